@@ -0,0 +1,134 @@
+/**
+ * Benchmark of coroutine memory and switch cost with dedicated
+ * and shared stacks. Each coroutine goes a few frames deep, then
+ * yields a number of times. Memory is sampled when all of them are
+ * alive and suspended in the middle of their work.
+ *
+ * Usage: ./bench_coro [shared|dedicated] [coroutines] [yields]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcoro.h"
+
+enum {
+	/** Stack for the dedicated mode, fits the test function. */
+	DEDICATED_STACK_SIZE = 16 * 1024,
+	/** How deep each coroutine goes before yielding. */
+	CALL_DEPTH = 4,
+};
+
+struct bench {
+	int coros;
+	int yields;
+	/** How many coroutines have reached the yield loop. */
+	int started;
+	/** Resident memory when all the coroutines are alive. */
+	long long rss_peak;
+	long long switches;
+};
+
+static long long
+rss_bytes(void)
+{
+	long long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lld %lld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+work(struct bench *b, int depth)
+{
+	/* Some frame to keep on the stack. */
+	volatile char pad[64];
+	pad[0] = depth;
+	if (depth > 0)
+		return work(b, depth - 1) + pad[0];
+	if (++b->started == b->coros)
+		b->rss_peak = rss_bytes();
+	for (int i = 0; i < b->yields; ++i)
+		coro_yield();
+	return 0;
+}
+
+static int
+coro_f_bench(void *arg)
+{
+	return work(arg, CALL_DEPTH);
+}
+
+/** Coroutine count, the mmap limit allows in the dedicated mode. */
+static int
+dedicated_limit(void)
+{
+	long long max_maps = 65530;
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lld", &max_maps) != 1)
+			max_maps = 65530;
+		fclose(f);
+	}
+	/* A stack and its guard page are 2 mappings. */
+	return (max_maps - 1000) / 2;
+}
+
+int
+main(int argc, char **argv)
+{
+	bool is_shared = argc <= 1 || strcmp(argv[1], "dedicated") != 0;
+	struct bench b;
+	memset(&b, 0, sizeof(b));
+	b.coros = argc > 2 ? atoi(argv[2]) : 1000000;
+	b.yields = argc > 3 ? atoi(argv[3]) : 10;
+	if (! is_shared && b.coros > dedicated_limit()) {
+		printf("dedicated stacks are limited by vm.max_map_count, "
+		       "using %d coroutines instead of %d\n",
+		       dedicated_limit(), b.coros);
+		b.coros = dedicated_limit();
+	}
+
+	coro_sched_init();
+	coro_set_stack_size(DEDICATED_STACK_SIZE);
+	long long rss_start = rss_bytes();
+	uint64_t start = now_ns();
+	for (int i = 0; i < b.coros; ++i) {
+		if (is_shared)
+			coro_new_shared(coro_f_bench, &b);
+		else
+			coro_new(coro_f_bench, &b);
+	}
+	uint64_t created = now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		b.switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	uint64_t finished = now_ns();
+
+	printf("%s stacks, %d coroutines, %d yields each\n",
+	       is_shared ? "shared" : "dedicated", b.coros, b.yields);
+	printf("create: %.3f s, %.0f ns per coroutine\n",
+	       (created - start) / 1e9, (double)(created - start) / b.coros);
+	printf("memory: %.1f MiB resident, %.0f bytes per coroutine\n",
+	       (b.rss_peak - rss_start) / 1048576.0,
+	       (double)(b.rss_peak - rss_start) / b.coros);
+	printf("run: %.3f s, %lld switches, %.1f ns per switch\n",
+	       (finished - created) / 1e9, b.switches,
+	       (double)(finished - created) / b.switches);
+	return 0;
+}
@@ -0,0 +1,281 @@
+/**
+ * Echo server benchmark for the libcoro event loop. One scheduler
+ * runs an acceptor, a handler coroutine per connection and a
+ * client coroutine per connection. Each client does a number of
+ * request-response round trips, and latencies are collected.
+ *
+ * Usage: ./bench_echo [unix|tcp] [clients] [round trips]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "libcoro.h"
+
+enum {
+	MSG_SIZE = 64,
+	/** Latency histogram bucket width in microseconds. */
+	HIST_BUCKET_US = 10,
+	/** Histogram covers up to 1 second, the rest is clamped. */
+	HIST_SIZE = 1000000 / HIST_BUCKET_US,
+};
+
+struct bench {
+	/** Address of the server. */
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int listen_fd;
+	int clients;
+	int round_trips;
+	/** How many connections are accepted so far. */
+	int accepted;
+	/** Round trip latency histogram. */
+	long long hist[HIST_SIZE];
+	long long rtt_count;
+	long long rtt_sum_ns;
+	long long errors;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Read exactly @a size bytes, waiting when needed. */
+static int
+read_full(int fd, char *buf, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t rc = read(fd, buf + done, size - done);
+		if (rc > 0) {
+			done += rc;
+		} else if (rc == 0) {
+			return done == 0 ? 0 : -1;
+		} else if (errno == EAGAIN) {
+			if (coro_wait_fd(fd, CORO_EV_READ,
+					 CORO_TIMEOUT_INFINITY) < 0)
+				return -1;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/** Write exactly @a size bytes, waiting when needed. */
+static int
+write_full(int fd, const char *buf, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t rc = write(fd, buf + done, size - done);
+		if (rc >= 0) {
+			done += rc;
+		} else if (errno == EAGAIN) {
+			if (coro_wait_fd(fd, CORO_EV_WRITE,
+					 CORO_TIMEOUT_INFINITY) < 0)
+				return -1;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+handler_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[MSG_SIZE];
+	while (read_full(fd, buf, sizeof(buf)) > 0) {
+		if (write_full(fd, buf, sizeof(buf)) != 0)
+			break;
+	}
+	close(fd);
+	return 0;
+}
+
+static int
+acceptor_f(void *arg)
+{
+	struct bench *b = arg;
+	while (b->accepted < b->clients) {
+		int fd = accept4(b->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd >= 0) {
+			++b->accepted;
+			coro_new(handler_f, (void *)(long)fd);
+		} else if (errno == EAGAIN) {
+			coro_wait_fd(b->listen_fd, CORO_EV_READ,
+				     CORO_TIMEOUT_INFINITY);
+		} else if (errno != EINTR && errno != ECONNABORTED) {
+			printf("accept failed: %s\n", strerror(errno));
+			exit(-1);
+		}
+	}
+	return 0;
+}
+
+static int
+client_connect(struct bench *b)
+{
+	while (true) {
+		int fd = socket(b->addr.ss_family,
+				SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd < 0)
+			return -1;
+		if (b->addr.ss_family == AF_INET) {
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+				   sizeof(one));
+		}
+		if (connect(fd, (struct sockaddr *)&b->addr,
+			    b->addr_len) == 0)
+			return fd;
+		if (errno == EINPROGRESS) {
+			coro_wait_fd(fd, CORO_EV_WRITE, CORO_TIMEOUT_INFINITY);
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err == 0)
+				return fd;
+			errno = err;
+		}
+		close(fd);
+		/* Listen queue is full, let the acceptor drain it. */
+		if (errno != EAGAIN && errno != ECONNREFUSED)
+			return -1;
+		coro_sleep(1000000);
+	}
+}
+
+static int
+client_f(void *arg)
+{
+	struct bench *b = arg;
+	int fd = client_connect(b);
+	if (fd < 0) {
+		++b->errors;
+		return -1;
+	}
+	char out[MSG_SIZE], in[MSG_SIZE];
+	memset(out, 'x', sizeof(out));
+	for (int i = 0; i < b->round_trips; ++i) {
+		uint64_t start = now_ns();
+		if (write_full(fd, out, sizeof(out)) != 0 ||
+		    read_full(fd, in, sizeof(in)) <= 0) {
+			++b->errors;
+			break;
+		}
+		uint64_t rtt = now_ns() - start;
+		uint64_t bucket = rtt / 1000 / HIST_BUCKET_US;
+		++b->hist[bucket < HIST_SIZE ? bucket : HIST_SIZE - 1];
+		++b->rtt_count;
+		b->rtt_sum_ns += rtt;
+	}
+	close(fd);
+	return 0;
+}
+
+static long long
+hist_percentile(const struct bench *b, double p)
+{
+	long long need = b->rtt_count * p;
+	long long seen = 0;
+	for (int i = 0; i < HIST_SIZE; ++i) {
+		seen += b->hist[i];
+		if (seen > need)
+			return (long long)i * HIST_BUCKET_US;
+	}
+	return (long long)HIST_SIZE * HIST_BUCKET_US;
+}
+
+static void
+bench_listen(struct bench *b, bool is_tcp)
+{
+	memset(&b->addr, 0, sizeof(b->addr));
+	if (is_tcp) {
+		struct sockaddr_in *in = (struct sockaddr_in *)&b->addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		b->addr_len = sizeof(*in);
+	} else {
+		struct sockaddr_un *un = (struct sockaddr_un *)&b->addr;
+		un->sun_family = AF_UNIX;
+		/* Abstract socket, nothing to clean up. */
+		int len = snprintf(un->sun_path + 1, sizeof(un->sun_path) - 1,
+				   "libcoro_bench_echo_%d", (int)getpid());
+		b->addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+	}
+	b->listen_fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK,
+			      0);
+	int one = 1;
+	setsockopt(b->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (b->listen_fd < 0 ||
+	    bind(b->listen_fd, (struct sockaddr *)&b->addr, b->addr_len) != 0 ||
+	    listen(b->listen_fd, SOMAXCONN) != 0) {
+		printf("listen failed: %s\n", strerror(errno));
+		exit(-1);
+	}
+	/* Learn the port, chosen by the kernel. */
+	getsockname(b->listen_fd, (struct sockaddr *)&b->addr, &b->addr_len);
+}
+
+int
+main(int argc, char **argv)
+{
+	bool is_tcp = argc > 1 && strcmp(argv[1], "tcp") == 0;
+	struct bench *b = calloc(1, sizeof(*b));
+	b->clients = argc > 2 ? atoi(argv[2]) : 10000;
+	b->round_trips = argc > 3 ? atoi(argv[3]) : 100;
+
+	/* Each connection takes 2 descriptors. */
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < (rlim_t)b->clients * 2 + 16) {
+		printf("too many clients for the descriptor limit %lld\n",
+		       (long long)rl.rlim_cur);
+		return -1;
+	}
+
+	coro_sched_init();
+	bench_listen(b, is_tcp);
+	uint64_t start = now_ns();
+	coro_new(acceptor_f, b);
+	for (int i = 0; i < b->clients; ++i)
+		coro_new(client_f, b);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double sec = (now_ns() - start) / 1e9;
+	close(b->listen_fd);
+
+	printf("%s, %d clients, %d round trips each, %lld errors\n",
+	       is_tcp ? "tcp" : "unix", b->clients, b->round_trips,
+	       b->errors);
+	printf("time %.3f s, %.0f round trips/s\n", sec, b->rtt_count / sec);
+	if (b->rtt_count > 0) {
+		printf("latency avg %.1f us, p50 %lld us, p99 %lld us, "
+		       "p99.9 %lld us\n",
+		       b->rtt_sum_ns / 1000.0 / b->rtt_count,
+		       hist_percentile(b, 0.5), hist_percentile(b, 0.99),
+		       hist_percentile(b, 0.999));
+	}
+	free(b);
+	return 0;
+}
@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "libcoro.h"
+#include "coro_chan.h"
+
+struct chan_select;
+
+/**
+ * A coroutine, waiting for a channel operation. One waiter per
+ * each operation of a select.
+ */
+struct chan_waiter {
+	/** Select this waiter belongs to. */
+	struct chan_select *sel;
+	/** Index of the operation in the select. */
+	int idx;
+	/** Channel queue the waiter is linked into. */
+	struct chan_queue *queue;
+	/** Element to send or a place for a received one. */
+	void *data;
+	/** Links in the channel waiter queue. */
+	struct chan_waiter *next, *prev;
+};
+
+/** State of a blocked select, shared by all its waiters. */
+struct chan_select {
+	/** Coroutine doing the select. */
+	struct coro *coro;
+	/** All the waiters of the select, one per operation. */
+	struct chan_waiter *waiters;
+	int count;
+	/** Index of the done operation, or -1. */
+	int done_idx;
+	/** Result of the done operation. */
+	int done_rc;
+};
+
+/** FIFO queue of waiters. */
+struct chan_queue {
+	struct chan_waiter *first, *last;
+};
+
+struct coro_chan {
+	/** Ring buffer of elements. */
+	char *buf;
+	size_t elem_size;
+	size_t capacity;
+	/** Index of the oldest element in the buffer. */
+	size_t head;
+	/** How many elements are in the buffer. */
+	size_t count;
+	bool is_closed;
+	/** Coroutines, waiting to send. */
+	struct chan_queue senders;
+	/** Coroutines, waiting to receive. */
+	struct chan_queue receivers;
+};
+
+static void
+chan_queue_add(struct chan_queue *q, struct chan_waiter *w)
+{
+	w->queue = q;
+	w->next = NULL;
+	w->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = w;
+	else
+		q->first = w;
+	q->last = w;
+}
+
+static void
+chan_queue_delete(struct chan_waiter *w)
+{
+	struct chan_queue *q = w->queue;
+	if (w->prev != NULL)
+		w->prev->next = w->next;
+	else
+		q->first = w->next;
+	if (w->next != NULL)
+		w->next->prev = w->prev;
+	else
+		q->last = w->prev;
+	w->queue = NULL;
+}
+
+/** Unlink all the waiters of a select from the channels. */
+static void
+chan_select_unlink(struct chan_select *sel)
+{
+	for (int i = 0; i < sel->count; ++i) {
+		if (sel->waiters[i].queue != NULL)
+			chan_queue_delete(&sel->waiters[i]);
+	}
+}
+
+/**
+ * Finish the select of the waiter with a result and wake its
+ * coroutine up. Its other waiters are dropped from their queues,
+ * so the select can't be done twice.
+ */
+static void
+chan_waiter_fire(struct chan_waiter *w, int rc)
+{
+	struct chan_select *sel = w->sel;
+	sel->done_idx = w->idx;
+	sel->done_rc = rc;
+	chan_select_unlink(sel);
+	coro_wakeup(sel->coro);
+}
+
+static inline char *
+chan_slot(struct coro_chan *ch, size_t i)
+{
+	return ch->buf + ((ch->head + i) % ch->capacity) * ch->elem_size;
+}
+
+static void
+chan_buf_push(struct coro_chan *ch, const void *data)
+{
+	memcpy(chan_slot(ch, ch->count), data, ch->elem_size);
+	++ch->count;
+}
+
+static void
+chan_buf_pop(struct coro_chan *ch, void *data)
+{
+	memcpy(data, chan_slot(ch, 0), ch->elem_size);
+	ch->head = (ch->head + 1) % ch->capacity;
+	--ch->count;
+}
+
+static bool
+chan_can_send(const struct coro_chan *ch)
+{
+	return ch->is_closed || ch->receivers.first != NULL ||
+	       ch->count < ch->capacity;
+}
+
+static bool
+chan_can_recv(const struct coro_chan *ch)
+{
+	return ch->is_closed || ch->count > 0 || ch->senders.first != NULL;
+}
+
+/** Send, when it is known not to block. */
+static int
+chan_do_send(struct coro_chan *ch, const void *data)
+{
+	if (ch->is_closed)
+		return CORO_CHAN_CLOSED;
+	struct chan_waiter *w = ch->receivers.first;
+	if (w != NULL) {
+		memcpy(w->data, data, ch->elem_size);
+		chan_waiter_fire(w, CORO_CHAN_OK);
+		return CORO_CHAN_OK;
+	}
+	chan_buf_push(ch, data);
+	return CORO_CHAN_OK;
+}
+
+/** Receive, when it is known not to block. */
+static int
+chan_do_recv(struct coro_chan *ch, void *data)
+{
+	struct chan_waiter *w = ch->senders.first;
+	if (ch->count > 0) {
+		chan_buf_pop(ch, data);
+		/* Freed space is taken by the oldest sender. */
+		if (w != NULL) {
+			chan_buf_push(ch, w->data);
+			chan_waiter_fire(w, CORO_CHAN_OK);
+		}
+		return CORO_CHAN_OK;
+	}
+	if (w != NULL) {
+		memcpy(data, w->data, ch->elem_size);
+		chan_waiter_fire(w, CORO_CHAN_OK);
+		return CORO_CHAN_OK;
+	}
+	return CORO_CHAN_CLOSED;
+}
+
+struct coro_chan *
+coro_chan_new(size_t elem_size, size_t capacity)
+{
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	ch->elem_size = elem_size;
+	ch->capacity = capacity;
+	if (capacity > 0)
+		ch->buf = malloc(elem_size * capacity);
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	free(ch->buf);
+	free(ch);
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	ch->is_closed = true;
+	while (ch->senders.first != NULL)
+		chan_waiter_fire(ch->senders.first, CORO_CHAN_CLOSED);
+	while (ch->receivers.first != NULL)
+		chan_waiter_fire(ch->receivers.first, CORO_CHAN_CLOSED);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, const void *data)
+{
+	struct coro_chan_op op = {ch, CORO_CHAN_SEND, (void *)data, 0};
+	if (coro_chan_select(&op, 1) < 0)
+		return CORO_CHAN_CLOSED;
+	return op.rc;
+}
+
+int
+coro_chan_send_timeout(struct coro_chan *ch, const void *data,
+		       uint64_t timeout_ns)
+{
+	struct coro_chan_op op = {ch, CORO_CHAN_SEND, (void *)data, 0};
+	if (ch == NULL) {
+		errno = EINVAL;
+		return CORO_CHAN_CLOSED;
+	}
+	if (coro_chan_select_timeout(&op, 1, timeout_ns) < 0)
+		return CORO_CHAN_TIMEOUT;
+	return op.rc;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void *data)
+{
+	struct coro_chan_op op = {ch, CORO_CHAN_RECV, data, 0};
+	if (coro_chan_select(&op, 1) < 0)
+		return CORO_CHAN_CLOSED;
+	return op.rc;
+}
+
+int
+coro_chan_recv_timeout(struct coro_chan *ch, void *data,
+		       uint64_t timeout_ns)
+{
+	struct coro_chan_op op = {ch, CORO_CHAN_RECV, data, 0};
+	if (ch == NULL) {
+		errno = EINVAL;
+		return CORO_CHAN_CLOSED;
+	}
+	if (coro_chan_select_timeout(&op, 1, timeout_ns) < 0)
+		return CORO_CHAN_TIMEOUT;
+	return op.rc;
+}
+
+int
+coro_chan_select(struct coro_chan_op *ops, int count)
+{
+	return coro_chan_select_timeout(ops, count, CORO_TIMEOUT_INFINITY);
+}
+
+int
+coro_chan_select_timeout(struct coro_chan_op *ops, int count,
+			 uint64_t timeout_ns)
+{
+	if (count <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (int i = 0; i < count; ++i) {
+		if (ops[i].chan == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	/* Fast path - something is ready right away. */
+	for (int i = 0; i < count; ++i) {
+		struct coro_chan_op *op = &ops[i];
+		if (op->type == CORO_CHAN_SEND && chan_can_send(op->chan)) {
+			op->rc = chan_do_send(op->chan, op->data);
+			return i;
+		}
+		if (op->type == CORO_CHAN_RECV && chan_can_recv(op->chan)) {
+			op->rc = chan_do_recv(op->chan, op->data);
+			return i;
+		}
+	}
+	if (timeout_ns == 0)
+		return -1;
+	/*
+	 * Slow path - wait on all the channels at once. The first
+	 * one to complete an operation unlinks the others. The wait
+	 * state and the elements are kept on the heap, because
+	 * other coroutines access them, and a stack of a shared
+	 * stack coroutine is not addressable while it is suspended.
+	 */
+	size_t size = sizeof(struct chan_select) +
+		      count * sizeof(struct chan_waiter);
+	for (int i = 0; i < count; ++i)
+		size += ops[i].chan->elem_size;
+	struct chan_select *sel = malloc(size);
+	struct chan_waiter *waiters = (struct chan_waiter *)(sel + 1);
+	char *elems = (char *)(waiters + count);
+	sel->coro = coro_this();
+	sel->waiters = waiters;
+	sel->count = count;
+	sel->done_idx = -1;
+	sel->done_rc = 0;
+	for (int i = 0; i < count; ++i) {
+		struct chan_waiter *w = &waiters[i];
+		struct coro_chan *ch = ops[i].chan;
+		w->sel = sel;
+		w->idx = i;
+		w->data = elems;
+		elems += ch->elem_size;
+		if (ops[i].type == CORO_CHAN_SEND) {
+			memcpy(w->data, ops[i].data, ch->elem_size);
+			chan_queue_add(&ch->senders, w);
+		} else {
+			chan_queue_add(&ch->receivers, w);
+		}
+	}
+	if (timeout_ns == CORO_TIMEOUT_INFINITY) {
+		while (sel->done_idx < 0)
+			coro_suspend();
+	} else {
+		uint64_t deadline = coro_now_ns() + timeout_ns;
+		uint64_t now;
+		while (sel->done_idx < 0 && (now = coro_now_ns()) < deadline)
+			coro_suspend_timeout(deadline - now);
+	}
+	int idx = sel->done_idx;
+	if (idx < 0) {
+		chan_select_unlink(sel);
+	} else {
+		struct coro_chan_op *op = &ops[idx];
+		op->rc = sel->done_rc;
+		if (op->type == CORO_CHAN_RECV && op->rc == CORO_CHAN_OK)
+			memcpy(op->data, waiters[idx].data, op->chan->elem_size);
+	}
+	free(sel);
+	return idx;
+}
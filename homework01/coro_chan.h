@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bounded channel to pass values between coroutines of one
+ * scheduler. Each channel transfers elements of one fixed size,
+ * copying them by value. A coroutine which can't send into a full
+ * channel or receive from an empty one is suspended until the
+ * other side makes progress, so pipelines of coroutines get a
+ * natural backpressure.
+ */
+struct coro_chan;
+
+/** Results of the channel operations. */
+enum {
+	CORO_CHAN_OK = 0,
+	CORO_CHAN_CLOSED = -1,
+	CORO_CHAN_TIMEOUT = -2,
+};
+
+/** Kind of an operation in coro_chan_select(). */
+enum coro_chan_op_type {
+	CORO_CHAN_SEND,
+	CORO_CHAN_RECV,
+};
+
+/** One operation for coro_chan_select(). */
+struct coro_chan_op {
+	/** Channel to work with. */
+	struct coro_chan *chan;
+	/** Send or receive. */
+	enum coro_chan_op_type type;
+	/**
+	 * Element to send, or a place for the received element.
+	 * Should be of the channel element size.
+	 */
+	void *data;
+	/**
+	 * Result of the operation, if it was chosen. CORO_CHAN_OK
+	 * on success, CORO_CHAN_CLOSED if the channel is closed.
+	 */
+	int rc;
+};
+
+/**
+ * Create a new channel.
+ * @param elem_size Size of one element in bytes.
+ * @param capacity How many elements can be buffered. 0 means
+ *     the sender waits until a receiver takes the element.
+ */
+struct coro_chan *
+coro_chan_new(size_t elem_size, size_t capacity);
+
+/**
+ * Free the channel. Nobody should be waiting on it. Elements,
+ * still buffered, are dropped.
+ */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Close the channel. New sends fail, receivers get the buffered
+ * elements and then fail too. All the waiting coroutines are
+ * woken up.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/**
+ * Send an element. Suspends the coroutine while the channel is
+ * full.
+ * @retval CORO_CHAN_OK Success.
+ * @retval CORO_CHAN_CLOSED The channel is closed, or NULL.
+ */
+int
+coro_chan_send(struct coro_chan *ch, const void *data);
+
+/**
+ * Like coro_chan_send(), but wait no longer than @a timeout_ns
+ * nanoseconds.
+ * @retval CORO_CHAN_TIMEOUT Nothing is sent, time is out.
+ */
+int
+coro_chan_send_timeout(struct coro_chan *ch, const void *data,
+		       uint64_t timeout_ns);
+
+/**
+ * Receive an element. Suspends the coroutine while the channel is
+ * empty.
+ * @retval CORO_CHAN_OK Success.
+ * @retval CORO_CHAN_CLOSED The channel is closed and has no more
+ *     elements, or it is NULL.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void *data);
+
+/**
+ * Like coro_chan_recv(), but wait no longer than @a timeout_ns
+ * nanoseconds.
+ * @retval CORO_CHAN_TIMEOUT Nothing is received, time is out.
+ */
+int
+coro_chan_recv_timeout(struct coro_chan *ch, void *data,
+		       uint64_t timeout_ns);
+
+/**
+ * Wait until any of the operations can be done, and do exactly
+ * one of them. If several are ready right away, the first one in
+ * the array is chosen.
+ * @param ops Operations to wait for.
+ * @param count Size of @a ops.
+ *
+ * @retval >= 0 Index of the done operation. Its rc is set.
+ * @retval -1 @a count is not positive or a channel is NULL, errno
+ *     is EINVAL.
+ */
+int
+coro_chan_select(struct coro_chan_op *ops, int count);
+
+/**
+ * Like coro_chan_select(), but wait no longer than @a timeout_ns
+ * nanoseconds.
+ * @retval >= 0 Index of the done operation.
+ * @retval -1 Time is out, no operation is done. Or the arguments
+ *     are invalid, like in coro_chan_select().
+ */
+int
+coro_chan_select_timeout(struct coro_chan_op *ops, int count,
+			 uint64_t timeout_ns);
@@ -5,16 +5,101 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+enum {
+	/** Resolution of the timers. */
+	TIMER_TICK_NS = 1000000,
+	/** Each wheel level has 2^TIMER_WHEEL_BITS slots. */
+	TIMER_WHEEL_BITS = 6,
+	TIMER_WHEEL_SIZE = 1 << TIMER_WHEEL_BITS,
+	TIMER_WHEEL_MASK = TIMER_WHEEL_SIZE - 1,
+	/**
+	 * Levels cover 64 ticks, 64^2, 64^3 and 64^4 ticks, which
+	 * is about 4.6 hours. Longer timers are parked in the last
+	 * slot and re-added when it is cascaded.
+	 */
+	TIMER_WHEEL_LEVELS = 4,
+	/** How many epoll events are fetched at once. */
+	EPOLL_BATCH_SIZE = 128,
+};
+
+/** A timer, waking a suspended coroutine up. */
+struct coro_timer {
+	/** Tick, when the timer should fire. */
+	uint64_t expire;
+	/** True, if the timer is in the wheel. */
+	bool is_active;
+	/** Wheel slot, where the timer is linked. */
+	struct coro_timer **slot;
+	/** Links in a wheel slot. */
+	struct coro_timer *next, *prev;
+};
+
+/** A coroutine, waiting for a file descriptor in coro_wait_fd(). */
+struct coro_fd_waiter {
+	struct coro *coro;
+	/** CORO_EV_* events to wait for. */
+	int events;
+	/** Happened events, 0 while waiting. */
+	int revents;
+	/** Links in the file descriptor waiter list. */
+	struct coro_fd_waiter *next, *prev;
+};
+
+/** State of one file descriptor in the event loop. */
+struct coro_fd_watch {
+	/** Coroutines, waiting for the descriptor. */
+	struct coro_fd_waiter *waiters;
+	/**
+	 * CORO_EV_* events the descriptor is armed for in epoll. It
+	 * is one-shot, so after an event it is 0 until re-armed.
+	 */
+	int armed;
+	/** True, if the descriptor was added to epoll. */
+	bool is_registered;
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
-	/** Stack, used by the coroutine. */
+	/**
+	 * Stack mapping, used by the coroutine. Its lowest page is a
+	 * guard, the rest is populated by the kernel on first touch.
+	 */
 	void *stack;
+	/** Size of the stack mapping including the guard page. */
+	size_t stack_size;
+	/**
+	 * True, if the coroutine has no own stack and runs on the
+	 * shared one.
+	 */
+	bool is_shared;
+	/**
+	 * True, if the shared stack coroutine has not run yet. It
+	 * is started from a copy of the template context.
+	 */
+	bool is_new;
+	/**
+	 * Lowest address of the live part of the shared stack, when
+	 * the coroutine was switched out.
+	 */
+	char *stack_sp;
+	/**
+	 * Live part of the shared stack, copied out when another
+	 * coroutine needs the shared stack.
+	 */
+	char *save;
+	size_t save_size;
+	size_t save_capacity;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
@@ -23,7 +108,19 @@ struct coro {
 	sigjmp_buf ctx;
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	/**
+	 * True, if the coroutine is suspended and is not in the
+	 * scheduler list until somebody wakes it up.
+	 */
+	bool is_suspended;
 	long long switch_count;
+	/** Timer for coro_suspend_timeout(). */
+	struct coro_timer timer;
+	/**
+	 * Wait state of coro_wait_fd(). It is not on the stack, as
+	 * stacks of shared stack coroutines move.
+	 */
+	struct coro_fd_waiter fd_waiter;
 	/** Links in the coroutine list, used by scheduler. */
 	struct coro *next, *prev;
 };
@@ -40,14 +137,78 @@ static struct coro coro_sched;
 static bool is_sched_waiting = false;
 /** Which coroutine works at this moment. */
 static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
+/**
+ * List of the coroutines, which are ready to run. Suspended and
+ * finished ones are not here.
+ */
 static struct coro *coro_list = NULL;
+/**
+ * Finished coroutines, not yet returned by the scheduler. Linked
+ * via 'next'.
+ */
+static struct coro *coro_finished_list = NULL;
+/** How many coroutines are suspended and wait for a wakeup. */
+static int coro_suspended_count = 0;
 /**
  * Buffer, used by the coroutine constructor to escape from the
  * signal handler back into the constructor to rollback
  * sigaltstack etc.
  */
 static sigjmp_buf start_point;
+/**
+ * Hierarchical timer wheel. Level 0 slots hold timers for the
+ * nearest ticks, one slot per tick. Each next level slot covers
+ * the whole previous level, and is cascaded down into it when the
+ * previous level makes a full turn.
+ */
+static struct coro_timer *timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+/** Next tick to be processed by the wheel. */
+static uint64_t timer_next_tick = 0;
+/** How many timers are in the wheel. */
+static int timer_count = 0;
+/** Stack size of new coroutines, without the guard page. */
+static size_t coro_default_stack_size = 1024 * 1024;
+/**
+ * Stack, shared by all the coroutines created with
+ * coro_new_shared(). Only one of them can have its frames there
+ * at a time - the owner. Others keep their frames copied out.
+ */
+static char *shared_stack = NULL;
+static size_t shared_stack_size = 0;
+/**
+ * Top of the live part of the shared stack. Everything above is
+ * the signal frame of the template context, which is never
+ * needed again.
+ */
+static char *shared_stack_top = NULL;
+/** Coroutine whose frames are on the shared stack now. */
+static struct coro *shared_stack_owner = NULL;
+/**
+ * Template context on the shared stack, from which all shared
+ * stack coroutines start. It is a copy of the same frame, so new
+ * coroutines are created without any syscalls.
+ */
+static sigjmp_buf shared_template_ctx;
+static char *shared_template;
+static size_t shared_template_size;
+/** Coroutine to be started from the template context. */
+static struct coro *shared_starting = NULL;
+/**
+ * A tiny context on its own stack, used to copy frames in and out
+ * of the shared stack. It can't be done while running on the
+ * shared stack itself.
+ */
+static sigjmp_buf shared_switch_ctx;
+static void *shared_switch_stack = NULL;
+/** Where to go after the shared stack is prepared. */
+static struct coro *shared_switch_target = NULL;
+/** Epoll instance of the event loop, created on first need. */
+static int coro_epoll_fd = -1;
+/** Event loop state of file descriptors, indexed by fd. */
+static struct coro_fd_watch *fd_watches = NULL;
+static int fd_watch_capacity = 0;
+/** How many coroutines are waiting for file descriptors. */
+static int fd_waiter_count = 0;
 
 /** Add a new coroutine to the beginning of the list. */
 static void
@@ -73,6 +234,351 @@ coro_list_delete(struct coro *c)
 		coro_list = next;
 }
 
+uint64_t
+coro_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Current monotonic time in ticks, rounded down. */
+static uint64_t
+timer_now_tick(void)
+{
+	return coro_now_ns() / TIMER_TICK_NS;
+}
+
+/** Put a timer into a slot, matching its distance to now. */
+static void
+timer_wheel_link(struct coro_timer *t)
+{
+	uint64_t expire = t->expire;
+	if (expire < timer_next_tick)
+		expire = timer_next_tick;
+	uint64_t delta = expire - timer_next_tick;
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+	       delta >= (uint64_t)1 << ((level + 1) * TIMER_WHEEL_BITS))
+		++level;
+	int shift = level * TIMER_WHEEL_BITS;
+	if (delta >= (uint64_t)1 << ((level + 1) * TIMER_WHEEL_BITS)) {
+		/* Too far. Parked, will be re-added on cascade. */
+		expire = timer_next_tick +
+			 ((uint64_t)1 << (TIMER_WHEEL_LEVELS *
+					  TIMER_WHEEL_BITS)) - 1;
+	}
+	struct coro_timer **slot =
+		&timer_wheel[level][(expire >> shift) & TIMER_WHEEL_MASK];
+	t->slot = slot;
+	t->prev = NULL;
+	t->next = *slot;
+	if (*slot != NULL)
+		(*slot)->prev = t;
+	*slot = t;
+}
+
+static void
+coro_timer_add(struct coro_timer *t, uint64_t expire)
+{
+	t->expire = expire;
+	t->is_active = true;
+	++timer_count;
+	timer_wheel_link(t);
+}
+
+static void
+coro_timer_delete(struct coro_timer *t)
+{
+	if (! t->is_active)
+		return;
+	if (t->prev != NULL)
+		t->prev->next = t->next;
+	else
+		*t->slot = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	t->is_active = false;
+	--timer_count;
+}
+
+/**
+ * Move all timers of a slot one level down. Returns index of the
+ * slot to let the caller know if the level has made a full turn.
+ */
+static int
+timer_wheel_cascade(int level)
+{
+	int shift = level * TIMER_WHEEL_BITS;
+	int idx = (timer_next_tick >> shift) & TIMER_WHEEL_MASK;
+	struct coro_timer *t = timer_wheel[level][idx];
+	timer_wheel[level][idx] = NULL;
+	while (t != NULL) {
+		struct coro_timer *next = t->next;
+		timer_wheel_link(t);
+		t = next;
+	}
+	return idx;
+}
+
+static void
+coro_timer_fire(struct coro_timer *t)
+{
+	struct coro *c = (struct coro *)((char *)t -
+					 offsetof(struct coro, timer));
+	t->is_active = false;
+	--timer_count;
+	coro_wakeup(c);
+}
+
+/** Process all the ticks up to @a now, firing expired timers. */
+static void
+timer_wheel_advance(uint64_t now)
+{
+	while (timer_next_tick <= now) {
+		if (timer_count == 0) {
+			timer_next_tick = now + 1;
+			return;
+		}
+		int idx = timer_next_tick & TIMER_WHEEL_MASK;
+		for (int l = 1; idx == 0 && l < TIMER_WHEEL_LEVELS; ++l)
+			idx = timer_wheel_cascade(l);
+		idx = timer_next_tick & TIMER_WHEEL_MASK;
+		++timer_next_tick;
+		struct coro_timer *t = timer_wheel[0][idx];
+		timer_wheel[0][idx] = NULL;
+		while (t != NULL) {
+			struct coro_timer *next = t->next;
+			coro_timer_fire(t);
+			t = next;
+		}
+	}
+}
+
+/**
+ * The earliest tick when the wheel might have something to do.
+ * For level 0 it is exact, for upper levels - when their
+ * nearest non-empty slot is cascaded.
+ */
+static uint64_t
+timer_wheel_next_event(void)
+{
+	uint64_t best = UINT64_MAX;
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+		int shift = l * TIMER_WHEEL_BITS;
+		uint64_t base = timer_next_tick >> shift;
+		for (int i = 0; i < TIMER_WHEEL_SIZE; ++i) {
+			if (timer_wheel[l][i] == NULL)
+				continue;
+			uint64_t tick = (base & ~(uint64_t)TIMER_WHEEL_MASK) | i;
+			if ((tick << shift) < timer_next_tick)
+				tick += TIMER_WHEEL_SIZE;
+			tick <<= shift;
+			if (tick < best)
+				best = tick;
+		}
+	}
+	return best;
+}
+
+/** Block the whole thread until the nearest timer event. */
+static void
+timer_wheel_sleep(void)
+{
+	uint64_t tick = timer_wheel_next_event();
+	uint64_t ns = tick * TIMER_TICK_NS;
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR);
+}
+
+/** Translate CORO_EV_* events to epoll ones. */
+static uint32_t
+coro_ev_to_epoll(int events)
+{
+	uint32_t res = 0;
+	if ((events & CORO_EV_READ) != 0)
+		res |= EPOLLIN;
+	if ((events & CORO_EV_WRITE) != 0)
+		res |= EPOLLOUT;
+	return res;
+}
+
+/** Translate epoll events to CORO_EV_* ones. */
+static int
+coro_ev_from_epoll(uint32_t events)
+{
+	int res = 0;
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLPRI)) != 0)
+		res |= CORO_EV_READ;
+	if ((events & EPOLLOUT) != 0)
+		res |= CORO_EV_WRITE;
+	if ((events & (EPOLLERR | EPOLLHUP)) != 0)
+		res |= CORO_EV_ERROR;
+	return res;
+}
+
+/**
+ * Arm the descriptor in epoll for all the events its waiters
+ * need. Nothing is done if it is already armed for them.
+ */
+static int
+fd_watch_arm(int fd)
+{
+	struct coro_fd_watch *watch = &fd_watches[fd];
+	int events = 0;
+	for (struct coro_fd_waiter *w = watch->waiters; w != NULL; w = w->next)
+		events |= w->events;
+	if (events == 0 || (events & ~watch->armed) == 0)
+		return 0;
+	struct epoll_event ev;
+	ev.events = coro_ev_to_epoll(events) | EPOLLONESHOT;
+	ev.data.fd = fd;
+	/*
+	 * The descriptor could be closed and reopened behind the
+	 * scheduler's back, so the registration flag is only a
+	 * hint. Epoll knows better.
+	 */
+	int op = watch->is_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	int rc = epoll_ctl(coro_epoll_fd, op, fd, &ev);
+	if (rc != 0 && op == EPOLL_CTL_MOD && errno == ENOENT)
+		rc = epoll_ctl(coro_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	else if (rc != 0 && op == EPOLL_CTL_ADD && errno == EEXIST)
+		rc = epoll_ctl(coro_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	if (rc != 0)
+		return -1;
+	watch->is_registered = true;
+	watch->armed = events;
+	return 0;
+}
+
+static void
+fd_watch_unlink(int fd, struct coro_fd_waiter *w)
+{
+	if (w->prev != NULL)
+		w->prev->next = w->next;
+	else
+		fd_watches[fd].waiters = w->next;
+	if (w->next != NULL)
+		w->next->prev = w->prev;
+	--fd_waiter_count;
+}
+
+/**
+ * Fetch ready descriptors from epoll and wake up their waiters.
+ * @param timeout_ms How long to block, -1 is infinity.
+ */
+static void
+coro_io_poll(int timeout_ms)
+{
+	struct epoll_event events[EPOLL_BATCH_SIZE];
+	int count = epoll_wait(coro_epoll_fd, events, EPOLL_BATCH_SIZE,
+			       timeout_ms);
+	for (int i = 0; i < count; ++i) {
+		int fd = events[i].data.fd;
+		int revents = coro_ev_from_epoll(events[i].events);
+		struct coro_fd_watch *watch = &fd_watches[fd];
+		watch->armed = 0;
+		struct coro_fd_waiter *w = watch->waiters;
+		while (w != NULL) {
+			struct coro_fd_waiter *next = w->next;
+			int got = revents & (w->events | CORO_EV_ERROR);
+			if (got != 0) {
+				w->revents = got;
+				fd_watch_unlink(fd, w);
+				coro_wakeup(w->coro);
+			}
+			w = next;
+		}
+		/* The rest still wait for other events. */
+		if (watch->waiters != NULL && fd_watch_arm(fd) != 0) {
+			while ((w = watch->waiters) != NULL) {
+				w->revents = CORO_EV_ERROR;
+				fd_watch_unlink(fd, w);
+				coro_wakeup(w->coro);
+			}
+		}
+	}
+}
+
+/**
+ * Block the whole thread until the nearest timer event or a file
+ * descriptor event, whichever comes first.
+ */
+static void
+coro_sched_block(void)
+{
+	uint64_t tick = timer_wheel_next_event();
+	if (fd_waiter_count == 0) {
+		timer_wheel_sleep();
+		return;
+	}
+	int timeout_ms = -1;
+	if (tick != UINT64_MAX) {
+		uint64_t now = coro_now_ns();
+		uint64_t at = tick * TIMER_TICK_NS;
+		if (at <= now)
+			timeout_ms = 0;
+		else
+			timeout_ms = (at - now + 999999) / 1000000;
+	}
+	coro_io_poll(timeout_ms);
+}
+
+int
+coro_wait_fd(int fd, int events, uint64_t timeout_ns)
+{
+	if (coro_epoll_fd < 0) {
+		coro_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (coro_epoll_fd < 0)
+			return -1;
+	}
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (fd >= fd_watch_capacity) {
+		int new_capacity = fd_watch_capacity == 0 ? 64 :
+				   fd_watch_capacity;
+		while (new_capacity <= fd)
+			new_capacity *= 2;
+		fd_watches = realloc(fd_watches,
+				     new_capacity * sizeof(*fd_watches));
+		memset(fd_watches + fd_watch_capacity, 0,
+		       (new_capacity - fd_watch_capacity) *
+		       sizeof(*fd_watches));
+		fd_watch_capacity = new_capacity;
+	}
+	struct coro_fd_waiter *w = &coro_this_ptr->fd_waiter;
+	w->coro = coro_this_ptr;
+	w->events = events;
+	w->revents = 0;
+	w->prev = NULL;
+	w->next = fd_watches[fd].waiters;
+	if (w->next != NULL)
+		w->next->prev = w;
+	fd_watches[fd].waiters = w;
+	++fd_waiter_count;
+	if (fd_watch_arm(fd) != 0) {
+		fd_watch_unlink(fd, w);
+		return -1;
+	}
+	if (timeout_ns == CORO_TIMEOUT_INFINITY) {
+		while (w->revents == 0)
+			coro_suspend();
+		return w->revents;
+	}
+	uint64_t deadline = coro_now_ns() + timeout_ns;
+	uint64_t now;
+	while (w->revents == 0 && (now = coro_now_ns()) < deadline)
+		coro_suspend_timeout(deadline - now);
+	if (w->revents == 0)
+		fd_watch_unlink(fd, w);
+	return w->revents;
+}
+
 int
 coro_status(const struct coro *c)
 {
@@ -91,21 +597,127 @@ coro_is_finished(const struct coro *c)
 	return c->is_finished;
 }
 
+size_t
+coro_stack_usage(const struct coro *c)
+{
+	if (c->is_shared)
+		return c->save_capacity;
+	if (c->stack == NULL)
+		return 0;
+	/*
+	 * The stack grows down, and its pages become resident only
+	 * when touched. So the lowest resident page is the deepest
+	 * point the stack has ever reached.
+	 */
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	char *begin = (char *)c->stack + page_size;
+	size_t page_count = (c->stack_size - page_size) / page_size;
+	unsigned char *vec = malloc(page_count);
+	size_t usage = 0;
+	if (mincore(begin, page_count * page_size, vec) == 0) {
+		for (size_t i = 0; i < page_count; ++i) {
+			if ((vec[i] & 1) != 0) {
+				usage = (page_count - i) * page_size;
+				break;
+			}
+		}
+	}
+	free(vec);
+	return usage;
+}
+
+size_t
+coro_stack_size(const struct coro *c)
+{
+	if (c->is_shared)
+		return shared_stack_top - shared_stack - sysconf(_SC_PAGESIZE);
+	if (c->stack == NULL)
+		return 0;
+	return c->stack_size - sysconf(_SC_PAGESIZE);
+}
+
+void
+coro_set_stack_size(size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+	coro_default_stack_size = (size + page_size - 1) / page_size * page_size;
+}
+
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	if (c->is_shared) {
+		if (shared_stack_owner == c)
+			shared_stack_owner = NULL;
+		free(c->save);
+	} else {
+		munmap(c->stack, c->stack_size);
+	}
 	free(c);
 }
 
+/**
+ * An address below the current stack frame. Everything the
+ * caller needs on the stack is above it.
+ */
+static __attribute__((noinline)) char *
+coro_stack_pointer(void)
+{
+	return __builtin_frame_address(0);
+}
+
+/**
+ * Runs on the switch context stack. Copies the owner frames out of
+ * the shared stack, copies the target frames in, and jumps to the
+ * target.
+ */
+static void __attribute__((noreturn))
+coro_shared_switch(void)
+{
+	struct coro *to = shared_switch_target;
+	struct coro *owner = shared_stack_owner;
+	if (owner != NULL && ! owner->is_finished) {
+		size_t size = shared_stack_top - owner->stack_sp;
+		if (size > owner->save_capacity) {
+			owner->save = realloc(owner->save, size);
+			owner->save_capacity = size;
+		}
+		memcpy(owner->save, owner->stack_sp, size);
+		owner->save_size = size;
+	}
+	shared_stack_owner = to;
+	if (to->is_new) {
+		to->is_new = false;
+		shared_starting = to;
+		memcpy(shared_stack_top - shared_template_size,
+		       shared_template, shared_template_size);
+		siglongjmp(shared_template_ctx, 1);
+	}
+	memcpy(shared_stack_top - to->save_size, to->save, to->save_size);
+	siglongjmp(to->ctx, 1);
+}
+
 /** Switch the current coroutine to an arbitrary one. */
 static void
 coro_yield_to(struct coro *to)
 {
 	struct coro *from = coro_this_ptr;
 	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
+	if (from->is_shared)
+		from->stack_sp = coro_stack_pointer();
+	if (sigsetjmp(from->ctx, 0) == 0) {
+		if (to->is_shared && shared_stack_owner != to) {
+			/*
+			 * The current frames might be on the shared
+			 * stack, so it is rewritten from another one.
+			 */
+			shared_switch_target = to;
+			siglongjmp(shared_switch_ctx, 1);
+		}
 		siglongjmp(to->ctx, 1);
+	}
 	coro_this_ptr = from;
 }
 
@@ -120,22 +732,92 @@ coro_yield(void)
 		coro_yield_to(to);
 }
 
+void
+coro_suspend(void)
+{
+	struct coro *c = coro_this_ptr;
+	if (c == &coro_sched) {
+		printf("Critical error - the scheduler can't suspend!\n");
+		exit(-1);
+	}
+	struct coro *to = c->next;
+	coro_list_delete(c);
+	c->is_suspended = true;
+	++coro_suspended_count;
+	if (to == NULL)
+		coro_yield_to(&coro_sched);
+	else
+		coro_yield_to(to);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	if (! c->is_suspended)
+		return;
+	c->is_suspended = false;
+	--coro_suspended_count;
+	coro_list_add(c);
+}
+
+bool
+coro_suspend_timeout(uint64_t timeout_ns)
+{
+	struct coro *c = coro_this_ptr;
+	if (timeout_ns == CORO_TIMEOUT_INFINITY) {
+		coro_suspend();
+		return false;
+	}
+	uint64_t deadline = coro_now_ns() + timeout_ns;
+	timer_wheel_advance(timer_now_tick());
+	/* Round up, the coroutine never wakes earlier than asked. */
+	coro_timer_add(&c->timer, (deadline + TIMER_TICK_NS - 1) / TIMER_TICK_NS);
+	coro_suspend();
+	if (! c->timer.is_active)
+		return true;
+	coro_timer_delete(&c->timer);
+	return false;
+}
+
+void
+coro_sleep(uint64_t ns)
+{
+	uint64_t deadline = coro_now_ns() + ns;
+	uint64_t now;
+	while ((now = coro_now_ns()) < deadline)
+		coro_suspend_timeout(deadline - now);
+}
+
 void
 coro_sched_init(void)
 {
 	memset(&coro_sched, 0, sizeof(coro_sched));
 	coro_this_ptr = &coro_sched;
+	timer_next_tick = timer_now_tick();
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
+	while (coro_list != NULL || coro_suspended_count > 0 ||
+	       coro_finished_list != NULL) {
+		timer_wheel_advance(timer_now_tick());
+		if (fd_waiter_count > 0)
+			coro_io_poll(0);
+		if (coro_finished_list != NULL) {
+			struct coro *c = coro_finished_list;
+			coro_finished_list = c->next;
+			return c;
+		}
+		if (coro_list == NULL) {
+			if (timer_count > 0 || fd_waiter_count > 0) {
+				/* Only sleepers and IO waiters are left. */
+				coro_sched_block();
+				continue;
 			}
+			printf("Critical error - all coroutines are suspended, "
+			       "nobody can wake them up!\n");
+			exit(-1);
 		}
 		is_sched_waiting = true;
 		coro_yield_to(coro_list);
@@ -150,6 +832,25 @@ coro_this(void)
 	return coro_this_ptr;
 }
 
+/**
+ * Move the current coroutine to the finished ones, and go to the
+ * scheduler to let it return this coroutine to the user.
+ */
+static void __attribute__((noreturn))
+coro_finish(struct coro *c)
+{
+	c->is_finished = true;
+	coro_list_delete(c);
+	c->next = coro_finished_list;
+	coro_finished_list = c;
+	/* Can not return - 'ret' address is invalid already! */
+	if (! is_sched_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	siglongjmp(coro_sched.ctx, 1);
+}
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -174,28 +875,54 @@ coro_body(int signum)
 	 */
 	coro_this_ptr = c;
 	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_finish(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Body of the template context on the shared stack. Each shared
+ * stack coroutine starts here, with its own copy of this frame.
+ */
+static void
+coro_shared_body(int signum)
+{
+	(void)signum;
+	/*
+	 * The frame of this function is all what the coroutines
+	 * need. The signal frame above it is dead after start.
+	 */
+	shared_stack_top = (char *)__builtin_frame_address(0) +
+			   2 * sizeof(void *);
+	shared_template = coro_stack_pointer();
+	coro_this_ptr = NULL;
+	if (sigsetjmp(shared_template_ctx, 0) == 0)
+		siglongjmp(start_point, 1);
+	struct coro *c = shared_starting;
+	coro_this_ptr = c;
+	c->ret = c->func(c->func_arg);
+	shared_stack_owner = NULL;
+	coro_finish(c);
+}
+
+/** Body of the shared stack switch context. */
+static void
+coro_switch_body(int signum)
+{
+	(void)signum;
+	coro_this_ptr = NULL;
+	if (sigsetjmp(shared_switch_ctx, 0) == 0)
+		siglongjmp(start_point, 1);
+	coro_shared_switch();
+}
+
+/**
+ * Run @a body as a signal handler on the given stack. The body
+ * remembers its context, sets coro_this_ptr to NULL and jumps back
+ * here via start_point. Afterwards the stack belongs to the saved
+ * context and can be used only by it.
+ */
+static void
+coro_stack_init(void *stack, size_t stack_size, void (*body)(int))
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -211,28 +938,25 @@ coro_new(coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
+	newsa.sa_handler = body;
 	newsa.sa_flags = SA_ONSTACK;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
+	newst.ss_sp = stack;
 	newst.ss_size = stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
 		while (coro_this_ptr != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -251,8 +975,102 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+}
+
+/** Map a stack with a guard page at its bottom. */
+static void *
+coro_stack_map(size_t size)
+{
+	/*
+	 * The stack is only reserved. Shallow coroutines touch just
+	 * a few pages of it, the rest never takes physical memory.
+	 */
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	void *stack = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			   MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		handle_error();
+	/* Overflow crashes instead of corrupting a neighbour. */
+	if (mprotect(stack, page_size, PROT_NONE) != 0)
+		handle_error();
+	return stack;
+}
+
+static struct coro *
+coro_alloc(coro_f func, void *func_arg)
+{
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	c->ret = 0;
+	c->stack = NULL;
+	c->stack_size = 0;
+	c->is_shared = false;
+	c->is_new = false;
+	c->stack_sp = NULL;
+	c->save = NULL;
+	c->save_size = 0;
+	c->save_capacity = 0;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_finished = false;
+	c->is_suspended = false;
+	c->switch_count = 0;
+	c->timer.is_active = false;
+	return c;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	struct coro *c = coro_alloc(func, func_arg);
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	c->stack_size = coro_default_stack_size + page_size;
+	c->stack = coro_stack_map(coro_default_stack_size);
+	struct coro *old_this = coro_this_ptr;
+	coro_this_ptr = c;
+	coro_stack_init((char *)c->stack + page_size,
+			coro_default_stack_size, coro_body);
+	coro_this_ptr = old_this;
 
 	/* Now scheduler can work with that coroutine. */
 	coro_list_add(c);
 	return c;
 }
+
+/** Create the shared stack with its template and switch contexts. */
+static void
+coro_shared_stack_init(void)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t switch_stack_size = SIGSTKSZ < 64 * 1024 ? 64 * 1024 :
+				   SIGSTKSZ;
+	shared_stack_size = coro_default_stack_size;
+	shared_stack = coro_stack_map(shared_stack_size);
+	shared_switch_stack = coro_stack_map(switch_stack_size);
+	struct coro *old_this = coro_this_ptr;
+	coro_this_ptr = &coro_sched;
+	coro_stack_init(shared_stack + page_size, shared_stack_size,
+			coro_shared_body);
+	coro_this_ptr = &coro_sched;
+	coro_stack_init((char *)shared_switch_stack + page_size,
+			switch_stack_size, coro_switch_body);
+	coro_this_ptr = old_this;
+	/* Remember the template frame to start coroutines from it. */
+	char *template = shared_template;
+	shared_template_size = shared_stack_top - template;
+	shared_template = malloc(shared_template_size);
+	memcpy(shared_template, template, shared_template_size);
+	shared_stack_owner = NULL;
+}
+
+struct coro *
+coro_new_shared(coro_f func, void *func_arg)
+{
+	if (shared_stack == NULL)
+		coro_shared_stack_init();
+	struct coro *c = coro_alloc(func, func_arg);
+	c->is_shared = true;
+	c->is_new = true;
+	coro_list_add(c);
+	return c;
+}
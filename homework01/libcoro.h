@@ -1,17 +1,34 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
+/** Timeout, which never expires. */
+#define CORO_TIMEOUT_INFINITY UINT64_MAX
+
+/** Events for coro_wait_fd(). */
+enum {
+	/** The descriptor is readable, or has hung up. */
+	CORO_EV_READ = 1,
+	/** The descriptor is writable. */
+	CORO_EV_WRITE = 2,
+	/** An error happened on the descriptor. Always reported. */
+	CORO_EV_ERROR = 4,
+};
+
 /** Make current context scheduler. */
 void
 coro_sched_init(void);
 
 /**
  * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * if no coroutines. When all the coroutines are sleeping or
+ * waiting for file descriptors, the thread blocks in epoll until
+ * the nearest timer or descriptor event.
  */
 struct coro *
 coro_sched_wait(void);
@@ -27,6 +44,20 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Create a new coroutine without an own stack. It runs on the
+ * stack, shared by all such coroutines. When another one needs
+ * the shared stack, the live frames are copied out into a compact
+ * buffer, and back on resume. It trades copying on each switch
+ * for memory: a suspended coroutine costs only its real stack
+ * depth. Creation does no syscalls.
+ *
+ * Pointers to stack variables of such a coroutine are valid only
+ * while it runs, they can't be passed to other coroutines.
+ */
+struct coro *
+coro_new_shared(coro_f func, void *func_arg);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -38,6 +69,30 @@ coro_switch_count(const struct coro *c);
 bool
 coro_is_finished(const struct coro *c);
 
+/**
+ * Set stack size of the coroutines created after this call.
+ * Rounded up to the page size. The default is 1 MiB. The stack
+ * is only reserved, pages are populated on first touch.
+ */
+void
+coro_set_stack_size(size_t size);
+
+/**
+ * Stack size of the coroutine, not counting the guard page. For
+ * shared stack coroutines it is the shared stack size.
+ */
+size_t
+coro_stack_size(const struct coro *c);
+
+/**
+ * Stack high-water mark of the coroutine - how deep its stack
+ * has ever been, with the page granularity. Can be used to pick
+ * a stack size via coro_set_stack_size(). For shared stack
+ * coroutines it is the biggest saved frames size in bytes.
+ */
+size_t
+coro_stack_usage(const struct coro *c);
+
 /** Free coroutine stack and it itself. */
 void
 coro_delete(struct coro *c);
@@ -45,3 +100,56 @@ coro_delete(struct coro *c);
 /** Switch to another not finished coroutine. */
 void
 coro_yield(void);
+
+/**
+ * Suspend the current coroutine until coro_wakeup() is called on
+ * it. Unlike coro_yield() the coroutine is not scheduled at all
+ * meanwhile, so waiting costs nothing. Can't be called by the
+ * scheduler.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Make a suspended coroutine ready to run again. It does not
+ * switch to it, only puts it back into the scheduler. Does
+ * nothing for not suspended coroutines.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Like coro_suspend(), but wake up by itself after @a timeout_ns
+ * nanoseconds, if nobody did it before. Timers have a millisecond
+ * resolution, and never fire earlier than asked.
+ * @retval true The timeout has expired.
+ * @retval false The coroutine was woken up by coro_wakeup().
+ */
+bool
+coro_suspend_timeout(uint64_t timeout_ns);
+
+/** Current monotonic time in nanoseconds, the clock of the timeouts. */
+uint64_t
+coro_now_ns(void);
+
+/** Suspend the current coroutine for @a ns nanoseconds. */
+void
+coro_sleep(uint64_t ns);
+
+/**
+ * Suspend the current coroutine until the file descriptor is
+ * ready for any of the @a events. The descriptor is better to be
+ * non-blocking: first try the IO, and wait only when it would
+ * block.
+ * @param fd File descriptor to wait for.
+ * @param events Bitwise combination of CORO_EV_READ and
+ *     CORO_EV_WRITE.
+ * @param timeout_ns Timeout in nanoseconds, or
+ *     CORO_TIMEOUT_INFINITY.
+ *
+ * @retval > 0 Happened CORO_EV_* events.
+ * @retval 0 Timeout.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_wait_fd(int fd, int events, uint64_t timeout_ns);
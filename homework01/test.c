@@ -0,0 +1,200 @@
+#include "libcoro.h"
+#include "coro_chan.h"
+#include "unit.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** Run coroutines until all of them are done. */
+static void
+run_all(void)
+{
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+static int
+chan_sender_f(void *arg)
+{
+	struct coro_chan *ch = arg;
+	for (int i = 0; i < 10; ++i)
+		unit_fail_if(coro_chan_send(ch, &i) != CORO_CHAN_OK);
+	coro_chan_close(ch);
+	return 0;
+}
+
+static int
+chan_receiver_f(void *arg)
+{
+	struct coro_chan *ch = arg;
+	int v, sum = 0, count = 0;
+	while (coro_chan_recv(ch, &v) == CORO_CHAN_OK) {
+		sum += v;
+		++count;
+	}
+	unit_check(count == 10 && sum == 45, "all sent elements are received");
+	unit_check(coro_chan_send(ch, &v) == CORO_CHAN_CLOSED,
+		   "send to a closed channel fails");
+	return 0;
+}
+
+static int
+chan_select_f(void *arg)
+{
+	(void)arg;
+	struct coro_chan *a = coro_chan_new(sizeof(int), 1);
+	struct coro_chan *b = coro_chan_new(sizeof(int), 1);
+	int v = 7, got = 0;
+	struct coro_chan_op ops[2] = {
+		{a, CORO_CHAN_RECV, &got, 0},
+		{b, CORO_CHAN_SEND, &v, 0},
+	};
+	unit_check(coro_chan_select(ops, 2) == 1 && ops[1].rc == CORO_CHAN_OK,
+		   "select picks the ready send");
+	unit_check(coro_chan_select_timeout(ops, 1, 1000000) == -1,
+		   "select of an empty channel times out");
+	unit_check(coro_chan_recv_timeout(a, &got, 0) == CORO_CHAN_TIMEOUT,
+		   "recv without a wait");
+	unit_check(coro_chan_recv(b, &got) == CORO_CHAN_OK && got == 7,
+		   "selected send is done");
+
+	errno = 0;
+	unit_check(coro_chan_select(ops, 0) == -1 && errno == EINVAL,
+		   "select of no operations");
+	ops[0].chan = NULL;
+	errno = 0;
+	unit_check(coro_chan_select(ops, 2) == -1 && errno == EINVAL,
+		   "select of a NULL channel");
+	coro_chan_delete(a);
+	coro_chan_delete(b);
+	return 0;
+}
+
+static void
+test_chan(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_chan *ch = coro_chan_new(sizeof(int), 0);
+	coro_new(chan_receiver_f, ch);
+	coro_new(chan_sender_f, ch);
+	run_all();
+	coro_chan_delete(ch);
+
+	coro_new(chan_select_f, NULL);
+	run_all();
+
+	unit_test_finish();
+}
+
+struct wait_args {
+	int fd;
+	int events;
+	int rc;
+};
+
+static int
+wait_fd_f(void *arg)
+{
+	struct wait_args *args = arg;
+	args->rc = coro_wait_fd(args->fd, args->events,
+				CORO_TIMEOUT_INFINITY);
+	return 0;
+}
+
+/**
+ * Close the watched descriptor, keeping its file alive by a dup,
+ * and make it writable. The write waiter is woken, and the re-arm
+ * for the read waiter fails on the closed descriptor.
+ */
+static int
+close_and_drain_f(void *arg)
+{
+	int *fds = arg;
+	coro_yield();
+	coro_yield();
+	close(fds[0]);
+	char buf[4096];
+	while (read(fds[1], buf, sizeof(buf)) > 0)
+		;
+	return 0;
+}
+
+static void
+rearm_fail_round(struct wait_args *rd, struct wait_args *wr)
+{
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	char buf[4096] = {0};
+	while (write(fds[0], buf, sizeof(buf)) > 0)
+		;
+	int keep = dup(fds[0]);
+	*rd = (struct wait_args){fds[0], CORO_EV_READ, 0};
+	*wr = (struct wait_args){fds[0], CORO_EV_WRITE, 0};
+	coro_new(wait_fd_f, rd);
+	coro_new(wait_fd_f, wr);
+	coro_new(close_and_drain_f, fds);
+	run_all();
+	close(keep);
+	close(fds[1]);
+}
+
+static int
+suspend_forever_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	return 0;
+}
+
+static void
+test_wait_fd_rearm_fail(void)
+{
+	unit_test_start();
+
+	struct wait_args rd, wr;
+	rearm_fail_round(&rd, &wr);
+	unit_check(wr.rc == CORO_EV_WRITE, "write waiter is woken");
+	unit_check(rd.rc == CORO_EV_ERROR, "failed re-arm wakes the rest");
+
+	/*
+	 * The dropped waiters are not counted anymore: with nobody to
+	 * wake a suspended coroutine the scheduler reports it instead
+	 * of waiting in epoll forever.
+	 */
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		freopen("/dev/null", "w", stdout);
+		alarm(5);
+		rearm_fail_round(&rd, &wr);
+		coro_new(suspend_forever_f, NULL);
+		run_all();
+		exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	unit_check(WIFEXITED(status) && WEXITSTATUS(status) == 255,
+		   "no waiters are leaked");
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_chan();
+	test_wait_fd_rearm_fail();
+
+	unit_test_finish();
+	return 0;
+}
@@ -0,0 +1,1114 @@
+/**
+ * Benchmarks of the userfs hot paths. Each case is run by its name,
+ * or all of them when no name is given.
+ *
+ * Usage: ./bench [case] [job]
+ *
+ * The jobs case runs fio-like profiles, all or the one named.
+ */
+#include "userfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+enum {
+	MB = 1024 * 1024,
+	/** File size for the big file cases. */
+	BIG_FILE_SIZE = 100 * MB,
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+check(bool cond, const char *what)
+{
+	if (!cond) {
+		printf("bench failed: %s, errno %d\n", what, (int)ufs_errno());
+		exit(-1);
+	}
+}
+
+static void
+report(const char *name, uint64_t ns, long long ops, long long bytes)
+{
+	double sec = ns / 1e9;
+	printf("%-16s %8.3f s %12.0f ops/s %10.1f MB/s %8.1f ns/op\n", name,
+	       sec, ops / sec, bytes / sec / MB, (double)ns / ops);
+}
+
+static long long
+rss_bytes(void)
+{
+	long long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lld %lld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/** Fill a file with @a size bytes by 1 MB writes. */
+static void
+fill_file(const char *name, size_t size)
+{
+	char *buf = malloc(MB);
+	memset(buf, 'x', MB);
+	int fd = ufs_open(name, UFS_CREATE);
+	check(fd != -1, "open");
+	for (size_t done = 0; done < size; done += MB)
+		check(ufs_write(fd, buf, MB) == MB, "fill write");
+	ufs_close(fd);
+	free(buf);
+}
+
+/** Sequential read of a 100 MB file in 4 KB chunks. */
+static void
+bench_read_4k(void)
+{
+	fill_file("big", BIG_FILE_SIZE);
+	char buf[4096];
+	int fd = ufs_open("big", 0);
+	check(fd != -1, "open");
+	long long ops = 0, bytes = 0;
+	uint64_t start = now_ns();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, sizeof(buf))) > 0) {
+		++ops;
+		bytes += rc;
+	}
+	uint64_t ns = now_ns() - start;
+	check(bytes == BIG_FILE_SIZE, "read all");
+	report("read_4k", ns, ops, bytes);
+	ufs_close(fd);
+	ufs_delete("big");
+}
+
+/** Sequential read of a 100 MB file in 64 byte chunks. */
+static void
+bench_read_64b(void)
+{
+	fill_file("big", BIG_FILE_SIZE);
+	char buf[64];
+	int fd = ufs_open("big", 0);
+	check(fd != -1, "open");
+	long long ops = 0, bytes = 0;
+	uint64_t start = now_ns();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, sizeof(buf))) > 0) {
+		++ops;
+		bytes += rc;
+	}
+	uint64_t ns = now_ns() - start;
+	check(bytes == BIG_FILE_SIZE, "read all");
+	report("read_64b", ns, ops, bytes);
+	ufs_close(fd);
+	ufs_delete("big");
+}
+
+/**
+ * Sequential write of a 100 MB file in 64 KB chunks, with the
+ * memory it takes.
+ */
+static void
+bench_write_64k(void)
+{
+	char *buf = malloc(64 * 1024);
+	memset(buf, 'x', 64 * 1024);
+	long long rss_start = rss_bytes();
+	int fd = ufs_open("big", UFS_CREATE);
+	check(fd != -1, "open");
+	uint64_t start = now_ns();
+	for (long long done = 0; done < BIG_FILE_SIZE; done += 64 * 1024)
+		check(ufs_write(fd, buf, 64 * 1024) == 64 * 1024, "write");
+	uint64_t ns = now_ns() - start;
+	report("write_64k", ns, BIG_FILE_SIZE / (64 * 1024), BIG_FILE_SIZE);
+	long long overhead = rss_bytes() - rss_start - BIG_FILE_SIZE;
+	printf("%-16s %8.1f MB over the data\n", "write_64k memory",
+	       overhead / (double)MB);
+	ufs_close(fd);
+	ufs_delete("big");
+	free(buf);
+}
+
+/** Grow a 100 MB file by 1 byte appends. */
+static void
+bench_append_1b(void)
+{
+	int fd = ufs_open("big", UFS_CREATE);
+	check(fd != -1, "open");
+	uint64_t start = now_ns();
+	for (long long i = 0; i < BIG_FILE_SIZE; ++i)
+		check(ufs_write(fd, "x", 1) == 1, "append");
+	uint64_t ns = now_ns() - start;
+	report("append_1b", ns, BIG_FILE_SIZE, BIG_FILE_SIZE);
+	ufs_close(fd);
+	ufs_delete("big");
+}
+
+/**
+ * Grow empty files to 100 MB, with the memory it takes, then read
+ * one of them.
+ */
+static void
+bench_resize(void)
+{
+	const int count = 100;
+	char name[32];
+	long long rss_start = rss_bytes();
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "big%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		check(fd != -1, "open");
+		check(ufs_resize(fd, BIG_FILE_SIZE) == 0, "resize");
+		ufs_close(fd);
+	}
+	uint64_t ns = now_ns() - start;
+	report("resize_100m", ns, count, 0);
+	printf("%-16s %8.1f KB per file\n", "resize memory",
+	       (rss_bytes() - rss_start) / 1024.0 / count);
+
+	char buf[4096];
+	int fd = ufs_open("big0", 0);
+	check(fd != -1, "open");
+	long long ops = 0;
+	start = now_ns();
+	while (ufs_read(fd, buf, sizeof(buf)) > 0)
+		++ops;
+	report("read_hole_4k", now_ns() - start, ops, BIG_FILE_SIZE);
+	ufs_close(fd);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "big%d", i);
+		ufs_delete(name);
+	}
+}
+
+/** Create, reopen and delete many small files by name. */
+static void
+bench_many_files(void)
+{
+	const int count = 200000;
+	char name[32];
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		check(fd != -1, "create");
+		check(ufs_write(fd, name, 8) == 8, "write");
+		ufs_close(fd);
+	}
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		check(fd != -1, "open");
+		ufs_close(fd);
+	}
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		check(ufs_delete(name) == 0, "delete");
+	}
+	uint64_t ns = now_ns() - start;
+	report("many_files", ns, 3 * count, 0);
+}
+
+/**
+ * 200k files of 100 bytes: the memory per file, and an open, read
+ * and close of each.
+ */
+static void
+bench_small_files(void)
+{
+	const int count = 200000;
+	char name[32], buf[100];
+	memset(buf, 's', sizeof(buf));
+	long long rss = rss_bytes();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "small%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		check(fd != -1, "create");
+		check(ufs_write(fd, buf, sizeof(buf)) == sizeof(buf), "write");
+		ufs_close(fd);
+	}
+	rss = rss_bytes() - rss;
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "small%d", i);
+		int fd = ufs_open(name, 0);
+		check(fd != -1, "open");
+		check(ufs_read(fd, buf, sizeof(buf)) == sizeof(buf), "read");
+		ufs_close(fd);
+	}
+	uint64_t ns = now_ns() - start;
+	report("small_files", ns, count, 0);
+	printf("%-16s %8lld B/file\n", "small_files_rss", rss / count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "small%d", i);
+		check(ufs_delete(name) == 0, "delete");
+	}
+}
+
+/**
+ * 100 cold files of 1 MB of log-like text: compression of all of
+ * them, the ratio, and the decompression on the next open.
+ */
+static void
+bench_compress(void)
+{
+	const int count = 100;
+	char name[32];
+	char *buf = malloc(MB);
+	for (int i = 0, line = 0; i < MB; ++line) {
+		int len = snprintf(buf + i, MB - i, "%08d request %d done in %d us\n",
+				   line, line * 7919 % 1000, line * 31 % 977);
+		i += len >= MB - i ? MB - i : len;
+	}
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "log%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		check(fd != -1, "create");
+		check(ufs_write(fd, buf, MB) == MB, "write");
+		ufs_close(fd);
+	}
+	ufs_set_compression(true, 0);
+	uint64_t start = now_ns();
+	check(ufs_compress() == 0, "compress");
+	uint64_t ns = now_ns() - start;
+	report("compress", ns, count, (long long)count * MB);
+	struct ufs_compression_stats stats;
+	ufs_compression_stats(&stats);
+	printf("%-16s %8.2f raw/compressed\n", "compress_ratio",
+	       (double)stats.raw_bytes / stats.compressed_bytes);
+	start = now_ns();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "log%d", i);
+		int fd = ufs_open(name, 0);
+		check(fd != -1, "open");
+		ufs_close(fd);
+	}
+	ns = now_ns() - start;
+	report("decompress", ns, count, (long long)count * MB);
+	ufs_compression_stats(&stats);
+	printf("%-16s %8.1f us/block\n", "decompress_lat",
+	       stats.decompress_ns / 1e3 / stats.decompressed_blocks);
+	ufs_set_compression(false, 0);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "log%d", i);
+		check(ufs_delete(name) == 0, "delete");
+	}
+	free(buf);
+}
+
+/** Write @a count files of 4 MB from @a buf, shifted by the file index. */
+static uint64_t
+write_copies(int count, const char *buf, int shift)
+{
+	char name[32];
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "copy%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		check(fd != -1, "create");
+		for (int done = 0; done < 4 * MB; done += 64 * 1024)
+			check(ufs_write(fd, buf + i * shift + done, 64 * 1024) == 64 * 1024, "write");
+		ufs_close(fd);
+	}
+	return now_ns() - start;
+}
+
+static void
+delete_copies(int count)
+{
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "copy%d", i);
+		check(ufs_delete(name) == 0, "delete");
+	}
+}
+
+/**
+ * 50 copies of one 4 MB template: the write path without the dedup,
+ * with it, and with it on unique data, where it only costs.
+ */
+static void
+bench_dedup(void)
+{
+	const int count = 50;
+	char *buf = malloc(5 * MB);
+	srand(1);
+	for (int i = 0; i < 5 * MB; ++i)
+		buf[i] = rand();
+	long long rss = rss_bytes();
+	uint64_t ns = write_copies(count, buf, 0);
+	report("dedup_off", ns, count, (long long)count * 4 * MB);
+	printf("%-16s %8lld MB rss\n", "dedup_off_rss", (rss_bytes() - rss) / MB);
+	delete_copies(count);
+
+	ufs_set_dedup(true);
+	rss = rss_bytes();
+	ns = write_copies(count, buf, 0);
+	report("dedup_same", ns, count, (long long)count * 4 * MB);
+	struct ufs_dedup_stats stats;
+	ufs_dedup_stats(&stats);
+	printf("%-16s %8lld MB rss %8.2f written/stored\n", "dedup_same_rss",
+	       (rss_bytes() - rss) / MB,
+	       (double)stats.hashed_bytes / (stats.hashed_bytes - stats.deduped_bytes));
+	delete_copies(count);
+
+	ns = write_copies(count, buf, 16 * 1024);
+	report("dedup_unique", ns, count, (long long)count * 4 * MB);
+	delete_copies(count);
+	ufs_set_dedup(false);
+	free(buf);
+}
+
+/**
+ * Open and close descriptors while many others stay open, like
+ * test_stress_open does.
+ */
+static void
+bench_open_close(void)
+{
+	const int count = 1000;
+	const int cycles = 1000000;
+	int fds[count];
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		check(fds[i] != -1, "create");
+	}
+	uint64_t start = now_ns();
+	for (int i = 0; i < cycles; ++i) {
+		int idx = i % count;
+		check(ufs_close(fds[idx]) == 0, "close");
+		sprintf(name, "file%d", idx);
+		fds[idx] = ufs_open(name, 0);
+		check(fds[idx] != -1, "open");
+	}
+	uint64_t ns = now_ns() - start;
+	report("open_close", ns, cycles, 0);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_close(fds[i]);
+		ufs_delete(name);
+	}
+}
+
+/** Destroy the whole FS with 100k small and 100 big files. */
+static void
+bench_destroy(void)
+{
+	char name[32];
+	for (int i = 0; i < 100000; ++i) {
+		sprintf(name, "small%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		check(fd != -1, "create");
+		check(ufs_write(fd, name, 8) == 8, "write");
+		ufs_close(fd);
+	}
+	for (int i = 0; i < 100; ++i) {
+		sprintf(name, "big%d", i);
+		fill_file(name, MB);
+	}
+	uint64_t start = now_ns();
+	ufs_destroy();
+	uint64_t ns = now_ns() - start;
+	report("destroy", ns, 1, 0);
+}
+
+/**
+ * Clone a 100 MB file, then change 4 KB in the clone, with the
+ * memory each step takes.
+ */
+static void
+bench_clone(void)
+{
+	const int count = 100;
+	fill_file("big", BIG_FILE_SIZE);
+	long long rss_start = rss_bytes();
+	uint64_t start = now_ns();
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "clone%d", i);
+		check(ufs_clone("big", name) == 0, "clone");
+	}
+	uint64_t ns = now_ns() - start;
+	report("clone", ns, count, 0);
+	long long rss_cloned = rss_bytes();
+	printf("%-16s %8.1f KB per clone\n", "clone memory",
+	       (rss_cloned - rss_start) / 1024.0 / count);
+	char buf[4096];
+	memset(buf, 'z', sizeof(buf));
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "clone%d", i);
+		int fd = ufs_open(name, 0);
+		check(fd != -1, "open");
+		check(ufs_pwrite(fd, buf, sizeof(buf), 50 * MB) ==
+		      sizeof(buf), "pwrite");
+		ufs_close(fd);
+	}
+	printf("%-16s %8.1f KB per clone\n", "clone 4k write",
+	       (rss_bytes() - rss_cloned) / 1024.0 / count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "clone%d", i);
+		ufs_delete(name);
+	}
+	ufs_delete("big");
+}
+
+/** Cheap checksum, so the memory traffic dominates. */
+static uint64_t
+checksum(const char *data, size_t size, uint64_t sum)
+{
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		sum += word;
+	}
+	for (; i < size; ++i)
+		sum += (unsigned char)data[i];
+	return sum;
+}
+
+/** Checksum a 100 MB file, copying it by 4 KB reads. */
+static void
+bench_sum_read(void)
+{
+	fill_file("big", BIG_FILE_SIZE);
+	char buf[4096];
+	int fd = ufs_open("big", 0);
+	check(fd != -1, "open");
+	long long ops = 0, bytes = 0;
+	uint64_t sum = 0;
+	uint64_t start = now_ns();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, sizeof(buf))) > 0) {
+		sum = checksum(buf, rc, sum);
+		++ops;
+		bytes += rc;
+	}
+	uint64_t ns = now_ns() - start;
+	check(bytes == BIG_FILE_SIZE && sum != 0, "read all");
+	report("sum_read", ns, ops, bytes);
+	ufs_close(fd);
+	ufs_delete("big");
+}
+
+/** Checksum a 100 MB file through views, without copying. */
+static void
+bench_sum_view(void)
+{
+	fill_file("big", BIG_FILE_SIZE);
+	struct iovec iov[64];
+	int fd = ufs_open("big", 0);
+	check(fd != -1, "open");
+	long long ops = 0, bytes = 0;
+	uint64_t sum = 0;
+	uint64_t start = now_ns();
+	int count;
+	while ((count = ufs_readv_view(fd, 4 * MB, iov, 64)) > 0) {
+		for (int i = 0; i < count; ++i) {
+			sum = checksum(iov[i].iov_base, iov[i].iov_len, sum);
+			bytes += iov[i].iov_len;
+		}
+		ufs_view_release(fd);
+		++ops;
+	}
+	uint64_t ns = now_ns() - start;
+	check(bytes == BIG_FILE_SIZE && sum != 0, "view all");
+	report("sum_view", ns, ops, bytes);
+	ufs_close(fd);
+	ufs_delete("big");
+}
+
+/**
+ * Read a 100 MB file as 64 byte records into separate buffers,
+ * one call per record or one ufs_readv() per 64 of them.
+ */
+static void
+bench_records(bool is_batch)
+{
+	enum { RECORD = 64, BATCH = 64 };
+	fill_file("big", BIG_FILE_SIZE);
+	int fd = ufs_open("big", 0);
+	check(fd != -1, "open");
+	char *buf = malloc(RECORD * BATCH);
+	struct iovec iov[BATCH];
+	for (int i = 0; i < BATCH; ++i) {
+		iov[i].iov_base = buf + i * RECORD;
+		iov[i].iov_len = RECORD;
+	}
+	long long records = BIG_FILE_SIZE / RECORD;
+	uint64_t start = now_ns();
+	for (long long i = 0; i < records; i += BATCH) {
+		if (is_batch) {
+			check(ufs_readv(fd, iov, BATCH) == RECORD * BATCH,
+			      "readv");
+			continue;
+		}
+		for (int j = 0; j < BATCH; ++j)
+			check(ufs_read(fd, iov[j].iov_base, RECORD) == RECORD,
+			      "read");
+	}
+	uint64_t ns = now_ns() - start;
+	report(is_batch ? "records_readv" : "records_read", ns, records,
+	       BIG_FILE_SIZE);
+	free(buf);
+	ufs_close(fd);
+	ufs_delete("big");
+}
+
+static void
+bench_records_read(void)
+{
+	bench_records(false);
+}
+
+static void
+bench_records_readv(void)
+{
+	bench_records(true);
+}
+
+enum {
+	THREAD_MAX = 16,
+	/** Operations per thread in the threads case. */
+	THREAD_OPS = 400000,
+	THREAD_FILE_SIZE = 16 * MB,
+	THREAD_IO_SIZE = 4096,
+};
+
+struct thread_job {
+	/** File to use, own or shared. */
+	const char *name;
+	/** Every write_every-th operation is a write, 0 for none. */
+	int write_every;
+	int id;
+};
+
+static void *
+thread_job_f(void *arg)
+{
+	struct thread_job *job = arg;
+	char buf[THREAD_IO_SIZE];
+	memset(buf, 'y', sizeof(buf));
+	int fd = ufs_open(job->name, 0);
+	check(fd != -1, "open");
+	/* Threads start at different places of a shared file. */
+	size_t blocks = THREAD_FILE_SIZE / THREAD_IO_SIZE;
+	size_t block = (size_t)job->id * 7919;
+	for (int i = 0; i < THREAD_OPS; ++i) {
+		block = (block + 1) % blocks;
+		size_t offset = block * THREAD_IO_SIZE;
+		if (job->write_every != 0 && i % job->write_every == 0)
+			check(ufs_pwrite(fd, buf, sizeof(buf), offset) ==
+			      sizeof(buf), "pwrite");
+		else
+			check(ufs_pread(fd, buf, sizeof(buf), offset) ==
+			      sizeof(buf), "pread");
+	}
+	ufs_close(fd);
+	return NULL;
+}
+
+/**
+ * Run 4 KB preads and pwrites from 1 to THREAD_MAX threads, each
+ * on its own file or all on one shared file.
+ */
+static void
+bench_threads_run(bool is_shared, int write_every)
+{
+	char names[THREAD_MAX][32];
+	for (int i = 0; i < THREAD_MAX; ++i) {
+		sprintf(names[i], "thread%d", is_shared ? 0 : i);
+		if (i == 0 || !is_shared)
+			fill_file(names[i], THREAD_FILE_SIZE);
+	}
+	for (int count = 1; count <= THREAD_MAX; count *= 2) {
+		pthread_t threads[THREAD_MAX];
+		struct thread_job jobs[THREAD_MAX];
+		uint64_t start = now_ns();
+		for (int i = 0; i < count; ++i) {
+			jobs[i].name = names[i];
+			jobs[i].write_every = write_every;
+			jobs[i].id = i;
+			check(pthread_create(&threads[i], NULL, thread_job_f,
+					     &jobs[i]) == 0, "thread");
+		}
+		for (int i = 0; i < count; ++i)
+			pthread_join(threads[i], NULL);
+		uint64_t ns = now_ns() - start;
+		char name[32];
+		sprintf(name, "%s_%s_%d", is_shared ? "shared" : "own",
+			write_every == 0 ? "r" : "rw", count);
+		long long ops = (long long)count * THREAD_OPS;
+		report(name, ns, ops, ops * THREAD_IO_SIZE);
+	}
+	for (int i = 0; i < (is_shared ? 1 : THREAD_MAX); ++i)
+		ufs_delete(names[i]);
+}
+
+/**
+ * Scaling in the concurrent mode: reads, and reads with a write
+ * per 4 operations, on own files and on one shared file.
+ */
+static void
+bench_threads(void)
+{
+	ufs_set_concurrent(true);
+	bench_threads_run(false, 0);
+	bench_threads_run(false, 4);
+	bench_threads_run(true, 0);
+	bench_threads_run(true, 4);
+	ufs_set_concurrent(false);
+}
+
+/**
+ * Reopen of a 1 GB image with 900 MB of files: the mount time and
+ * memory, and the first read, which faults the data in.
+ */
+static void
+bench_image(void)
+{
+	const int count = 90;
+	char path[] = "/tmp/ufs_bench_XXXXXX";
+	int tmp = mkstemp(path);
+	check(tmp != -1, "mkstemp");
+	close(tmp);
+	/* Mount needs an empty FS. */
+	ufs_destroy();
+	check(ufs_mount(path, 1024 * MB) == 0, "create image");
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		fill_file(name, 10 * MB);
+	}
+	ufs_destroy();
+	long long rss_start = rss_bytes();
+	uint64_t start = now_ns();
+	check(ufs_mount(path, 0) == 0, "open image");
+	uint64_t ns = now_ns() - start;
+	report("image_mount", ns, 1, 0);
+	printf("%-16s %8.1f MB\n", "image_mount mem",
+	       (rss_bytes() - rss_start) / (double)MB);
+	char buf[4096];
+	int fd = ufs_open("file0", 0);
+	check(fd != -1, "open");
+	long long ops = 0, bytes = 0;
+	start = now_ns();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, sizeof(buf))) > 0) {
+		++ops;
+		bytes += rc;
+	}
+	ns = now_ns() - start;
+	check(bytes == 10 * MB, "read all");
+	report("image_read_4k", ns, ops, bytes);
+	ufs_close(fd);
+	ufs_destroy();
+	unlink(path);
+}
+
+struct journal_args {
+	int id;
+	int count;
+	int sync_every;
+};
+
+/** 4 KB appends to own files, with a sync per some of them. */
+static void *
+journal_worker(void *arg)
+{
+	struct journal_args *args = arg;
+	char buf[4096];
+	memset(buf, 'j', sizeof(buf));
+	char name[32];
+	int fds[16];
+	for (int i = 0; i < 16; ++i) {
+		sprintf(name, "j%d_%d", args->id, i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		check(fds[i] != -1, "open");
+	}
+	for (int i = 0; i < args->count; ++i) {
+		check(ufs_write(fds[i % 16], buf, sizeof(buf)) == sizeof(buf),
+		      "write");
+		if (args->sync_every > 0 && (i + 1) % args->sync_every == 0)
+			check(ufs_sync() == 0, "sync");
+	}
+	for (int i = 0; i < 16; ++i) {
+		ufs_close(fds[i]);
+		sprintf(name, "j%d_%d", args->id, i);
+		ufs_delete(name);
+	}
+	return NULL;
+}
+
+static uint64_t
+bench_journal_run(const char *name, int thread_count, int count,
+		  int sync_every)
+{
+	pthread_t threads[8];
+	struct journal_args args[8];
+	ufs_set_concurrent(thread_count > 1);
+	uint64_t start = now_ns();
+	for (int i = 0; i < thread_count; ++i) {
+		args[i] = (struct journal_args){i, count, sync_every};
+		pthread_create(&threads[i], NULL, journal_worker, &args[i]);
+	}
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	/* The files are gone, so their space is freed by the sync. */
+	check(ufs_sync() == 0, "sync");
+	uint64_t ns = now_ns() - start;
+	ufs_set_concurrent(false);
+	long long ops = (long long)thread_count * count;
+	report(name, ns, ops, ops * 4096);
+	return ns;
+}
+
+/**
+ * Small writes to a mounted image: without syncs, with a sync per
+ * 256 writes, and with a sync per write from one and from 8
+ * threads, which share the flushes.
+ */
+static void
+bench_journal(void)
+{
+	char path[] = "/tmp/ufs_bench_XXXXXX";
+	int tmp = mkstemp(path);
+	check(tmp != -1, "mkstemp");
+	close(tmp);
+	/* Mount needs an empty FS. */
+	ufs_destroy();
+	check(ufs_mount(path, 512 * MB) == 0, "create image");
+	uint64_t base = bench_journal_run("journal_nosync", 1, 50000, 0);
+	uint64_t batch = bench_journal_run("journal_sync256", 1, 50000, 256);
+	printf("%-16s %8.2f x\n", "sync256 slower", (double)batch / base);
+	bench_journal_run("journal_sync1", 1, 500, 1);
+	bench_journal_run("journal_sync1_8t", 8, 500, 1);
+	ufs_destroy();
+	unlink(path);
+}
+
+/** Random 4 KB preads of the big file by a ring, @a batch per submit. */
+static uint64_t
+ring_preads(int fd, int count, int batch, char *buf)
+{
+	struct ufs_ring *ring = ufs_ring_new(batch);
+	check(ring != NULL, "ring");
+	struct ufs_cqe cqes[64];
+	srand(1);
+	uint64_t start = now_ns();
+	for (int done = 0; done < count; done += batch) {
+		for (int i = 0; i < batch; ++i) {
+			struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+			sqe->op = UFS_OP_PREAD;
+			sqe->fd = fd;
+			sqe->buf = buf + i * 4096;
+			sqe->size = 4096;
+			sqe->offset = (size_t)(rand() % (BIG_FILE_SIZE / 4096)) * 4096;
+		}
+		check(ufs_ring_submit(ring) == batch, "submit");
+		for (int got = 0; got < batch;) {
+			int n = ufs_ring_reap(ring, cqes, batch - got, 1);
+			for (int i = 0; i < n; ++i)
+				check(cqes[i].result == 4096, "ring pread");
+			got += n;
+		}
+	}
+	uint64_t ns = now_ns() - start;
+	ufs_ring_delete(ring);
+	return ns;
+}
+
+/**
+ * Random 4 KB preads one by one, and by a ring in batches of 32,
+ * served inline and by a worker thread in the concurrent mode.
+ */
+static void
+bench_ring(void)
+{
+	const int count = 1000000, batch = 32;
+	fill_file("big", BIG_FILE_SIZE);
+	char *buf = malloc(batch * 4096);
+	int fd = ufs_open("big", 0);
+	check(fd != -1, "open");
+	srand(1);
+	uint64_t start = now_ns();
+	for (int i = 0; i < count; ++i) {
+		size_t offset = (size_t)(rand() % (BIG_FILE_SIZE / 4096)) * 4096;
+		check(ufs_pread(fd, buf, 4096, offset) == 4096, "pread");
+	}
+	report("ring_sync", now_ns() - start, count, (long long)count * 4096);
+	uint64_t ns = ring_preads(fd, count, batch, buf);
+	report("ring_inline", ns, count, (long long)count * 4096);
+	ufs_set_concurrent(true);
+	ns = ring_preads(fd, count, batch, buf);
+	report("ring_worker", ns, count, (long long)count * 4096);
+	ufs_set_concurrent(false);
+	ufs_close(fd);
+	free(buf);
+	ufs_destroy();
+}
+
+/**
+ * A job in the manner of fio: calls of one block size spread over
+ * some files, sequential or at random offsets, with a share of reads
+ * and of resizes, the rest are writes.
+ */
+struct bench_job {
+	const char *name;
+	size_t block_size;
+	bool is_random;
+	/** Percent of reads and of resizes among the calls. */
+	int read_percent;
+	int resize_percent;
+	int file_count;
+	size_t file_size;
+	int op_count;
+};
+
+static const struct bench_job jobs[] = {
+	{"seq_read_128k", 128 * 1024, false, 100, 0, 1, BIG_FILE_SIZE, 20000},
+	{"seq_write_128k", 128 * 1024, false, 0, 0, 1, BIG_FILE_SIZE, 20000},
+	{"seq_read_4k", 4096, false, 100, 0, 1, BIG_FILE_SIZE, 1000000},
+	{"rand_read_4k", 4096, true, 100, 0, 1, BIG_FILE_SIZE, 1000000},
+	{"rand_write_4k", 4096, true, 0, 0, 1, BIG_FILE_SIZE, 1000000},
+	{"rand_rw70_4k", 4096, true, 70, 0, 1, BIG_FILE_SIZE, 1000000},
+	{"rand_rw50_64k", 64 * 1024, true, 50, 0, 1, BIG_FILE_SIZE, 100000},
+	{"rand_rw_resize", 4096, true, 45, 10, 16, MB, 1000000},
+	{"small_files_4k", 4096, true, 50, 0, 10000, 16 * 1024, 1000000},
+};
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Print the latency percentiles of @a count sorted calls. */
+static void
+report_latency(const char *name, uint64_t *lat, int count)
+{
+	qsort(lat, count, sizeof(*lat), cmp_u64);
+	printf("%-16s p50 %6llu  p90 %6llu  p99 %6llu  p99.9 %7llu  "
+	       "max %8llu ns\n", name,
+	       (unsigned long long)lat[count / 2],
+	       (unsigned long long)lat[(long long)count * 90 / 100],
+	       (unsigned long long)lat[(long long)count * 99 / 100],
+	       (unsigned long long)lat[(long long)count * 999 / 1000],
+	       (unsigned long long)lat[count - 1]);
+}
+
+static void
+run_job(const struct bench_job *job)
+{
+	int *fds = malloc(job->file_count * sizeof(*fds));
+	char *buf = malloc(MB);
+	memset(buf, 'j', MB);
+	char name[32];
+	for (int i = 0; i < job->file_count; ++i) {
+		sprintf(name, "job%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		check(fds[i] != -1, "open");
+		for (size_t done = 0; done < job->file_size; done += MB) {
+			size_t size = job->file_size - done < MB ?
+				      job->file_size - done : MB;
+			check(ufs_write(fds[i], buf, size) == (ssize_t)size,
+			      "fill write");
+		}
+	}
+	uint64_t *lat = malloc(job->op_count * sizeof(*lat));
+	size_t blocks = job->file_size / job->block_size;
+	size_t pos = 0;
+	long long bytes = 0;
+	srand(1);
+	uint64_t start = now_ns();
+	for (int i = 0; i < job->op_count; ++i) {
+		int fd;
+		size_t offset;
+		if (job->is_random) {
+			fd = fds[rand() % job->file_count];
+			offset = (size_t)(rand() % blocks) * job->block_size;
+		} else {
+			fd = fds[pos / blocks % job->file_count];
+			offset = pos % blocks * job->block_size;
+			++pos;
+		}
+		int kind = rand() % 100;
+		uint64_t op_start = now_ns();
+		ssize_t rc;
+		if (kind < job->read_percent) {
+			rc = ufs_pread(fd, buf, job->block_size, offset);
+		} else if (kind < job->read_percent + job->resize_percent) {
+			rc = ufs_resize(fd, job->file_size / 2 + offset / 2);
+		} else {
+			rc = ufs_pwrite(fd, buf, job->block_size, offset);
+		}
+		lat[i] = now_ns() - op_start;
+		check(rc >= 0, "job call");
+		bytes += rc;
+	}
+	uint64_t ns = now_ns() - start;
+	report(job->name, ns, job->op_count, bytes);
+	report_latency(job->name, lat, job->op_count);
+	for (int i = 0; i < job->file_count; ++i)
+		ufs_close(fds[i]);
+	ufs_destroy();
+	free(lat);
+	free(buf);
+	free(fds);
+}
+
+/** Name of the job to run by the jobs case, or NULL for all of them. */
+static const char *job_name;
+
+/**
+ * The fio-like job profiles: throughput and latency percentiles of
+ * each call, measured around the call itself.
+ */
+static void
+bench_jobs(void)
+{
+	bool found = false;
+	for (size_t i = 0; i < sizeof(jobs) / sizeof(jobs[0]); ++i) {
+		if (job_name != NULL && strcmp(job_name, jobs[i].name) != 0)
+			continue;
+		found = true;
+		run_job(&jobs[i]);
+	}
+	if (!found)
+		printf("unknown job %s\n", job_name);
+}
+
+struct bench_case {
+	const char *name;
+	void (*func)(void);
+};
+
+static int
+count_entry_f(const struct ufs_dirent *entry, void *ctx)
+{
+	(void)entry;
+	++*(int *)ctx;
+	return 0;
+}
+
+/**
+ * Listing of a small and of a 1000 file directory among 500k files,
+ * and opens by an 8 level deep path against ones in the root.
+ */
+static void
+bench_dirs(void)
+{
+	const int dir_count = 500, file_count = 1000;
+	char name[64];
+	for (int i = 0; i < dir_count; ++i) {
+		sprintf(name, "dir%d", i);
+		check(ufs_mkdir(name) == 0, "mkdir");
+		for (int j = 0; j < file_count; ++j) {
+			sprintf(name, "dir%d/file%d", i, j);
+			int fd = ufs_open(name, UFS_CREATE);
+			check(fd != -1, "create");
+			ufs_close(fd);
+		}
+	}
+	check(ufs_mkdir("small") == 0, "mkdir");
+	for (int j = 0; j < 10; ++j) {
+		sprintf(name, "small/file%d", j);
+		ufs_close(ufs_open(name, UFS_CREATE));
+	}
+
+	const int lists = 100000;
+	int total = 0;
+	uint64_t start = now_ns();
+	for (int i = 0; i < lists; ++i)
+		check(ufs_readdir("small", count_entry_f, &total) == 0, "readdir");
+	report("readdir_10", now_ns() - start, lists, 0);
+	check(total == lists * 10, "readdir count");
+	total = 0;
+	start = now_ns();
+	for (int i = 0; i < lists / 100; ++i)
+		check(ufs_readdir("dir7", count_entry_f, &total) == 0, "readdir");
+	report("readdir_1000", now_ns() - start, lists / 100, 0);
+	check(total == lists / 100 * file_count, "readdir count");
+
+	strcpy(name, "deep");
+	for (int i = 0; i < 8; ++i) {
+		check(ufs_mkdir(name) == 0, "mkdir deep");
+		strcat(name, "/deep");
+	}
+	ufs_close(ufs_open(name, UFS_CREATE));
+	ufs_close(ufs_open("flat", UFS_CREATE));
+	const int opens = 1000000;
+	start = now_ns();
+	for (int i = 0; i < opens; ++i)
+		check(ufs_close(ufs_open(name, 0)) == 0, "open deep");
+	report("open_deep", now_ns() - start, opens, 0);
+	start = now_ns();
+	for (int i = 0; i < opens; ++i)
+		check(ufs_close(ufs_open("flat", 0)) == 0, "open flat");
+	report("open_flat", now_ns() - start, opens, 0);
+	ufs_destroy();
+}
+
+static const struct bench_case cases[] = {
+	{"read_4k", bench_read_4k},
+	{"read_64b", bench_read_64b},
+	{"write_64k", bench_write_64k},
+	{"append_1b", bench_append_1b},
+	{"resize", bench_resize},
+	{"many_files", bench_many_files},
+	{"small_files", bench_small_files},
+	{"compress", bench_compress},
+	{"dedup", bench_dedup},
+	{"open_close", bench_open_close},
+	{"records_read", bench_records_read},
+	{"records_readv", bench_records_readv},
+	{"sum_read", bench_sum_read},
+	{"sum_view", bench_sum_view},
+	{"clone", bench_clone},
+	{"threads", bench_threads},
+	{"image", bench_image},
+	{"journal", bench_journal},
+	{"dirs", bench_dirs},
+	{"ring", bench_ring},
+	{"jobs", bench_jobs},
+	{"destroy", bench_destroy},
+};
+
+int
+main(int argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : NULL;
+	job_name = argc > 2 ? argv[2] : NULL;
+	bool found = false;
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		if (name != NULL && strcmp(name, cases[i].name) != 0)
+			continue;
+		found = true;
+		cases[i].func();
+	}
+	if (!found) {
+		printf("unknown case %s\n", name);
+		return -1;
+	}
+	ufs_destroy();
+	return 0;
+}
@@ -0,0 +1,637 @@
+#include "image.h"
+#include "spin.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	IMAGE_VERSION = 3,
+	IMAGE_PAGE_SIZE = 4096,
+	/** An inode is reserved per this many bytes of the image. */
+	IMAGE_BYTES_PER_INODE = 64 * 1024,
+	IMAGE_MIN_INODES = 16,
+	/** Units of the biggest allocation. */
+	IMAGE_MAX_RUN = 1 << (IMAGE_MAX_ORDER - 1),
+};
+
+enum image_state {
+	/** Closed, the bitmap is right. */
+	IMAGE_CLEAN = 0,
+	/** Open, or crashed while open. */
+	IMAGE_OPEN,
+};
+
+/** "UFSIMAGE" */
+static const uint64_t image_magic = 0x45474d4953465555ull;
+/** "UFSJOURN" */
+static const uint64_t txn_magic = 0x4e52554f4a534655ull;
+
+struct image_super {
+	uint64_t magic;
+	uint32_t version;
+	/** One of enum image_state. */
+	uint32_t state;
+	uint32_t inode_count;
+	/** How many inodes were ever used, the rest are free. */
+	uint32_t inode_used;
+	/** Image size, the file should be of the same size. */
+	uint64_t size;
+	uint64_t inode_offset;
+	uint64_t bitmap_offset;
+	uint64_t journal_offset;
+	/** Fits a transaction with all the inodes. */
+	uint64_t journal_size;
+	/** Sequence number of the first transaction in the journal. */
+	uint64_t journal_seq;
+	uint64_t data_offset;
+	/** Units in the data region, a multiple of IMAGE_MAX_RUN. */
+	uint64_t unit_count;
+};
+
+/** Header of a journal transaction, the records follow it. */
+struct image_txn {
+	uint64_t magic;
+	uint64_t seq;
+	uint32_t count;
+	uint32_t reserved;
+	/** Of the records, the sequence number and the count. */
+	uint64_t checksum;
+};
+
+/** New state of an inode. */
+struct image_record {
+	uint32_t index;
+	uint32_t reserved;
+	struct image_inode inode;
+};
+
+static inline uint64_t
+image_round(uint64_t size, uint64_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+static inline size_t
+txn_size(uint32_t count)
+{
+	return sizeof(struct image_txn) + count * sizeof(struct image_record);
+}
+
+/** FNV-1a by words, the records are a multiple of 8 bytes. */
+static uint64_t
+txn_checksum(const struct image_txn *txn)
+{
+	uint64_t hash = 14695981039346656037ull;
+	hash = (hash ^ txn->seq) * 1099511628211ull;
+	hash = (hash ^ txn->count) * 1099511628211ull;
+	const uint64_t *word = (const uint64_t *)(txn + 1);
+	size_t count = txn->count * sizeof(struct image_record) / 8;
+	for (size_t i = 0; i < count; ++i)
+		hash = (hash ^ word[i]) * 1099511628211ull;
+	return hash;
+}
+
+static inline int
+write_all(int fd, const void *buf, size_t size, uint64_t offset)
+{
+	return pwrite(fd, buf, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+/** Place the tables and the data in an image of the given size. */
+static void
+image_layout(struct image_super *super, uint64_t size)
+{
+	memset(super, 0, sizeof(*super));
+	uint64_t inode_count = size / IMAGE_BYTES_PER_INODE;
+	if (inode_count < IMAGE_MIN_INODES)
+		inode_count = IMAGE_MIN_INODES;
+	super->inode_count = inode_count;
+	super->inode_offset = IMAGE_PAGE_SIZE;
+	super->bitmap_offset = image_round(super->inode_offset + inode_count *
+					   sizeof(struct image_inode),
+					   IMAGE_PAGE_SIZE);
+	/* The bitmap is sized for the whole image, a bit too big. */
+	uint64_t bitmap_size = image_round(size / IMAGE_UNIT_SIZE, 64) / 8;
+	super->journal_offset = image_round(super->bitmap_offset + bitmap_size,
+					    IMAGE_PAGE_SIZE);
+	super->journal_size = image_round(txn_size(inode_count),
+					  IMAGE_PAGE_SIZE);
+	super->data_offset = super->journal_offset + super->journal_size;
+	uint64_t units = size > super->data_offset ?
+			 (size - super->data_offset) / IMAGE_UNIT_SIZE : 0;
+	super->unit_count = units / IMAGE_MAX_RUN * IMAGE_MAX_RUN;
+	super->size = size;
+	super->state = IMAGE_CLEAN;
+	super->version = IMAGE_VERSION;
+	super->magic = image_magic;
+}
+
+/**
+ * Write the inodes from the journal to the inode table. The
+ * journal is read up to the first transaction, which is torn or is
+ * left from before the last checkpoint. Then the journal sequence
+ * number of @a super points after the applied transactions.
+ */
+static int
+image_replay(int fd, struct image_super *super)
+{
+	struct image_txn *txn = malloc(txn_size(super->inode_count));
+	if (txn == NULL)
+		return -1;
+	uint64_t pos = 0;
+	while (pos + sizeof(*txn) <= super->journal_size) {
+		uint64_t offset = super->journal_offset + pos;
+		if (pread(fd, txn, sizeof(*txn), offset) != sizeof(*txn) ||
+		    txn->magic != txn_magic || txn->seq != super->journal_seq ||
+		    txn->count > super->inode_count ||
+		    pos + txn_size(txn->count) > super->journal_size)
+			break;
+		size_t size = txn->count * sizeof(struct image_record);
+		if (pread(fd, txn + 1, size, offset + sizeof(*txn)) !=
+		    (ssize_t)size || txn_checksum(txn) != txn->checksum)
+			break;
+		struct image_record *record = (struct image_record *)(txn + 1);
+		for (uint32_t i = 0; i < txn->count; ++i, ++record) {
+			if (record->index >= super->inode_count)
+				continue;
+			if (write_all(fd, &record->inode, sizeof(record->inode),
+				      super->inode_offset + record->index *
+				      sizeof(struct image_inode)) != 0) {
+				free(txn);
+				return -1;
+			}
+			if (record->index >= super->inode_used)
+				super->inode_used = record->index + 1;
+		}
+		++super->journal_seq;
+		pos += txn_size(txn->count);
+	}
+	free(txn);
+	return 0;
+}
+
+/** Flush the shared part of the mapping: the bitmap and the data. */
+static int
+image_flush_data(struct image *image)
+{
+	uint64_t offset = image->super->bitmap_offset;
+	return msync(image->base + offset, image->size - offset, MS_SYNC);
+}
+
+/**
+ * Move the journal to the inode table, and start it over. The
+ * superblock goes last, so a crash in between replays the journal
+ * once again. A clean image has the bitmap flushed too.
+ */
+static int
+image_checkpoint(struct image *image, enum image_state state)
+{
+	spin_lock(&image->lock);
+	struct image_super super = *image->super;
+	spin_unlock(&image->lock);
+	if (state == IMAGE_CLEAN && image_flush_data(image) != 0)
+		return -1;
+	if (image_replay(image->fd, &super) != 0 || fdatasync(image->fd) != 0)
+		return -1;
+	super.state = state;
+	if (write_all(image->fd, &super, sizeof(super), 0) != 0 ||
+	    fdatasync(image->fd) != 0)
+		return -1;
+	image->super->journal_seq = super.journal_seq;
+	image->journal_seq = super.journal_seq;
+	image->journal_used = 0;
+	return 0;
+}
+
+int
+image_open(struct image *image, const char *path, size_t size)
+{
+	memset(image, 0, sizeof(*image));
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	struct image_super super;
+	if (fstat(fd, &st) != 0)
+		goto fail;
+	if (st.st_size == 0) {
+		if (ftruncate(fd, size) != 0)
+			goto fail;
+		image_layout(&super, size);
+	} else {
+		size = st.st_size;
+		if (pread(fd, &super, sizeof(super), 0) != sizeof(super))
+			goto fail;
+	}
+	if (super.magic != image_magic || super.version != IMAGE_VERSION ||
+	    super.size != size || super.unit_count == 0)
+		goto fail;
+	bool is_crashed = super.state != IMAGE_CLEAN;
+	/*
+	 * The commits after the last checkpoint are applied again, and
+	 * a crash from now on is seen on the next open.
+	 */
+	if (image_replay(fd, &super) != 0)
+		goto fail;
+	super.state = IMAGE_OPEN;
+	if (write_all(fd, &super, sizeof(super), 0) != 0 || fdatasync(fd) != 0)
+		goto fail;
+
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+	if (base == MAP_FAILED)
+		goto fail;
+	/* The superblock and the inodes change in memory only. */
+	if (mmap(base, super.bitmap_offset, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+		goto fail_unmap;
+	image->base = base;
+	image->super = (struct image_super *)base;
+	image->inodes = (struct image_inode *)(base + super.inode_offset);
+	image->bitmap = (uint64_t *)(base + super.bitmap_offset);
+	image->size = size;
+	image->fd = fd;
+	image->journal_seq = super.journal_seq;
+	image->dirty = malloc(super.inode_count * sizeof(uint32_t));
+	image->is_dirty = calloc(super.inode_count, sizeof(bool));
+	image->txn = malloc(txn_size(super.inode_count));
+	if (image->dirty == NULL || image->is_dirty == NULL ||
+	    image->txn == NULL) {
+		free(image->dirty);
+		free(image->is_dirty);
+		free(image->txn);
+		goto fail_unmap;
+	}
+	if (is_crashed) {
+		memset(image->bitmap, 0, super.journal_offset -
+		       super.bitmap_offset);
+		image->is_rebuilding = true;
+	}
+#ifdef __GLIBC__
+	/* Commits should not starve behind the changes. */
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&image->change_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+#else
+	pthread_rwlock_init(&image->change_lock, NULL);
+#endif
+	pthread_mutex_init(&image->commit_lock, NULL);
+	pthread_cond_init(&image->commit_cond, NULL);
+	return 0;
+fail_unmap:
+	munmap(base, size);
+fail:
+	close(fd);
+	return -1;
+}
+
+void
+image_close(struct image *image)
+{
+	/* A bitmap, not rebuilt in full, is rebuilt on the next open. */
+	if (image_commit(image) == 0)
+		image_checkpoint(image, image->is_rebuilding ? IMAGE_OPEN :
+				 IMAGE_CLEAN);
+	munmap(image->base, image->size);
+	close(image->fd);
+	free(image->dirty);
+	free(image->is_dirty);
+	free(image->freed);
+	free(image->released);
+	free(image->txn);
+	pthread_rwlock_destroy(&image->change_lock);
+	pthread_mutex_destroy(&image->commit_lock);
+	pthread_cond_destroy(&image->commit_cond);
+	image->base = NULL;
+}
+
+void
+image_set_shared(struct image *image, bool is_shared)
+{
+	image->is_shared = is_shared;
+}
+
+void
+image_change_begin(struct image *image)
+{
+	if (image->is_shared)
+		pthread_rwlock_rdlock(&image->change_lock);
+}
+
+void
+image_change_end(struct image *image)
+{
+	if (image->is_shared)
+		pthread_rwlock_unlock(&image->change_lock);
+	/* A transaction should fit the journal half. */
+	uint32_t limit = image->super->inode_count / 4 + 1;
+	if (__atomic_load_n(&image->needs_commit, __ATOMIC_RELAXED) ||
+	    __atomic_load_n(&image->dirty_count, __ATOMIC_RELAXED) >= limit)
+		image_commit(image);
+}
+
+void
+image_inode_dirty(struct image *image, struct image_inode *inode)
+{
+	uint32_t i = inode - image->inodes;
+	if (__atomic_load_n(&image->is_dirty[i], __ATOMIC_RELAXED) ||
+	    __atomic_exchange_n(&image->is_dirty[i], true, __ATOMIC_RELAXED))
+		return;
+	spin_lock(&image->lock);
+	image->dirty[image->dirty_count] = i;
+	__atomic_store_n(&image->dirty_count, image->dirty_count + 1,
+			 __ATOMIC_RELAXED);
+	spin_unlock(&image->lock);
+}
+
+/**
+ * Take the dirty inodes into a transaction, and the freed data to
+ * be released after it. The changes in progress are waited for.
+ */
+static uint32_t
+image_snapshot(struct image *image)
+{
+	if (image->is_shared)
+		pthread_rwlock_wrlock(&image->change_lock);
+	struct image_txn *txn = (struct image_txn *)image->txn;
+	struct image_record *record = (struct image_record *)(txn + 1);
+	for (uint32_t i = 0; i < image->dirty_count; ++i, ++record) {
+		uint32_t index = image->dirty[i];
+		record->index = index;
+		record->reserved = 0;
+		memcpy(&record->inode, &image->inodes[index],
+		       sizeof(record->inode));
+		image->is_dirty[index] = false;
+	}
+	txn->count = image->dirty_count;
+	__atomic_store_n(&image->dirty_count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&image->needs_commit, false, __ATOMIC_RELAXED);
+	/* Unpins free data out of the changes. */
+	spin_lock(&image->lock);
+	struct image_extent *released = image->freed;
+	uint32_t released_capacity = image->freed_capacity;
+	uint32_t released_count = image->freed_count;
+	image->freed = image->released;
+	image->freed_capacity = image->released_capacity;
+	image->freed_count = 0;
+	spin_unlock(&image->lock);
+	image->released = released;
+	image->released_capacity = released_capacity;
+	++image->txn_id;
+	if (image->is_shared)
+		pthread_rwlock_unlock(&image->change_lock);
+	return released_count;
+}
+
+/** Clear the units in the bitmap, the lock is held. */
+static void
+image_release(struct image *image, uint64_t offset, int order)
+{
+	uint64_t unit = (offset - image->super->data_offset) /
+			IMAGE_UNIT_SIZE;
+	uint64_t w = unit / 64;
+	if (order >= 6) {
+		memset(&image->bitmap[w], 0,
+		       (1ull << (order - 6)) * sizeof(uint64_t));
+	} else {
+		uint64_t mask = (1ull << (1 << order)) - 1;
+		image->bitmap[w] &= ~(mask << (unit % 64));
+	}
+	/* Keep the data compact, reuse the lowest free space first. */
+	if (w < image->word_hint[order])
+		image->word_hint[order] = w;
+}
+
+/**
+ * Write the snapshot: the data goes first, so the committed inodes
+ * never refer to data, which is not in the file.
+ */
+static int
+image_write_txn(struct image *image, uint32_t released_count)
+{
+	if (image_flush_data(image) != 0)
+		return -1;
+	struct image_txn *txn = (struct image_txn *)image->txn;
+	if (txn->count > 0) {
+		size_t size = txn_size(txn->count);
+		if (image->journal_used + size > image->super->journal_size &&
+		    image_checkpoint(image, IMAGE_OPEN) != 0)
+			return -1;
+		txn->magic = txn_magic;
+		txn->seq = image->journal_seq;
+		txn->reserved = 0;
+		txn->checksum = txn_checksum(txn);
+		if (write_all(image->fd, txn, size,
+			      image->super->journal_offset +
+			      image->journal_used) != 0 ||
+		    fdatasync(image->fd) != 0)
+			return -1;
+		++image->journal_seq;
+		image->journal_used += size;
+	}
+	spin_lock(&image->lock);
+	for (uint32_t i = 0; i < released_count; ++i)
+		image_release(image, image->released[i].offset,
+			      image->released[i].order);
+	spin_unlock(&image->lock);
+	if (image->journal_used > image->super->journal_size / 2)
+		return image_checkpoint(image, IMAGE_OPEN);
+	return 0;
+}
+
+int
+image_commit(struct image *image)
+{
+	pthread_mutex_lock(&image->commit_lock);
+	/* The changes, finished by now, are in this transaction. */
+	uint64_t id = image->txn_id;
+	while (image->is_committing && image->committed_id <= id)
+		pthread_cond_wait(&image->commit_cond, &image->commit_lock);
+	if (image->committed_id > id || image->commit_rc != 0) {
+		int rc = image->commit_rc;
+		pthread_mutex_unlock(&image->commit_lock);
+		return rc;
+	}
+	/* Others wait for this commit, and go in the next one. */
+	image->is_committing = true;
+	uint32_t released_count = image_snapshot(image);
+	pthread_mutex_unlock(&image->commit_lock);
+
+	int rc = image_write_txn(image, released_count);
+
+	pthread_mutex_lock(&image->commit_lock);
+	if (rc != 0)
+		image->commit_rc = -1;
+	image->committed_id = id + 1;
+	image->is_committing = false;
+	pthread_cond_broadcast(&image->commit_cond);
+	rc = image->commit_rc;
+	pthread_mutex_unlock(&image->commit_lock);
+	return rc;
+}
+
+bool
+image_reclaim(struct image *image)
+{
+	spin_lock(&image->lock);
+	bool has_freed = image->freed_count > 0;
+	spin_unlock(&image->lock);
+	if (!has_freed)
+		return false;
+	/*
+	 * A commit now would wait for the change, which calls it, or
+	 * take its half done inodes.
+	 */
+	__atomic_store_n(&image->needs_commit, true, __ATOMIC_RELAXED);
+	return true;
+}
+
+uint32_t
+image_inode_count(const struct image *image)
+{
+	return image->super->inode_used;
+}
+
+struct image_inode *
+image_inode_alloc(struct image *image)
+{
+	struct image_super *super = image->super;
+	struct image_inode *inode = NULL;
+	spin_lock(&image->lock);
+	for (uint32_t n = 0; n < super->inode_count; ++n) {
+		uint32_t i = (image->inode_hint + n) % super->inode_count;
+		if (image->inodes[i].state != IMAGE_INODE_FREE)
+			continue;
+		inode = &image->inodes[i];
+		image->inode_hint = i + 1;
+		if (i >= super->inode_used)
+			super->inode_used = i + 1;
+		break;
+	}
+	if (inode != NULL) {
+		memset(inode, 0, sizeof(*inode));
+		inode->state = IMAGE_INODE_USED;
+	}
+	spin_unlock(&image->lock);
+	if (inode != NULL)
+		image_inode_dirty(image, inode);
+	return inode;
+}
+
+void
+image_inode_free(struct image *image, struct image_inode *inode)
+{
+	spin_lock(&image->lock);
+	inode->state = IMAGE_INODE_FREE;
+	spin_unlock(&image->lock);
+	image_inode_dirty(image, inode);
+}
+
+/** Find and take 2^order units, order >= 6 takes whole words. */
+static uint64_t
+image_alloc_words(struct image *image, int order)
+{
+	uint64_t word_count = image->super->unit_count / 64;
+	uint64_t words = 1ull << (order - 6);
+	/* The hint is kept aligned, and so is the word count. */
+	for (uint64_t n = 0; n < word_count; n += words) {
+		uint64_t w = (image->word_hint[order] + n) % word_count;
+		uint64_t i = 0;
+		while (i < words && image->bitmap[w + i] == 0)
+			++i;
+		if (i < words)
+			continue;
+		memset(&image->bitmap[w], 0xff, words * sizeof(uint64_t));
+		image->word_hint[order] = (w + words) % word_count;
+		return w * 64;
+	}
+	return UINT64_MAX;
+}
+
+/** Find and take 2^order units inside one word, order < 6. */
+static uint64_t
+image_alloc_bits(struct image *image, int order)
+{
+	uint64_t word_count = image->super->unit_count / 64;
+	int bits = 1 << order;
+	uint64_t mask = (1ull << bits) - 1;
+	for (uint64_t n = 0; n < word_count; ++n) {
+		uint64_t w = (image->word_hint[order] + n) % word_count;
+		uint64_t word = image->bitmap[w];
+		if (word == UINT64_MAX)
+			continue;
+		for (int b = 0; b < 64; b += bits) {
+			if (((word >> b) & mask) != 0)
+				continue;
+			image->bitmap[w] = word | (mask << b);
+			image->word_hint[order] = w;
+			return w * 64 + b;
+		}
+	}
+	return UINT64_MAX;
+}
+
+uint64_t
+image_alloc(struct image *image, int order)
+{
+	spin_lock(&image->lock);
+	uint64_t unit = order >= 6 ? image_alloc_words(image, order) :
+				     image_alloc_bits(image, order);
+	spin_unlock(&image->lock);
+	if (unit == UINT64_MAX)
+		return 0;
+	return image->super->data_offset + unit * IMAGE_UNIT_SIZE;
+}
+
+void
+image_free(struct image *image, uint64_t offset, int order)
+{
+	spin_lock(&image->lock);
+	if (image->freed_count == image->freed_capacity) {
+		uint32_t capacity = image->freed_capacity == 0 ? 64 :
+				    image->freed_capacity * 2;
+		struct image_extent *freed =
+			realloc(image->freed, capacity * sizeof(*freed));
+		/* The data is lost till a crash, but is never reused. */
+		if (freed == NULL) {
+			spin_unlock(&image->lock);
+			return;
+		}
+		image->freed = freed;
+		image->freed_capacity = capacity;
+	}
+	image->freed[image->freed_count].offset = offset;
+	image->freed[image->freed_count].order = order;
+	++image->freed_count;
+	spin_unlock(&image->lock);
+}
+
+void
+image_prefetch(struct image *image, const char *data, size_t size)
+{
+	(void)image;
+	uintptr_t start = (uintptr_t)data & ~(uintptr_t)(IMAGE_PAGE_SIZE - 1);
+	/* Only an advice, an error is not a reason to fail a read. */
+	madvise((void *)start, (uintptr_t)data + size - start, MADV_WILLNEED);
+}
+
+void
+image_mark(struct image *image, uint64_t offset, int order)
+{
+	uint64_t unit = (offset - image->super->data_offset) /
+			IMAGE_UNIT_SIZE;
+	uint64_t w = unit / 64;
+	if (order >= 6) {
+		memset(&image->bitmap[w], 0xff,
+		       (1ull << (order - 6)) * sizeof(uint64_t));
+	} else {
+		uint64_t mask = (1ull << (1 << order)) - 1;
+		image->bitmap[w] |= mask << (unit % 64);
+	}
+}
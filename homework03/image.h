@@ -0,0 +1,261 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Image file of a persistent FS. The image is mapped into memory
+ * as a whole, shared with the file, and consists of:
+ *
+ * - the superblock with the layout of the rest;
+ * - the inode table, one inode per file;
+ * - the bitmap of the data units, one bit per unit;
+ * - the journal of the inode changes;
+ * - the data region, split into units of IMAGE_UNIT_SIZE.
+ *
+ * Data is allocated by aligned runs of 2^order units, so a block of
+ * any power of two size is found right in the bitmap. Everything
+ * refers to data by offsets from the image start, so the image can
+ * be mapped at any address. Nothing is read on open, the pages are
+ * faulted in when touched.
+ *
+ * The superblock and the inodes are mapped privately, so the
+ * changes don't reach the file by themselves. They are made in
+ * changes, see image_change_begin(), and a commit writes the
+ * inodes, changed since the previous one, to the journal in one
+ * transaction, which many changes share. A checkpoint moves the
+ * journal to the inode table, when the journal is half full and on
+ * close. On open the journal after the last checkpoint is applied
+ * again, so after a crash the inodes are as of the last commit.
+ * The data goes right to the file, and is flushed before each
+ * commit. Freed data is not reused until the commit, so it is
+ * never overwritten while the committed inodes refer to it. The
+ * bitmap is not journaled, after a crash it is built again from
+ * the inodes, see image_mark().
+ *
+ * Allocations are thread-safe. Changes and commits are too, after
+ * image_set_shared().
+ */
+
+enum {
+	/** Smallest allocation in the data region. */
+	IMAGE_UNIT_SIZE = 512,
+	/** How many blocks an inode has, enough for the biggest file. */
+	IMAGE_INODE_BLOCKS = 112,
+	/** Size of a name in an inode, with the terminating zero. */
+	IMAGE_NAME_SIZE = 112,
+	/** Biggest allocation is 2^(IMAGE_MAX_ORDER - 1) units. */
+	IMAGE_MAX_ORDER = 12,
+};
+
+enum image_inode_state {
+	IMAGE_INODE_FREE = 0,
+	IMAGE_INODE_USED,
+	/**
+	 * The file is deleted, but was still open. Its inode and data
+	 * are freed on the next open of the image.
+	 */
+	IMAGE_INODE_UNLINKED,
+	/** A directory. It has no data, only files refer to it. */
+	IMAGE_INODE_DIR,
+};
+
+struct image_inode {
+	/** One of enum image_inode_state. */
+	uint32_t state;
+	/** Inode index of the directory plus 1, 0 for the root. */
+	uint32_t parent;
+	/** File size in bytes. */
+	uint64_t size;
+	/** Offsets of the file blocks in the image, 0 for a hole. */
+	uint64_t blocks[IMAGE_INODE_BLOCKS];
+	/** Name in the directory, not the whole path. */
+	char name[IMAGE_NAME_SIZE];
+};
+
+/** Freed data, which waits for a commit. */
+struct image_extent {
+	uint64_t offset;
+	int order;
+};
+
+struct image_super;
+
+struct image {
+	/** Start of the mapping, the superblock is there. */
+	char *base;
+	struct image_super *super;
+	struct image_inode *inodes;
+	uint64_t *bitmap;
+	/** Size of the mapping. */
+	size_t size;
+	/** Image file descriptor. */
+	int fd;
+	/** Where to start the search of a free inode. */
+	uint32_t inode_hint;
+	/** Where to start the search of free units, per order. */
+	uint64_t word_hint[IMAGE_MAX_ORDER];
+	/** Spinlock of the allocations and of the lists below. */
+	int lock;
+	/** Whether the image is used by several threads. */
+	bool is_shared;
+	/**
+	 * The bitmap is lost in a crash. Then it is empty after open,
+	 * and the owner marks all the used data in it before any
+	 * allocation.
+	 */
+	bool is_rebuilding;
+	/** Inodes changed since the last commit, and their flags. */
+	uint32_t *dirty;
+	uint32_t dirty_count;
+	bool *is_dirty;
+	/** Data freed since the last commit. */
+	struct image_extent *freed;
+	uint32_t freed_count;
+	uint32_t freed_capacity;
+	/** Freed data of the commit in progress. */
+	struct image_extent *released;
+	uint32_t released_capacity;
+	/** Transaction of the commit in progress. */
+	char *txn;
+	/** Sequence number of the next transaction in the journal. */
+	uint64_t journal_seq;
+	/** Bytes of the journal taken since the last checkpoint. */
+	uint64_t journal_used;
+	/** A commit is asked by a change, which could not do it. */
+	bool needs_commit;
+	/**
+	 * Changes in progress hold it for read, a commit takes it for
+	 * write to see the inodes between the changes.
+	 */
+	pthread_rwlock_t change_lock;
+	/** Commits, one at a time, and the waiters of their results. */
+	pthread_mutex_t commit_lock;
+	pthread_cond_t commit_cond;
+	bool is_committing;
+	/** Changes since the last commit go to this transaction. */
+	uint64_t txn_id;
+	uint64_t committed_id;
+	/** A failed commit fails all the next ones. */
+	int commit_rc;
+};
+
+/**
+ * Open the image at @a path, or create it of @a size bytes, if the
+ * file does not exist or is empty.
+ * @retval 0 Success.
+ * @retval -1 The file can't be opened or mapped, or it is not an
+ *     image.
+ */
+int
+image_open(struct image *image, const char *path, size_t size);
+
+/**
+ * Commit the changes, make a checkpoint, flush the image to the
+ * file and unmap it.
+ */
+void
+image_close(struct image *image);
+
+/**
+ * How many inodes were ever used. All the inodes behind are free,
+ * so iteration over the files stops there.
+ */
+uint32_t
+image_inode_count(const struct image *image);
+
+static inline struct image_inode *
+image_inode_at(const struct image *image, uint32_t i)
+{
+	return &image->inodes[i];
+}
+
+static inline uint32_t
+image_inode_index(const struct image *image, const struct image_inode *inode)
+{
+	return inode - image->inodes;
+}
+
+/** Set whether the image is used by several threads. */
+void
+image_set_shared(struct image *image, bool is_shared);
+
+/**
+ * Begin a change of the inodes. The inode changes from the begin
+ * to the end go to one commit. A change can't be nested.
+ */
+void
+image_change_begin(struct image *image);
+
+/** End a change of the inodes, commit if the changes are many. */
+void
+image_change_end(struct image *image);
+
+/** The inode is changed, so it goes to the next commit. */
+void
+image_inode_dirty(struct image *image, struct image_inode *inode);
+
+/**
+ * Make all the finished changes durable. Several threads commit
+ * with one flush, when they come at once.
+ * @retval 0 Success.
+ * @retval -1 A write to the file failed, now or before.
+ */
+int
+image_commit(struct image *image);
+
+/**
+ * Make the freed data reusable, when an allocation fails. A commit
+ * is asked of the change in progress, and is done at its end.
+ * @retval true Some data becomes reusable, the change can be tried
+ *     again after it ends.
+ */
+bool
+image_reclaim(struct image *image);
+
+/**
+ * Allocate a zeroed inode in the used state.
+ * @retval NULL The inode table is full.
+ */
+struct image_inode *
+image_inode_alloc(struct image *image);
+
+void
+image_inode_free(struct image *image, struct image_inode *inode);
+
+/**
+ * Allocate 2^@a order units of data.
+ * @retval Offset of the data in the image.
+ * @retval 0 The data region is full.
+ */
+uint64_t
+image_alloc(struct image *image, int order);
+
+/** Free the data. It is reusable after the next commit. */
+void
+image_free(struct image *image, uint64_t offset, int order);
+
+/**
+ * Ask the system to read the data from the file ahead, before it
+ * is touched. It does not wait for the read.
+ */
+void
+image_prefetch(struct image *image, const char *data, size_t size);
+
+/** Mark used data in the bitmap, which is being rebuilt. */
+void
+image_mark(struct image *image, uint64_t offset, int order);
+
+static inline char *
+image_data(const struct image *image, uint64_t offset)
+{
+	return image->base + offset;
+}
+
+static inline uint64_t
+image_offset(const struct image *image, const char *data)
+{
+	return data - image->base;
+}
@@ -0,0 +1,216 @@
+#include "lz.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+enum {
+	/** Matches are at least that long... */
+	LZ_MIN_MATCH = 4,
+	/** ...and at most that far back. */
+	LZ_MAX_OFFSET = 65535,
+	/** The last bytes are always literals, like LZ4 wants... */
+	LZ_LAST_LITERALS = 5,
+	/** ...and the last match starts that far from the end. */
+	LZ_MATCH_LIMIT = 12,
+	/**
+	 * Copies go by chunks of this size, when there is space for
+	 * an overrun, instead of a memcpy() of an exact size.
+	 */
+	LZ_COPY_CHUNK = 16,
+	/** Size of the prefix hash table is 2^this. */
+	LZ_HASH_BITS = 12,
+	/**
+	 * After 2^this misses in a row the search starts to skip
+	 * bytes, so incompressible data is passed quickly.
+	 */
+	LZ_SKIP_TRIGGER = 6,
+};
+
+static inline uint32_t
+lz_read32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/** Write a length continuation: 255s and the rest. */
+static inline char *
+lz_put_length(char *out, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*out++ = (char)255;
+	*out++ = (char)len;
+	return out;
+}
+
+/**
+ * Write a sequence of @a lit_len literals and a match of
+ * @a match_len bytes @a offset back. No match, when the length is 0.
+ */
+static bool
+lz_put_sequence(char **out, char *out_end, const char *literals,
+		size_t lit_len, size_t offset, size_t match_len)
+{
+	size_t need = 1 + lit_len + lit_len / 255 + 1;
+	if (match_len > 0)
+		need += 2 + match_len / 255 + 1;
+	char *o = *out;
+	if ((size_t)(out_end - o) < need)
+		return false;
+	uint8_t *token = (uint8_t *)o++;
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if (lit_len >= 15)
+		o = lz_put_length(o, lit_len - 15);
+	memcpy(o, literals, lit_len);
+	o += lit_len;
+	if (match_len > 0) {
+		*o++ = (char)(offset & 0xff);
+		*o++ = (char)(offset >> 8);
+		size_t len = match_len - LZ_MIN_MATCH;
+		*token |= len >= 15 ? 15 : len;
+		if (len >= 15)
+			o = lz_put_length(o, len - 15);
+	}
+	*out = o;
+	return true;
+}
+
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const char *end = src + size;
+	char *out = dst;
+	char *out_end = dst + capacity;
+	const char *anchor = src;
+	if (size > LZ_MATCH_LIMIT) {
+		const char *limit = end - LZ_MATCH_LIMIT;
+		const char *p = src + 1;
+		unsigned misses = 0;
+		while (p < limit) {
+			uint32_t seq = lz_read32(p);
+			uint32_t h = lz_hash(seq);
+			const char *ref = src + table[h];
+			table[h] = p - src;
+			if (p - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+				p += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+			while (p > anchor && ref > src && p[-1] == ref[-1]) {
+				--p;
+				--ref;
+			}
+			const char *m = p + LZ_MIN_MATCH;
+			const char *r = ref + LZ_MIN_MATCH;
+			const char *match_end = end - LZ_LAST_LITERALS;
+			while (m < match_end && *m == *r) {
+				++m;
+				++r;
+			}
+			if (!lz_put_sequence(&out, out_end, anchor, p - anchor,
+					     p - ref, m - p))
+				return 0;
+			p = anchor = m;
+		}
+	}
+	if (!lz_put_sequence(&out, out_end, anchor, end - anchor, 0, 0))
+		return 0;
+	return out - dst;
+}
+
+/**
+ * Copy @a len bytes by whole chunks. Up to a chunk more is written
+ * and read, the caller checks there is space.
+ */
+static inline void
+lz_wild_copy(char *dst, const char *src, size_t len)
+{
+	char *end = dst + len;
+	do {
+		memcpy(dst, src, LZ_COPY_CHUNK);
+		dst += LZ_COPY_CHUNK;
+		src += LZ_COPY_CHUNK;
+	} while (dst < end);
+}
+
+/** Read a length continuation. */
+static inline bool
+lz_get_length(const uint8_t **in, const uint8_t *in_end, size_t *len)
+{
+	const uint8_t *p = *in;
+	uint8_t b;
+	do {
+		if (p == in_end)
+			return false;
+		b = *p++;
+		*len += b;
+	} while (b == 255);
+	*in = p;
+	return true;
+}
+
+ssize_t
+lz_decompress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	const uint8_t *p = (const uint8_t *)src;
+	const uint8_t *end = p + size;
+	char *o = dst;
+	char *o_end = dst + capacity;
+	while (p < end) {
+		uint8_t token = *p++;
+		size_t len = token >> 4;
+		if (len == 15 && !lz_get_length(&p, end, &len))
+			return -1;
+		if ((size_t)(end - p) < len || (size_t)(o_end - o) < len)
+			return -1;
+		if ((size_t)(end - p) >= len + LZ_COPY_CHUNK &&
+		    (size_t)(o_end - o) >= len + LZ_COPY_CHUNK)
+			lz_wild_copy(o, (const char *)p, len);
+		else
+			memcpy(o, p, len);
+		o += len;
+		p += len;
+		if (p == end)
+			break;
+		if (end - p < 2)
+			return -1;
+		size_t offset = p[0] | (size_t)p[1] << 8;
+		p += 2;
+		len = token & 15;
+		if (len == 15 && !lz_get_length(&p, end, &len))
+			return -1;
+		len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(o - dst) ||
+		    (size_t)(o_end - o) < len)
+			return -1;
+		/*
+		 * The match may overlap the output: the copied part
+		 * repeats, and each chunk can be twice bigger.
+		 */
+		const char *ref = o - offset;
+		if (offset >= LZ_COPY_CHUNK &&
+		    (size_t)(o_end - o) >= len + LZ_COPY_CHUNK) {
+			lz_wild_copy(o, ref, len);
+			o += len;
+			continue;
+		}
+		while (len > 0) {
+			size_t n = o - ref;
+			if (n > len)
+				n = len;
+			memcpy(o, ref, n);
+			o += n;
+			len -= n;
+		}
+	}
+	return o - dst;
+}
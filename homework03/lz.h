@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Small LZ77 codec in the format of LZ4 blocks. A block is a chain
+ * of sequences: a token byte with a length of literals in the high
+ * nibble and a length of a match in the low one, the literals, and
+ * a 2-byte little-endian offset of the match back in the output.
+ * A nibble 15 is continued by bytes, adding up while they are 255.
+ * The last sequence has only literals. Fast rather than tight: the
+ * matches are found greedily through a hash table of 4-byte
+ * prefixes.
+ */
+
+/**
+ * Compress @a size bytes of @a src into @a dst.
+ * @return Size of the compressed data, or 0 if it does not fit
+ *     into @a capacity bytes.
+ */
+size_t
+lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+/**
+ * Decompress @a size bytes of @a src into @a dst. The input is
+ * checked, a broken one is not read or written out of the bounds.
+ * @return Size of the decompressed data, or -1 if the input is
+ *     broken or does not fit into @a capacity bytes.
+ */
+ssize_t
+lz_decompress(const char *src, size_t size, char *dst, size_t capacity);
@@ -0,0 +1,227 @@
+#include "slab.h"
+#include "spin.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+enum {
+	/** Slabs are at least that big... */
+	SLAB_MIN_SIZE = 1024 * 1024,
+	/** ...and fit at least that many objects. */
+	SLAB_MIN_OBJECTS = 8,
+	/** Objects are aligned like malloc() does. */
+	SLAB_ALIGN = 16,
+};
+
+/**
+ * Hidden header before each object. It finds the slab in
+ * slab_free() without a lookup.
+ */
+struct slab_obj {
+	struct slab *slab;
+	/** Next free object, when the object is free. */
+	struct slab_obj *next_free;
+};
+
+/** Header at the start of each slab mapping. */
+struct slab {
+	struct slab_cache *cache;
+	/** Links in the list of all the slabs of the cache. */
+	struct slab *next, *prev;
+	/** Links in the list of slabs with free objects. */
+	struct slab *next_partial, *prev_partial;
+	bool is_partial;
+	/** Freed objects, ready for reuse. */
+	struct slab_obj *free_list;
+	/** How many objects were ever carved, the rest is untouched. */
+	int carved;
+	/** How many objects are allocated. */
+	int used;
+};
+
+static inline size_t
+slab_round(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+/** Offset of the first object in a slab. */
+static inline size_t
+slab_header_size(void)
+{
+	return slab_round(sizeof(struct slab), SLAB_ALIGN);
+}
+
+static inline struct slab_obj *
+slab_obj_at(struct slab *slab, int i)
+{
+	return (struct slab_obj *)((char *)slab + slab_header_size() +
+				   i * slab->cache->stride);
+}
+
+static inline void *
+slab_obj_data(struct slab_obj *obj)
+{
+	return (char *)obj + slab_round(sizeof(*obj), SLAB_ALIGN);
+}
+
+static void
+slab_partial_add(struct slab *slab)
+{
+	struct slab_cache *cache = slab->cache;
+	slab->is_partial = true;
+	slab->prev_partial = NULL;
+	slab->next_partial = cache->partial;
+	if (cache->partial != NULL)
+		cache->partial->prev_partial = slab;
+	cache->partial = slab;
+}
+
+static void
+slab_partial_delete(struct slab *slab)
+{
+	struct slab_cache *cache = slab->cache;
+	slab->is_partial = false;
+	if (slab->prev_partial != NULL)
+		slab->prev_partial->next_partial = slab->next_partial;
+	else
+		cache->partial = slab->next_partial;
+	if (slab->next_partial != NULL)
+		slab->next_partial->prev_partial = slab->prev_partial;
+}
+
+static struct slab *
+slab_new(struct slab_cache *cache)
+{
+	struct slab *slab = mmap(NULL, cache->slab_size,
+				 PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				 -1, 0);
+	if (slab == MAP_FAILED)
+		return NULL;
+	slab->cache = cache;
+	slab->free_list = NULL;
+	slab->carved = 0;
+	slab->used = 0;
+	slab->prev = NULL;
+	slab->next = cache->slabs;
+	if (cache->slabs != NULL)
+		cache->slabs->prev = slab;
+	cache->slabs = slab;
+	++cache->slab_count;
+	slab_partial_add(slab);
+	return slab;
+}
+
+static void
+slab_delete(struct slab *slab)
+{
+	struct slab_cache *cache = slab->cache;
+	if (slab->is_partial)
+		slab_partial_delete(slab);
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		cache->slabs = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+	--cache->slab_count;
+	munmap(slab, cache->slab_size);
+}
+
+void
+slab_cache_create(struct slab_cache *cache, size_t obj_size)
+{
+	cache->obj_size = obj_size;
+	cache->stride = slab_round(sizeof(struct slab_obj), SLAB_ALIGN) +
+			slab_round(obj_size, SLAB_ALIGN);
+	size_t size = cache->stride * SLAB_MIN_OBJECTS;
+	if (size < SLAB_MIN_SIZE)
+		size = SLAB_MIN_SIZE;
+	cache->slab_size = slab_round(slab_header_size() + size, 4096);
+	cache->slab_capacity = (cache->slab_size - slab_header_size()) /
+			       cache->stride;
+	cache->slabs = NULL;
+	cache->partial = NULL;
+	cache->slab_count = 0;
+	cache->used = 0;
+	cache->is_shared = false;
+	cache->lock = 0;
+}
+
+void
+slab_cache_destroy(struct slab_cache *cache)
+{
+	while (cache->slabs != NULL)
+		slab_delete(cache->slabs);
+	cache->used = 0;
+}
+
+void
+slab_cache_set_shared(struct slab_cache *cache, bool is_shared)
+{
+	cache->is_shared = is_shared;
+}
+
+static inline void
+slab_cache_lock(struct slab_cache *cache)
+{
+	if (cache->is_shared)
+		spin_lock(&cache->lock);
+}
+
+static inline void
+slab_cache_unlock(struct slab_cache *cache)
+{
+	if (cache->is_shared)
+		spin_unlock(&cache->lock);
+}
+
+void *
+slab_alloc(struct slab_cache *cache)
+{
+	slab_cache_lock(cache);
+	struct slab *slab = cache->partial;
+	if (slab == NULL && (slab = slab_new(cache)) == NULL) {
+		slab_cache_unlock(cache);
+		return NULL;
+	}
+	struct slab_obj *obj = slab->free_list;
+	if (obj != NULL) {
+		slab->free_list = obj->next_free;
+	} else {
+		/* Carve lazily, so untouched pages stay unmapped. */
+		obj = slab_obj_at(slab, slab->carved++);
+		obj->slab = slab;
+	}
+	if (++slab->used == cache->slab_capacity)
+		slab_partial_delete(slab);
+	++cache->used;
+	slab_cache_unlock(cache);
+	return slab_obj_data(obj);
+}
+
+void
+slab_free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	struct slab_obj *obj = (struct slab_obj *)
+		((char *)ptr - slab_round(sizeof(*obj), SLAB_ALIGN));
+	struct slab *slab = obj->slab;
+	struct slab_cache *cache = slab->cache;
+	slab_cache_lock(cache);
+	obj->next_free = slab->free_list;
+	slab->free_list = obj;
+	--cache->used;
+	if (!slab->is_partial)
+		slab_partial_add(slab);
+	/*
+	 * Keep the slab if it is the only one with free space, so
+	 * alloc-free on a border does not map and unmap each time.
+	 */
+	if (--slab->used == 0 &&
+	    (cache->partial != slab || slab->next_partial != NULL))
+		slab_delete(slab);
+	slab_cache_unlock(cache);
+}
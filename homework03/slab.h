@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Slab allocator for objects of one fixed size. Objects are carved
+ * from big mmap'd slabs, and freed ones are reused through a free
+ * list of their slab. A slab, which becomes empty, is returned to
+ * the system, except one kept per cache to avoid map-unmap thrash
+ * on a border.
+ *
+ * A cache is not thread-safe, unless it is marked shared.
+ */
+
+struct slab;
+
+struct slab_cache {
+	/** Size of one object, as requested. */
+	size_t obj_size;
+	/** Distance between objects in a slab, with the header. */
+	size_t stride;
+	/** How many objects fit into one slab. */
+	int slab_capacity;
+	/** Size of one slab mapping. */
+	size_t slab_size;
+	/** All the slabs of the cache. */
+	struct slab *slabs;
+	/** Slabs, having free objects. */
+	struct slab *partial;
+	/** How many slabs are mapped. */
+	int slab_count;
+	/** How many objects are allocated. */
+	size_t used;
+	/** Whether the cache is used by several threads. */
+	bool is_shared;
+	/** Spinlock of a shared cache. */
+	int lock;
+};
+
+/** Initialize a cache of objects of size @a obj_size. */
+void
+slab_cache_create(struct slab_cache *cache, size_t obj_size);
+
+/**
+ * Free all the slabs of the cache at once, together with all the
+ * objects allocated from it. The cache is empty but usable after.
+ */
+void
+slab_cache_destroy(struct slab_cache *cache);
+
+/**
+ * Make the cache safe to use from several threads at once, or
+ * back. Should be called when no other thread uses the cache.
+ */
+void
+slab_cache_set_shared(struct slab_cache *cache, bool is_shared);
+
+/**
+ * Allocate an object.
+ * @retval NULL Not enough memory.
+ */
+void *
+slab_alloc(struct slab_cache *cache);
+
+/** Free an object, allocated by any cache. NULL is ignored. */
+void
+slab_free(void *ptr);
@@ -0,0 +1,23 @@
+#pragma once
+
+/**
+ * Test-and-test-and-set spinlock for very short critical sections.
+ * A lock is a plain int, zero when free, so it needs no init and
+ * works the same on any platform with GCC atomics.
+ */
+
+static inline void
+spin_lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		/* Spin on a load, so the cache line is not bounced. */
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+			;
+	}
+}
+
+static inline void
+spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
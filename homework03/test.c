@@ -2,7 +2,11 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 static void
 test_open(void)
@@ -436,11 +440,1046 @@ test_resize(void)
 	unit_fail_if(ufs_close(fd2) != 0);
 	unit_fail_if(ufs_close(fd) != 0);
 	unit_fail_if(ufs_delete("file") != 0);
+	/*
+	 * Growing fills the file with zeros, across many blocks.
+	 */
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	rc = ufs_resize(fd, 1500);
+	unit_check(rc == 0, "grow to bigger size");
+	unit_fail_if(ufs_write(fd, "def", 3) != 3);
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	rc = ufs_read(fd2, buffer, sizeof(buffer));
+	unit_check(rc == 1500, "the file has the new size");
+	bool is_zero = true;
+	for (int i = 6; i < 1500 && is_zero; ++i)
+		is_zero = buffer[i] == 0;
+	unit_check(memcmp(buffer, "abcdef", 6) == 0 && is_zero,
+		   "the position is kept and the new space is zeroed");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
 
 	unit_test_finish();
 #endif
 }
 
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	char buf[64];
+	unit_check(ufs_pread(-1, buf, 1, 0) == -1, "pread invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "world", 5, 6) == 5, "pwrite behind the end");
+	unit_check(ufs_pwrite(fd, "hello", 5, 0) == 5, "pwrite at the start");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 11, "pread all");
+	unit_check(memcmp(buf, "hello\0world", 11) == 0,
+		   "the gap is zeroed");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 11) == 0, "pread at EOF");
+	unit_check(ufs_read(fd, buf, 5) == 5 && memcmp(buf, "hello", 5) == 0,
+		   "the position was not moved");
+
+	int ro = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(ro == -1);
+	unit_check(ufs_pwrite(ro, "x", 1, 0) == -1, "pwrite needs write rights");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+
+	char a[3], b[4];
+	struct iovec riov[] = {{a, sizeof(a)}, {b, sizeof(b)}};
+	unit_check(ufs_readv(ro, riov, 2) == 7, "readv fills all buffers");
+	unit_check(memcmp(a, "hel", 3) == 0 && memcmp(b, "lo\0w", 4) == 0,
+		   "in order");
+	unit_check(ufs_readv(ro, riov, 2) == 4 && memcmp(a, "orl", 3) == 0 &&
+		   b[0] == 'd', "readv reads the rest");
+	unit_fail_if(ufs_close(ro) != 0);
+
+	struct iovec wiov[] = {{"12", 2}, {"", 0}, {"345", 3}};
+	unit_check(ufs_writev(fd, wiov, 3) == 5, "writev from the position");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 11 &&
+		   memcmp(buf, "hello12345d", 11) == 0, "data is correct");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/*
+	 * A descriptor remembers its block between the calls. Reads by
+	 * small pieces cross the blocks, while positional I/O jumps
+	 * back and forth.
+	 */
+	enum { SIZE = 100000, STEP = 37 };
+	char *data = malloc(SIZE);
+	for (int i = 0; i < SIZE; ++i)
+		data[i] = i * 7 + i / 1000;
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, data, SIZE, 0) != SIZE);
+	bool ok = true;
+	for (int pos = 0; pos < SIZE && ok; pos += STEP) {
+		int n = pos + STEP > SIZE ? SIZE - pos : STEP;
+		ok = ufs_read(fd, buf, STEP) == n &&
+		     memcmp(buf, data + pos, n) == 0;
+		size_t far = (size_t)pos * 13 % SIZE;
+		ok = ok && ufs_pread(fd, buf, 1, far) == 1 && buf[0] == data[far];
+		if (pos % (STEP * 100) == 0) {
+			data[far] = 'x';
+			ok = ok && ufs_pwrite(fd, "x", 1, far) == 1;
+		}
+	}
+	unit_check(ok, "small reads with positional I/O between");
+	free(data);
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_read_view(void)
+{
+	unit_test_start();
+
+	struct iovec iov[16];
+	unit_check(ufs_readv_view(-1, 10, iov, 16) == -1, "view invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[5000];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	int count = ufs_readv_view(fd2, 3000, iov, 16);
+	unit_check(count > 1, "view spans several blocks");
+	size_t total = 0;
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		ok = ok && memcmp(iov[i].iov_base, buf + total,
+				  iov[i].iov_len) == 0;
+		total += iov[i].iov_len;
+	}
+	unit_check(total == 3000 && ok, "view gives the data");
+	char c;
+	unit_check(ufs_read(fd2, &c, 1) == 1 && c == buf[3000],
+		   "position is moved");
+
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	total = 0;
+	ok = true;
+	for (int i = 0; i < count; ++i) {
+		ok = ok && memcmp(iov[i].iov_base, buf + total,
+				  iov[i].iov_len) == 0;
+		total += iov[i].iov_len;
+	}
+	unit_check(ok, "pinned view survives truncate and delete");
+	unit_check(ufs_readv_view(fd2, 10, iov, 16) == 0, "then EOF");
+	unit_check(ufs_view_release(fd2) == 0, "release the views");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_clone("nonexistent", "copy") == -1, "clone no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* Several blocks, and the last one is not full. */
+	enum { SIZE = 5000 };
+	char buf[SIZE], got[SIZE + 16];
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, SIZE) != SIZE);
+
+	unit_check(ufs_clone("file", "copy") == 0, "clone");
+	int copy = ufs_open("copy", 0);
+	unit_fail_if(copy == -1);
+	unit_check(ufs_read(copy, got, SIZE) == SIZE &&
+		   memcmp(got, buf, SIZE) == 0, "clone has the data");
+
+	unit_fail_if(ufs_pwrite(copy, "XYZ", 3, 1000) != 3);
+	unit_check(ufs_pread(fd, got, SIZE, 0) == SIZE &&
+		   memcmp(got, buf, SIZE) == 0, "source is not changed");
+	unit_fail_if(ufs_pwrite(fd, "123", 3, 10) != 3);
+	unit_check(ufs_pread(copy, got, 20, 0) == 20 &&
+		   memcmp(got, buf, 20) == 0, "clone is not changed");
+	unit_check(ufs_pread(copy, got, 3, 1000) == 3 &&
+		   memcmp(got, "XYZ", 3) == 0, "clone has own write");
+
+	unit_fail_if(ufs_write(fd, "tail", 4) != 4);
+	unit_check(ufs_pread(copy, got, SIZE + 10, 0) == SIZE,
+		   "append to source does not grow the clone");
+	unit_fail_if(ufs_resize(copy, 100) != 0);
+	unit_check(ufs_pread(fd, got, SIZE + 10, 0) == SIZE + 4 &&
+		   memcmp(got + SIZE, "tail", 4) == 0 &&
+		   memcmp(got + 100, buf + 100, 100) == 0,
+		   "truncate of the clone does not cut the source");
+	unit_fail_if(ufs_write(copy, "end", 3) != 3);
+	unit_check(ufs_pread(fd, got, 3, 100) == 3 &&
+		   memcmp(got, buf + 100, 3) == 0,
+		   "append to the cut clone keeps the source");
+
+	unit_check(ufs_clone("file", "copy") == 0, "clone over a file");
+	unit_check(ufs_pread(copy, got, 200, 0) == 103 &&
+		   memcmp(got + 100, "end", 3) == 0,
+		   "old descriptor sees the replaced file");
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	copy = ufs_open("copy", 0);
+	unit_fail_if(copy == -1);
+	unit_check(ufs_read(copy, got, SIZE + 10) == SIZE + 4 &&
+		   memcmp(got, "abcdefghij123", 13) == 0,
+		   "clone outlives the source");
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_small_files(void)
+{
+	unit_test_start();
+
+	/* A small file grows out of its record by any way. */
+	char buf[1000], got[1000];
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, 100) != 100);
+	unit_fail_if(ufs_write(fd, buf + 100, 100) != 100);
+	unit_check(ufs_pread(fd, got, sizeof(got), 0) == 200 &&
+		   memcmp(got, buf, 200) == 0, "append grows a small file");
+	unit_fail_if(ufs_resize(fd, 50) != 0);
+	unit_fail_if(ufs_resize(fd, 300) != 0);
+	unit_check(ufs_pread(fd, got, sizeof(got), 0) == 300 &&
+		   memcmp(got, buf, 50) == 0 && got[50] == 0 && got[299] == 0,
+		   "resize grows it");
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_pwrite(fd, buf, 5, 700) != 5);
+	unit_check(ufs_pread(fd, got, sizeof(got), 0) == 705 &&
+		   memcmp(got, buf, 10) == 0 && got[10] == 0 && got[699] == 0 &&
+		   memcmp(got + 700, buf, 5) == 0, "pwrite behind the end too");
+
+	/* A view keeps the data of a small file, which is cut. */
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_write(fd, "viewed", 6) != 6);
+	int view_fd = ufs_open("small", 0);
+	struct iovec view;
+	unit_fail_if(ufs_readv_view(view_fd, 6, &view, 1) != 1);
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_pwrite(fd, "other!", 6, 0) != 6);
+	unit_check(memcmp(view.iov_base, "viewed", 6) == 0,
+		   "view of a cut small file");
+	unit_fail_if(ufs_close(view_fd) != 0);
+
+	/* A clone has its own copy. */
+	unit_fail_if(ufs_clone("small", "small copy") != 0);
+	int copy = ufs_open("small copy", 0);
+	unit_fail_if(ufs_pwrite(copy, "COPY", 4, 0) != 4);
+	unit_check(ufs_pread(fd, got, 10, 0) == 6 &&
+		   memcmp(got, "other!", 6) == 0, "source of a small clone");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_check(ufs_pread(copy, got, 10, 0) == 6 &&
+		   memcmp(got, "COPYr!", 6) == 0, "small clone outlives it");
+	unit_fail_if(ufs_close(copy) != 0);
+
+	/* Names of any length move in and out of the record. */
+	char name[100];
+	memset(name, 'n', sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	unit_check(ufs_rename("small copy", name) == 0, "rename to a long name");
+	unit_check(ufs_rename(name, "s") == 0, "rename to a short name");
+	fd = ufs_open("s", 0);
+	unit_check(fd != -1 && ufs_read(fd, got, 10) == 6, "file is there");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("s") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_compression(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 300 * 1024 };
+	static char buf[SIZE], got[SIZE];
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = "compressible text "[i % 18] + i / 1000 % 3;
+	ufs_set_compression(true, 0);
+	unit_fail_if(ufs_mkdir("cold dir") != 0);
+	int fd = ufs_open("cold dir/cold", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buf, SIZE) != SIZE);
+	unit_fail_if(ufs_close(fd) != 0);
+	int hot = ufs_open("hot", UFS_CREATE);
+	unit_fail_if(ufs_write(hot, buf, SIZE) != SIZE);
+
+	/* Closed files are compressed, open ones are not. */
+	struct ufs_compression_stats stats;
+	unit_check(ufs_compress() == 0, "compress");
+	ufs_compression_stats(&stats);
+	unit_check(stats.raw_bytes > SIZE / 2 && stats.raw_bytes < SIZE &&
+		   stats.compressed_bytes < stats.raw_bytes / 2,
+		   "the cold file is compressed");
+	unit_check(ufs_pread(hot, got, SIZE, 0) == SIZE &&
+		   memcmp(got, buf, SIZE) == 0, "the hot one is not");
+	unit_fail_if(ufs_close(hot) != 0);
+
+	/* An open decompresses the file. */
+	fd = ufs_open("cold dir/cold", 0);
+	unit_check(ufs_read(fd, got, SIZE) == SIZE &&
+		   memcmp(got, buf, SIZE) == 0, "data after decompression");
+	ufs_compression_stats(&stats);
+	unit_check(stats.decompressed_blocks > 0 && stats.raw_bytes == 0,
+		   "decompression is counted");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* Clones are made of the decompressed data, and are not
+	 * compressed while the blocks are shared. */
+	unit_fail_if(ufs_compress() != 0);
+	unit_check(ufs_clone("cold dir/cold", "copy") == 0, "clone a cold file");
+	unit_fail_if(ufs_delete("hot") != 0);
+	unit_fail_if(ufs_compress() != 0);
+	ufs_compression_stats(&stats);
+	unit_check(stats.raw_bytes == 0, "shared blocks are not compressed");
+	fd = ufs_open("copy", 0);
+	unit_check(ufs_read(fd, got, SIZE) == SIZE &&
+		   memcmp(got, buf, SIZE) == 0, "data of the clone");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* A delete frees the compressed blocks. */
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_fail_if(ufs_compress() != 0);
+	ufs_compression_stats(&stats);
+	unit_fail_if(stats.raw_bytes == 0);
+	unit_fail_if(ufs_delete("cold dir/cold") != 0);
+	ufs_compression_stats(&stats);
+	unit_check(stats.raw_bytes == 0 && stats.compressed_bytes == 0,
+		   "delete of a compressed file");
+
+	/* Recently closed files are not cold yet. */
+	ufs_set_compression(true, 1000 * 1000);
+	fd = ufs_open("warm", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buf, SIZE) != SIZE);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_compress() != 0);
+	ufs_compression_stats(&stats);
+	unit_check(stats.raw_bytes == 0, "warm file is not compressed");
+	unit_fail_if(ufs_delete("warm") != 0);
+	unit_fail_if(ufs_rmdir("cold dir") != 0);
+	ufs_set_compression(false, 0);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 3 * 1024 * 1024 };
+	char *buf = malloc(SIZE), *got = malloc(SIZE);
+	srand(1);
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = rand();
+	ufs_set_dedup(true);
+	const char *names[] = {"copy 1", "copy 2", "zeros 1", "zeros 2"};
+	for (int i = 0; i < 4; ++i) {
+		if (i == 2)
+			memset(buf, 0, SIZE);
+		int fd = ufs_open(names[i], UFS_CREATE);
+		for (int done = 0; done < SIZE; done += 100000) {
+			int size = SIZE - done < 100000 ? SIZE - done : 100000;
+			unit_fail_if(ufs_write(fd, buf + done, size) != size);
+		}
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	struct ufs_dedup_stats stats;
+	ufs_dedup_stats(&stats);
+	unit_check(stats.hashed_bytes >= 4ull * 2 * 1024 * 1024 &&
+		   stats.deduped_bytes >= 2 * 2 * 1024 * 1024,
+		   "equal files share the blocks");
+	uint64_t indexed = stats.indexed_blocks;
+
+	/* A change of a shared block copies it. */
+	int fd1 = ufs_open("copy 1", 0);
+	int fd2 = ufs_open("copy 2", 0);
+	unit_fail_if(ufs_pwrite(fd2, "changed", 7, 2 * 1024 * 1024) != 7);
+	srand(1);
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = rand();
+	unit_check(ufs_pread(fd1, got, SIZE, 0) == SIZE && memcmp(got, buf, SIZE) == 0,
+		   "the other file is intact");
+	unit_check(ufs_pread(fd2, got, SIZE, 0) == SIZE &&
+		   memcmp(got + 2 * 1024 * 1024, "changed", 7) == 0, "the changed file");
+
+	/* A block, owned by one file, is taken out of the table. */
+	unit_fail_if(ufs_pwrite(fd1, "changed", 7, 2 * 1024 * 1024) != 7);
+	ufs_dedup_stats(&stats);
+	unit_check(stats.indexed_blocks < indexed, "the block is changed in place");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	/* Deletes keep the blocks of the other files. */
+	unit_fail_if(ufs_delete("copy 1") != 0);
+	unit_fail_if(ufs_delete("zeros 1") != 0);
+	fd2 = ufs_open("zeros 2", 0);
+	memset(buf, 0, SIZE);
+	unit_check(ufs_read(fd2, got, SIZE) == SIZE && memcmp(got, buf, SIZE) == 0,
+		   "data of a deduplicated file");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("copy 2") != 0);
+	unit_fail_if(ufs_delete("zeros 2") != 0);
+	ufs_dedup_stats(&stats);
+	unit_check(stats.indexed_blocks == 0, "the table is empty");
+	ufs_set_dedup(false);
+	free(buf);
+	free(got);
+
+	unit_test_finish();
+}
+
+/** Take a submission entry of a read or a write. */
+static void
+ring_io(struct ufs_ring *ring, enum ufs_op op, int fd, void *buf,
+	size_t size, size_t offset)
+{
+	struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+	sqe->op = op;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->size = size;
+	sqe->offset = offset;
+	sqe->user_data = op;
+}
+
+static void
+ring_round(bool is_concurrent)
+{
+	ufs_set_concurrent(is_concurrent);
+	struct ufs_ring *ring = ufs_ring_new(6);
+	unit_fail_if(ring == NULL);
+	struct ufs_cqe cqes[8];
+
+	/* An open, and the ring is full at its size. */
+	struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+	sqe->op = UFS_OP_OPEN;
+	sqe->path = "ring";
+	sqe->flags = UFS_CREATE;
+	sqe->user_data = 100;
+	unit_check(ufs_ring_submit(ring) == 1, "submit an open");
+	unit_check(ufs_ring_reap(ring, cqes, 8, 1) == 1 &&
+		   cqes[0].user_data == 100 && cqes[0].result >= 0, "open is done");
+	int fd = cqes[0].result;
+	int count = 0;
+	while ((sqe = ufs_ring_get_sqe(ring)) != NULL) {
+		sqe->op = UFS_OP_CLOSE;
+		sqe->fd = -1;
+		++count;
+	}
+	unit_check(count == 8, "ring size is a power of 2");
+	unit_check(ufs_ring_submit(ring) == 8 &&
+		   ufs_ring_reap(ring, cqes, 8, 8) == 8 &&
+		   cqes[7].result == -1 && cqes[7].error == UFS_ERR_NO_FILE,
+		   "closes of a bad descriptor");
+
+	/* Calls of a batch go in order. */
+	char got[2][8] = {"", ""};
+	ring_io(ring, UFS_OP_WRITE, fd, "abc", 3, 0);
+	ring_io(ring, UFS_OP_WRITE, fd, "def", 3, 0);
+	ring_io(ring, UFS_OP_PREAD, fd, got[0], 8, 2);
+	ring_io(ring, UFS_OP_PWRITE, fd, "X", 1, 0);
+	ring_io(ring, UFS_OP_READ, fd, got[1], 8, 0);
+	ring_io(ring, UFS_OP_PREAD, fd, got[1], 8, 0);
+	ring_io(ring, UFS_OP_CLOSE, fd, NULL, 0, 0);
+	ring_io(ring, UFS_OP_READ, fd, got[1], 8, 0);
+	unit_check(ufs_ring_submit(ring) == 8, "submit a batch");
+	count = 0;
+	while (count < 8)
+		count += ufs_ring_reap(ring, cqes + count, 8 - count, 1);
+	unit_check(cqes[0].result == 3 && cqes[1].result == 3 &&
+		   cqes[2].result == 4 && memcmp(got[0], "cdef", 4) == 0,
+		   "writes and a read");
+	unit_check(cqes[3].result == 1 && cqes[4].result == 0,
+		   "read at the descriptor position");
+	unit_check(cqes[5].result == 6 && memcmp(got[1], "Xbcdef", 6) == 0,
+		   "pwrite is seen");
+	unit_check(cqes[6].result == 0 && cqes[7].result == -1 &&
+		   cqes[7].error == UFS_ERR_NO_FILE, "read after close fails");
+	unit_check(cqes[7].user_data == UFS_OP_READ, "user data");
+
+	/* An unknown op is not run as some other call. */
+	char untouched[4] = "abc";
+	ring_io(ring, (enum ufs_op)42, fd, untouched, 3, 0);
+	unit_check(ufs_ring_submit(ring) == 1 &&
+		   ufs_ring_reap(ring, cqes, 1, 1) == 1 &&
+		   cqes[0].result == -1 &&
+		   cqes[0].error == UFS_ERR_INVALID_ARG &&
+		   memcmp(untouched, "abc", 4) == 0, "unknown op fails");
+	ufs_ring_delete(ring);
+	unit_fail_if(ufs_delete("ring") != 0);
+	ufs_set_concurrent(false);
+}
+
+static void
+test_ring(void)
+{
+	unit_test_start();
+
+	ring_round(false);
+	ring_round(true);
+
+	unit_test_finish();
+}
+
+static void
+test_sparse(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_seek_data(-1, 0) == -1, "seek invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	enum { SIZE = 10 * 1024 * 1024, MIDDLE = 5 * 1024 * 1024 };
+	unit_check(ufs_resize(fd, SIZE) == 0, "grow to 10 MB");
+	unit_check(ufs_seek_hole(fd, 0) == 0, "all is a hole");
+	unit_check(ufs_seek_data(fd, 0) == SIZE, "no data");
+
+	unit_check(ufs_pwrite(fd, "abc", 3, MIDDLE) == 3, "write in the hole");
+	ssize_t data = ufs_seek_data(fd, 0);
+	unit_check(data > 0 && data <= MIDDLE, "data is found");
+	ssize_t hole = ufs_seek_hole(fd, data);
+	unit_check(hole > MIDDLE && hole < SIZE, "hole after the data");
+	unit_check(ufs_seek_data(fd, hole) == SIZE, "no data after");
+	unit_check(ufs_seek_hole(fd, MIDDLE) == hole, "seek from the middle");
+	unit_check(ufs_seek_data(fd, MIDDLE + 1) == MIDDLE + 1,
+		   "seek in the data");
+
+	char buf[8];
+	unit_check(ufs_pread(fd, buf, 5, MIDDLE - 1) == 5 &&
+		   memcmp(buf, "\0abc\0", 5) == 0, "data among zeros");
+	unit_check(ufs_pread(fd, buf, 8, 100) == 8 &&
+		   memcmp(buf, "\0\0\0\0\0\0\0\0", 8) == 0,
+		   "hole reads as zeros");
+	unit_check(ufs_pread(fd, buf, 8, SIZE - 4) == 4, "hole at the end");
+
+	struct iovec iov[4];
+	int rd = ufs_open("file", 0);
+	unit_fail_if(rd == -1);
+	int count = ufs_readv_view(rd, 100, iov, 4);
+	unit_check(count == 1 && iov[0].iov_len == 100 &&
+		   memcmp(iov[0].iov_base, buf, 4) == 0, "view of a hole");
+	unit_fail_if(ufs_close(rd) != 0);
+
+	unit_fail_if(ufs_resize(fd, MIDDLE + 2) != 0);
+	unit_check(ufs_seek_hole(fd, data) == MIDDLE + 2,
+		   "truncate keeps the data");
+	unit_check(ufs_write(fd, "xyz", 3) == 3, "write from the start");
+	unit_check(ufs_write(fd, "tail", 4) == 4, "write into the hole");
+	unit_fail_if(ufs_pwrite(fd, "!", 1, MIDDLE + 2) != 1);
+	unit_check(ufs_pread(fd, buf, 4, 0) == 4 &&
+		   memcmp(buf, "xyzt", 4) == 0, "data at the start");
+	unit_check(ufs_pread(fd, buf, 8, MIDDLE) == 3 &&
+		   memcmp(buf, "ab!", 3) == 0, "append after the data");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_COUNT = 8,
+	THREAD_ITERATIONS = 500,
+	/** Each thread owns a region of the shared file. */
+	THREAD_REGION = 700,
+};
+
+static void *
+test_concurrent_f(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[32], buf[THREAD_REGION], got[THREAD_REGION];
+	sprintf(name, "thread%d", id);
+	int shared = ufs_open("shared", 0);
+	if (shared == -1)
+		return (void *)"open shared";
+	/* The error of another thread is not seen here. */
+	if (ufs_errno() != UFS_ERR_NO_ERR)
+		return (void *)"errno is per thread";
+	const char *err = NULL;
+	for (int i = 0; i < THREAD_ITERATIONS && err == NULL; ++i) {
+		memset(buf, 'a' + (id + i) % 26, sizeof(buf));
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1 || ufs_write(fd, buf, sizeof(buf)) != sizeof(buf))
+			err = "write own file";
+		else if (ufs_pread(fd, got, sizeof(got), 0) != sizeof(got) ||
+			 memcmp(buf, got, sizeof(buf)) != 0)
+			err = "read own file";
+		else if (ufs_close(fd) != 0 || ufs_delete(name) != 0)
+			err = "delete own file";
+		size_t offset = (size_t)id * THREAD_REGION;
+		if (err == NULL &&
+		    ufs_pwrite(shared, buf, sizeof(buf), offset) != sizeof(buf))
+			err = "write shared file";
+		else if (err == NULL &&
+			 (ufs_pread(shared, got, sizeof(got), offset) !=
+			  sizeof(got) || memcmp(buf, got, sizeof(buf)) != 0))
+			err = "read shared file";
+	}
+	ufs_close(shared);
+	return (void *)err;
+}
+
+static void
+test_concurrent(void)
+{
+	unit_test_start();
+
+	ufs_set_concurrent(true);
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, THREAD_COUNT * THREAD_REGION) != 0);
+	unit_check(ufs_open("nonexistent", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "error in the main thread");
+
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_concurrent_f,
+					    (void *)(intptr_t)i) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		void *err;
+		pthread_join(threads[i], &err);
+		if (err != NULL) {
+			unit_msg("thread %d: %s", i, (const char *)err);
+			ok = false;
+		}
+	}
+	unit_check(ok, "threads use own and shared files");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is kept");
+
+	char buf[THREAD_REGION];
+	ok = true;
+	for (int i = 0; i < THREAD_COUNT && ok; ++i) {
+		char c = 'a' + (i + THREAD_ITERATIONS - 1) % 26;
+		ok = ufs_read(fd, buf, sizeof(buf)) == sizeof(buf);
+		for (int j = 0; j < THREAD_REGION && ok; ++j)
+			ok = buf[j] == c;
+	}
+	unit_check(ok, "shared file has the last writes");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+	ufs_set_concurrent(false);
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	/* Mount needs an empty FS. */
+	ufs_destroy();
+	char path[] = "/tmp/ufs_test_XXXXXX";
+	int tmp = mkstemp(path);
+	unit_fail_if(tmp == -1);
+	unit_fail_if(write(tmp, "not an image", 12) != 12);
+	unit_check(ufs_mount(path, 0) == -1, "mount not an image");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_fail_if(ftruncate(tmp, 0) != 0);
+	close(tmp);
+
+	unit_check(ufs_mount(path, 16 * 1024 * 1024) == 0, "create image");
+	enum { SIZE = 5000, BIG = 4 * 1024 * 1024, MIDDLE = 3 * 1024 * 1024 };
+	char buf[SIZE], got[SIZE];
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("a", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, SIZE) != SIZE);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("b", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, BIG) != 0);
+	unit_fail_if(ufs_pwrite(fd, "xyz", 3, MIDDLE) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_clone("a", "c") != 0);
+	fd = ufs_open("c", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "CLONE", 5, 100) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	int ghost = ufs_open("d", UFS_CREATE);
+	unit_fail_if(ghost == -1);
+	unit_fail_if(ufs_write(ghost, buf, SIZE) != SIZE);
+	unit_fail_if(ufs_delete("d") != 0);
+	char name[200];
+	memset(name, 'n', sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	unit_check(ufs_open(name, UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "long name does not fit");
+	ufs_destroy();
+
+	unit_check(ufs_mount(path, 0) == 0, "open image");
+	fd = ufs_open("a", 0);
+	unit_check(fd != -1, "file is there");
+	unit_check(ufs_read(fd, got, SIZE) == SIZE &&
+		   memcmp(got, buf, SIZE) == 0, "with the data");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("c", 0);
+	unit_check(fd != -1 && ufs_read(fd, got, SIZE) == SIZE &&
+		   memcmp(got, buf, 100) == 0 &&
+		   memcmp(got + 100, "CLONE", 5) == 0 &&
+		   memcmp(got + 105, buf + 105, SIZE - 105) == 0,
+		   "clone is there");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("b", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_seek_data(fd, 0) > 0 && ufs_seek_data(fd, 0) <= MIDDLE,
+		   "hole is kept");
+	unit_check(ufs_pread(fd, got, 5, MIDDLE - 1) == 5 &&
+		   memcmp(got, "\0xyz\0", 5) == 0, "data among zeros");
+	unit_check(ufs_pread(fd, got, 10, BIG - 4) == 4, "size is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("d", 0) == -1, "deleted file is dropped");
+
+	/* Freed space is reused. */
+	unit_fail_if(ufs_delete("a") != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+	unit_fail_if(ufs_delete("c") != 0);
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char *mb = calloc(1, 1024 * 1024);
+	size_t total = 0;
+	ssize_t rc;
+	while ((rc = ufs_write(fd, mb, 1024 * 1024)) > 0)
+		total += rc;
+	unit_check(total >= 12 * 1024 * 1024, "space is reused");
+	unit_check(total < 16 * 1024 * 1024 && ufs_errno() == UFS_ERR_NO_MEM,
+		   "image is limited");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* A ring write takes the space, freed in the current transaction. */
+	unit_fail_if(ufs_delete("big") != 0);
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_ring *ring = ufs_ring_new(1);
+	struct ufs_cqe cqe;
+	ring_io(ring, UFS_OP_WRITE, fd, mb, 1024 * 1024, 0);
+	unit_check(ufs_ring_submit(ring) == 1 &&
+		   ufs_ring_reap(ring, &cqe, 1, 1) == 1 &&
+		   cqe.result == 1024 * 1024, "ring write reuses the space");
+	ufs_ring_delete(ring);
+	free(mb);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static void
+fill_pattern(char *buf, int size, int seed)
+{
+	for (int i = 0; i < size; ++i)
+		buf[i] = 'a' + (i + seed) % 26;
+}
+
+static bool
+check_file(const char *name, int size, int seed)
+{
+	char *buf = malloc(size + 1), *expected = malloc(size);
+	fill_pattern(expected, size, seed);
+	int fd = ufs_open(name, 0);
+	bool ok = fd != -1 && ufs_read(fd, buf, size + 1) == size &&
+		  memcmp(buf, expected, size) == 0;
+	if (fd != -1)
+		ufs_close(fd);
+	free(buf);
+	free(expected);
+	return ok;
+}
+
+static bool
+write_file(const char *name, int size, int seed)
+{
+	char *buf = malloc(size);
+	fill_pattern(buf, size, seed);
+	int fd = ufs_open(name, UFS_CREATE);
+	bool ok = fd != -1 && ufs_resize(fd, 0) == 0 &&
+		  ufs_write(fd, buf, size) == size;
+	if (fd != -1)
+		ufs_close(fd);
+	free(buf);
+	return ok;
+}
+
+/** Run the function in a child, which exits as if crashed. */
+static bool
+run_crashed(bool (*func)(const char *), const char *path)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+		_exit(func(path) ? 0 : 1);
+	int status;
+	return pid > 0 && waitpid(pid, &status, 0) == pid &&
+	       WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool
+crash_after_sync(const char *path)
+{
+	if (ufs_mount(path, 16 * 1024 * 1024) != 0 ||
+	    !write_file("a", 5000, 0) || !write_file("b", 300000, 1) ||
+	    ufs_sync() != 0)
+		return false;
+	/* Lost in the crash, and the freed space is not reused. */
+	int fd = ufs_open("b", 0);
+	if (fd == -1 || ufs_resize(fd, 10) != 0)
+		return false;
+	ufs_close(fd);
+	return ufs_delete("a") == 0 && write_file("c", 2000000, 2) &&
+	       write_file("d", 100, 3);
+}
+
+static bool
+crash_after_checkpoints(const char *path)
+{
+	if (ufs_mount(path, 0) != 0)
+		return false;
+	char name[16];
+	/* The journal is a few hundred KB, so it wraps many times. */
+	for (int i = 0; i < 200; ++i) {
+		for (int j = 0; j < 20; ++j) {
+			sprintf(name, "f%d", j);
+			if (!write_file(name, 1000 + i * 10 + j, i + j))
+				return false;
+		}
+		if (ufs_sync() != 0)
+			return false;
+	}
+	return ufs_delete("b") == 0;
+}
+
+static void
+test_journal(void)
+{
+	unit_test_start();
+
+	ufs_destroy();
+	char path[] = "/tmp/ufs_test_XXXXXX";
+	int tmp = mkstemp(path);
+	unit_fail_if(tmp == -1);
+	close(tmp);
+
+	unit_fail_if(!run_crashed(crash_after_sync, path));
+	unit_check(ufs_mount(path, 0) == 0, "mount after a crash");
+	unit_check(check_file("a", 5000, 0), "synced file is there");
+	unit_check(check_file("b", 300000, 1), "with its size and data");
+	unit_check(ufs_open("c", 0) == -1 && ufs_open("d", 0) == -1,
+		   "files after the sync are not");
+	ufs_destroy();
+
+	unit_fail_if(!run_crashed(crash_after_checkpoints, path));
+	unit_check(ufs_mount(path, 0) == 0, "mount after checkpoints");
+	bool ok = true;
+	char name[16];
+	for (int j = 0; j < 20; ++j) {
+		sprintf(name, "f%d", j);
+		ok = ok && check_file(name, 1000 + 199 * 10 + j, 199 + j);
+	}
+	unit_check(ok, "last commit is there");
+	unit_check(check_file("b", 300000, 1), "delete after it is not");
+	unit_check(write_file("big", 12 * 1024 * 1024, 4),
+		   "space is rebuilt");
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+	ufs_destroy();
+
+	/* After a clean unmount the deleted files stay deleted. */
+	unit_check(ufs_mount(path, 0) == 0, "mount after unmount");
+	unit_check(ufs_open("big", 0) == -1 && ufs_open("b", 0) == -1,
+		   "deletes are kept");
+	unit_check(check_file("a", 5000, 0), "and the rest");
+	unit_check(ufs_sync() == 0, "sync");
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
+struct dir_listing {
+	int count;
+	int dir_count;
+	char names[8][16];
+};
+
+static int
+list_dir_f(const struct ufs_dirent *entry, void *ctx)
+{
+	struct dir_listing *listing = ctx;
+	if (listing->count < 8)
+		strcpy(listing->names[listing->count], entry->name);
+	listing->count++;
+	listing->dir_count += entry->is_dir;
+	return 0;
+}
+
+static bool
+has_entry(const struct dir_listing *listing, const char *name)
+{
+	for (int i = 0; i < listing->count && i < 8; ++i) {
+		if (strcmp(listing->names[i], name) == 0)
+			return true;
+	}
+	return false;
+}
+
+static int
+stop_dir_f(const struct ufs_dirent *entry, void *ctx)
+{
+	(void)entry;
+	++*(int *)ctx;
+	return 1;
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("a") == 0, "mkdir");
+	unit_check(ufs_mkdir("/a/b") == 0, "mkdir nested");
+	unit_check(ufs_mkdir("a") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "mkdir existing");
+	unit_check(ufs_mkdir("x/y") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "mkdir without parent");
+	unit_check(ufs_open("a", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "open a directory");
+	unit_check(ufs_open("x/f", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "create in no directory");
+	unit_check(ufs_open("a/", UFS_CREATE) == -1, "empty name");
+
+	int fd = ufs_open("a/b/f", UFS_CREATE);
+	unit_check(fd != -1, "create in a directory");
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("f", 0) == -1, "not in the root");
+	unit_check(ufs_open("a/f", 0) == -1, "not in the parent");
+	fd = ufs_open("/a/b/f", 0);
+	unit_check(fd != -1, "open with a leading slash");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(ufs_open("a/g", UFS_CREATE)) != 0);
+	unit_fail_if(ufs_close(ufs_open("f", UFS_CREATE)) != 0);
+
+	struct dir_listing listing = {0};
+	unit_check(ufs_readdir("a", list_dir_f, &listing) == 0 &&
+		   listing.count == 2 && listing.dir_count == 1 &&
+		   has_entry(&listing, "b") && has_entry(&listing, "g"),
+		   "readdir");
+	memset(&listing, 0, sizeof(listing));
+	unit_check(ufs_readdir("/", list_dir_f, &listing) == 0 &&
+		   listing.count == 2 && has_entry(&listing, "a") &&
+		   has_entry(&listing, "f"), "readdir root");
+	int calls = 0;
+	unit_fail_if(ufs_readdir("a", stop_dir_f, &calls) != 0);
+	unit_check(calls == 1, "readdir stops");
+	unit_check(ufs_readdir("a/g", list_dir_f, &listing) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "readdir a file");
+
+	unit_check(ufs_rmdir("a/b") == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_EMPTY, "rmdir not empty");
+	unit_check(ufs_rmdir("a/g") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "rmdir a file");
+	unit_check(ufs_delete("a/b") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "delete a directory");
+
+	/* The cached path of a moved directory is not used. */
+	fd = ufs_open("a/b/f", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_rename("a/b", "c") == 0, "rename a directory");
+	unit_check(ufs_open("a/b/f", 0) == -1, "old path is gone");
+	char got[3];
+	int fd2 = ufs_open("c/f", 0);
+	unit_check(fd2 != -1 && ufs_read(fd2, got, 3) == 3 &&
+		   memcmp(got, "abc", 3) == 0, "new path works");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_write(fd, "d", 1) == 1, "descriptor survives");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_rename("a", "a/x") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "move into itself");
+	unit_check(ufs_rename("c", "f") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "directory over a file");
+	unit_check(ufs_rename("f", "c") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "file over a directory");
+	unit_check(ufs_rename("c/f", "a/g") == 0, "file replaces a file");
+	fd = ufs_open("a/g", 0);
+	unit_check(fd != -1 && ufs_read(fd, got, 3) == 3 &&
+		   memcmp(got, "dbc", 3) == 0, "with the data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_clone("a/g", "c/h") == 0, "clone into a directory");
+	unit_check(ufs_clone("a/g", "a") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "clone over a directory");
+
+	unit_fail_if(ufs_delete("c/h") != 0);
+	unit_check(ufs_rmdir("c") == 0, "rmdir");
+	unit_check(ufs_open("c/h", UFS_CREATE) == -1, "removed path is gone");
+	unit_fail_if(ufs_delete("a/g") != 0);
+	unit_fail_if(ufs_rmdir("a") != 0);
+	unit_fail_if(ufs_delete("f") != 0);
+
+	/* The tree is kept in the image. */
+	ufs_destroy();
+	char path[] = "/tmp/ufs_test_XXXXXX";
+	int tmp = mkstemp(path);
+	unit_fail_if(tmp == -1);
+	close(tmp);
+	unit_fail_if(ufs_mount(path, 4 * 1024 * 1024) != 0);
+	unit_fail_if(ufs_mkdir("d") != 0 || ufs_mkdir("d/e") != 0 ||
+		     ufs_mkdir("m") != 0);
+	unit_fail_if(!write_file("d/e/f", 3000, 7));
+	unit_fail_if(!write_file("d/g", 100, 8));
+	unit_fail_if(ufs_rename("d/e", "m/e") != 0);
+	unit_fail_if(ufs_sync() != 0);
+	ufs_destroy();
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	unit_check(check_file("m/e/f", 3000, 7), "moved file is there");
+	unit_check(check_file("d/g", 100, 8), "file in a directory too");
+	memset(&listing, 0, sizeof(listing));
+	unit_check(ufs_readdir("m", list_dir_f, &listing) == 0 &&
+		   listing.count == 1 && listing.dir_count == 1,
+		   "directory is there");
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -454,6 +1493,18 @@ main(void)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_positional_io();
+	test_read_view();
+	test_clone();
+	test_small_files();
+	test_compression();
+	test_dedup();
+	test_ring();
+	test_sparse();
+	test_concurrent();
+	test_image();
+	test_journal();
+	test_dirs();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
@@ -1,10 +1,18 @@
 #include "userfs.h"
+#include "image.h"
+#include "lz.h"
+#include "slab.h"
+#include "spin.h"
+#include "thread_pool.h"
+#include <pthread.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <time.h>
 
 long long
 min(long long a, long long b)
@@ -20,48 +28,349 @@ max(long long a, long long b)
 
 enum
 {
-	BLOCK_SIZE = 512,
+	/** Size of the first block of a file. */
+	MIN_BLOCK_SIZE = 512,
+	/** Blocks double in size until this one. */
+	MAX_BLOCK_SIZE = 1024 * 1024,
+	/** How many blocks are growing: 512 B, 1 KB, ..., 1 MB. */
+	GROWING_BLOCK_COUNT = 12,
+	/** File size covered by the growing blocks. */
+	GROWING_BLOCKS_SIZE = MIN_BLOCK_SIZE * ((1 << GROWING_BLOCK_COUNT) - 1),
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/** Files up to this size keep the data in the file record. */
+	INLINE_DATA_SIZE = 128,
+	/** Names shorter than this are kept in the file record. */
+	INLINE_NAME_SIZE = 32,
+	/** The name table is split into 2^NAME_STRIPE_BITS stripes. */
+	NAME_STRIPE_BITS = 6,
+	NAME_STRIPE_COUNT = 1 << NAME_STRIPE_BITS,
+	/** Reads in a row, after which the reader is sequential. */
+	SEQUENTIAL_READS = 2,
+	/** Resolved directory paths are cached in this many entries. */
+	PATH_CACHE_SIZE = 4096,
+	/** Workers of the rings in the concurrent mode. */
+	RING_THREAD_COUNT = 4,
+	/** A batch locks a file for at most that many calls in a row. */
+	RING_RUN_LIMIT = 64,
+	/** Descriptors are allocated by chunks of this size... */
+	FD_CHUNK_SIZE = 1024,
+	/** ...up to this many chunks. */
+	FD_CHUNK_COUNT = 4096,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/**
+ * In the concurrent mode the FS can be used by several threads at
+ * once. Otherwise no locks are taken at all.
+ */
+static bool is_concurrent = false;
+
+/**
+ * Files and blocks are allocated from slab caches, one per block
+ * size. They live in a few big mappings instead of many small
+ * mallocs, and are all freed at once on destroy.
+ */
+static struct slab_cache block_caches[GROWING_BLOCK_COUNT];
+static struct slab_cache file_cache;
+/** Headers of the blocks, which memory is in the image. */
+static struct slab_cache image_block_cache;
+static bool are_caches_created = false;
+
+/**
+ * When the FS is mounted, the files and their data are stored in
+ * the image, see ufs_mount(). The name table and the descriptors
+ * are still in the process memory, and are rebuilt from the image
+ * on mount.
+ */
+static struct image file_image;
+static bool is_mounted = false;
+
+/**
+ * Compression of cold files, see ufs_set_compression(). The stats
+ * are changed atomically: blocks are compressed and decompressed
+ * under the locks of different files.
+ */
+static bool is_compression_enabled = false;
+static uint64_t compression_age_ms;
+static struct ufs_compression_stats compression_stats;
+
+/**
+ * Content table of the full blocks in the dedup mode, see
+ * ufs_set_dedup(), chained through the blocks. A block in the table
+ * is never changed: the only file, having it, takes it out of the
+ * table first, and other files copy it, like a block of a clone.
+ */
+static bool is_dedup_enabled = false;
+static struct block **dedup_table;
+/** How many chains the table has, a power of 2... */
+static uint32_t dedup_capacity;
+/** ...and how many blocks are in them. */
+static uint32_t dedup_count;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Changed under the lock, read atomically. */
+static struct ufs_dedup_stats dedup_stats;
+
+/**
+ * A ring of calls, see ufs_ring_new(). Both queues are indexed by
+ * the same counters: a call and its result are in the same slot,
+ * and an entry is free, when its result is reaped.
+ */
+struct ufs_ring {
+	struct ufs_sqe *sqes;
+	struct ufs_cqe *cqes;
+	unsigned mask;
+	/** Entries, taken by the caller... */
+	unsigned sq_pending;
+	/** ...submitted... */
+	unsigned sq_tail;
+	/** ...completed... */
+	unsigned cq_tail;
+	/** ...and reaped. */
+	unsigned cq_head;
+	/** A worker runs the submitted calls. */
+	bool is_running;
+	/** Task of the last run by a worker, joined before the next. */
+	struct thread_task *task;
+	/** Protects the counters, except the caller's ones. */
+	pthread_mutex_t lock;
+	/** Signaled, when calls are completed. */
+	pthread_cond_t cond;
+};
+
+/**
+ * Rings are run by the workers of this pool in the concurrent mode.
+ * It is created with the first ring, and deleted on destroy.
+ */
+static struct thread_pool *ring_pool;
+static pthread_mutex_t ring_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/**
+ * An allocation of the thread failed while the image has space,
+ * freed in the current transaction. It is reusable after the commit
+ * at the end of the change, and the change can be tried once more.
+ */
+static __thread bool is_reclaim_asked = false;
 
+/**
+ * A file block, allocated in one piece with its memory. Blocks of
+ * a file grow geometrically from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE,
+ * so small files stay small, and big files have few blocks.
+ */
 struct block {
-	/** Block memory. */
-	char *memory;
+	/**
+	 * References to the block: one per each file, having it, and
+	 * one per each view pin. Changed atomically, because readers
+	 * pin blocks under a shared file lock.
+	 */
+	int refs;
+	/**
+	 * How many files have the block. A block of several files is
+	 * not changed, a file copies it first.
+	 */
+	int file_refs;
 	/** How many bytes are occupied. */
 	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
-
-	/* PUT HERE OTHER MEMBERS */
+	/** Size of the block memory. */
+	int size;
+	/**
+	 * Size of the compressed data, or 0 if the block is raw. A
+	 * compressed block keeps the raw size and occupied, but its
+	 * memory is of a smaller size class, see ufs_compress().
+	 */
+	int packed;
+	/** The block is in the content table, see ufs_set_dedup(). */
+	bool is_indexed;
+	/**
+	 * Block memory. It is right after the header, or in the image
+	 * when the FS is mounted.
+	 */
+	char *memory;
+	/** Hash of the data and the next block in the content table. */
+	uint64_t hash;
+	struct block *dedup_next;
 };
 
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * Array of file blocks, indexed by block_index(offset). All
+	 * the blocks except the last one are full, so any offset is
+	 * resolved to its block in O(1). NULL is a hole: it takes no
+	 * memory, reads as zeros, and gets a block on the first write.
+	 */
+	struct block **blocks;
+	/** How many blocks are in the array above. */
+	int block_count;
+	/** How many blocks the array can hold without growing. */
+	int block_capacity;
+	/** File size in bytes. */
+	size_t size;
+	/**
+	 * How many file descriptors are opened on the file. Protected
+	 * by the name table stripe of the file, like in_list.
 	 */
-	struct block *last_block;
-	/** How many file descriptors are opened on the file. */
 	int refs;
-	/** File name. */
+	/** File name, the last component of its path. */
 	char *name;
+	/** Hash of the name, cached for the name table. */
+	uint32_t hash;
+	/** Directory of the file, NULL for the root and deleted files. */
+	struct file *parent;
+	/**
+	 * Name table of a directory, NULL for a regular file. The root
+	 * has NAME_STRIPE_COUNT stripes, other directories have one.
+	 */
+	struct name_stripe *stripes;
+	int stripe_bits;
 	/** Files are stored in a double-linked list. */
 	struct file *next;
 	struct file *prev;
 
-	size_t bytes_left;
 	bool in_list;
+	/**
+	 * In the concurrent mode reads and views take the lock shared,
+	 * writes and resize take it exclusive.
+	 */
+	pthread_rwlock_t lock;
+	/** Inode of the file in the image, or NULL if not mounted. */
+	struct image_inode *inode;
+	/**
+	 * A small file needs no allocations besides the record. The
+	 * block array of a one block file is this slot...
+	 */
+	struct block *first_block;
+	/**
+	 * ...and the first block of a file under INLINE_DATA_SIZE is
+	 * this one, until the file grows. It is not shared by clones,
+	 * and it is not used when mounted, the image keeps all the data
+	 * in its units. Unused, when it has no refs.
+	 */
+	struct block inline_block;
+	char inline_data[INLINE_DATA_SIZE];
+	/** Storage of a short name. */
+	char inline_name[INLINE_NAME_SIZE];
+	/**
+	 * When the file was closed last, in milliseconds, while the
+	 * compression is on. Protected like refs.
+	 */
+	uint64_t close_time;
+	/**
+	 * How many blocks are compressed. Changed under the exclusive
+	 * file lock, but read atomically by ufs_open() without it.
+	 */
+	int packed_count;
+	/**
+	 * The file is being compressed. Protected by the stripe of the
+	 * file, an open, seeing it, waits and decompresses the file.
+	 */
+	bool is_compressing;
+};
+
+/** A slot of the file name table. */
+struct file_slot {
+	/** Cached hash of the file name to skip most of strcmp. */
+	uint32_t hash;
+	/** NULL if the slot is free, or a tombstone, or a file. */
+	struct file *file;
+};
+
+/**
+ * A stripe of a directory name table. The top bits of a name hash
+ * choose the stripe, and each stripe has its own lock, so opens
+ * and creates of different names rarely wait for each other.
+ *
+ * A stripe is an open addressing hash table with linear probing.
+ * Deleted slots become tombstones, so probe chains are not broken.
+ * The table is rebuilt when used slots, including tombstones, take
+ * a half of it.
+ */
+struct name_stripe {
+	pthread_mutex_t lock;
+	struct file_slot *table;
+	uint32_t capacity;
+	/** How many slots hold files. */
+	uint32_t count;
+	/** How many slots hold files or tombstones. */
+	uint32_t used;
+	/** Files of the stripe in creation order. */
+	struct file *list;
+	/** Last file in the list above for fast append. */
+	struct file *list_last;
+};
+
+static struct name_stripe name_stripes[NAME_STRIPE_COUNT] = {
+	[0 ... NAME_STRIPE_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+/** The root directory, a path is resolved from it. */
+static struct file root_dir = {
+	.name = "",
+	.stripes = name_stripes,
+	.stripe_bits = NAME_STRIPE_BITS,
+	.in_list = true,
+};
+/**
+ * Guards refs of the deleted files, which have no directory and no
+ * stripe anymore.
+ */
+static struct name_stripe deleted_stripe = {.lock = PTHREAD_MUTEX_INITIALIZER};
+/** Marker of a deleted slot. */
+static struct file file_tombstone;
+
+/**
+ * In the concurrent mode the name space is locked shared by the
+ * calls, which resolve paths, and exclusive by the ones, which
+ * unlink or move files, so a directory does not go away during a
+ * lookup. Stripes are locked only under the shared lock.
+ */
+static pthread_rwlock_t name_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * A resolved path of a directory. Deep paths are found in the
+ * cache at once, instead of a lookup per component.
+ */
+struct path_entry {
+	/** Hash of the path. */
+	uint32_t hash;
+	/** The entry is valid while it is equal to path_generation. */
+	uint32_t generation;
+	char *path;
+	struct file *dir;
+};
+
+/**
+ * Directory path cache, direct mapped by the path hash. A rename or
+ * a removal of a directory changes the paths inside it, so they
+ * invalidate all the entries at once by the generation bump. They
+ * are rare, unlike lookups.
+ */
+static struct path_entry path_cache[PATH_CACHE_SIZE];
+static uint32_t path_generation = 1;
+/** Spinlocks of the cache entries in the concurrent mode. */
+static int path_cache_locks[NAME_STRIPE_COUNT];
+
+/** Zeros, viewed in place of holes. Never written, takes no memory. */
+static char hole_memory[MAX_BLOCK_SIZE];
+
+/** A block of the image, found by its offset on mount. */
+struct block_slot {
+	/** 0 if the slot is free. */
+	uint64_t offset;
+	struct block *block;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+/**
+ * Position of an I/O in the file blocks. The block bounds depend
+ * only on the offset, so a cursor stays valid whatever happens to
+ * the file, and a descriptor keeps its cursor between the calls.
+ */
+struct block_cursor {
+	int index;
+	/** File offset of the block start. */
+	size_t start;
+	/** Size of the block. */
+	size_t size;
+};
 
 struct filedesc {
 	struct file *file;
@@ -70,504 +379,3098 @@ struct filedesc {
 	ssize_t offset;
 	bool can_read;
 	bool can_write;
+	/** Next free descriptor in the free stack, when not occupied. */
+	int next_free;
+	/** Blocks, pinned by the views of this descriptor. */
+	struct block **pins;
+	int pin_count;
+	int pin_capacity;
+	/**
+	 * Block of the last I/O. The next one likely starts in this
+	 * block or in the next one, which are found without the index
+	 * computation.
+	 */
+	struct block_cursor cursor;
+	/** End of the last read, and how many reads in a row began so. */
+	size_t read_end;
+	int sequential_reads;
+	/** The last block, read ahead for a sequential reader. */
+	int ahead_index;
 };
 
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * File descriptors, stored inline in chunks. A chunk never moves,
+ * so a descriptor can be used by one thread while another one
+ * opens more. When a file descriptor is closed, its slot is pushed
+ * to the free stack and is taken by the next ufs_open() call. New
+ * slots are taken only when the stack is empty.
  */
-static struct filedesc **file_descriptors = NULL;
+static struct filedesc *file_descriptor_chunks[FD_CHUNK_COUNT];
+/** How many slots were ever taken, occupied or free. */
 static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+/** Top of the free descriptor stack, or -1. */
+static int file_descriptor_free = -1;
+/** Spinlock of the descriptor allocation in the concurrent mode. */
+static int file_descriptor_lock = 0;
 
 // check permission for FD
 bool
 is_permitted(int flags, enum open_flags flag);
 
-// search file in a list
+// search file in a name table stripe by a name of the given length
+struct file *
+search_file(struct name_stripe *stripe, uint32_t hash, const char *name, size_t len);
+
+// make sure the stripe's name table takes one more file, false if
+// it is full and can't grow
+bool
+reserve_file_slot(struct name_stripe *stripe);
+
+// append file to the stripe's files list and name table, false if
+// no memory
+bool
+append_file(struct name_stripe *stripe, struct file *new_file);
+
+// remove file from the stripe's files list and name table
+void
+remove_file(struct name_stripe *stripe, struct file *file);
+
+// remove a deleted file, which lives until its last close
+void
+unlink_file(struct name_stripe *stripe, struct file *file);
+
+// hash a file name of the given length
+uint32_t
+hash_name(const char *name, size_t len);
+
+// get the name table stripe of the hash in the directory
+struct name_stripe *
+get_name_stripe(struct file *dir, uint32_t hash);
+
+// lock the name space in the concurrent mode, exclusive to unlink
+// or move files
+void
+lock_names(bool is_write);
+
+void
+unlock_names(void);
+
+// find the directory of the path and the last component of it, or
+// NULL if the directory does not exist
+struct file *
+resolve_parent(const char *path, const char **name, size_t *len);
+
+// find the directory by a path of the given length, the root for
+// an empty one, or NULL; the path cache is tried first
+struct file *
+find_dir(const char *path, size_t len);
+
+// find the directory by walking the path components
 struct file *
-search_file(const char *filename);
+walk_dir(const char *path, size_t len);
+
+// turn a new file into an empty directory, false if no memory
+bool
+make_dir(struct file *file);
+
+// lock the stripe in the concurrent mode
+void
+lock_name_stripe(struct name_stripe *stripe);
+
+void
+unlock_name_stripe(struct name_stripe *stripe);
+
+// lock the file for reading or writing in the concurrent mode
+void
+lock_file(struct file *file, bool is_write);
+
+void
+unlock_file(struct file *file);
+
+// begin a change of the inodes when mounted, so a commit does not
+// see it half done; changes are not nested
+void
+begin_change(void);
 
-// append file to files list
 void
-append_file(struct file *new_file);
+end_change(void);
 
-// search FREE FD to use
+// take a free FD, or -1 if no memory
 int
 get_fd();
 
-// create empty block on file and append it to list
+// put the FD to the free stack
+void
+put_fd(int fd);
+
+// get an occupied descriptor, or NULL
+struct filedesc *
+get_filedesc(int fd);
+
+// create a file in the directory, not added to the name table yet;
+// when mounted, with the given inode or a new one
+struct file *
+create_file(const char *name, size_t len, uint32_t hash, struct file *parent, struct image_inode *inode);
+
+// put the block into the file at the index, and into its inode
+void
+set_block(struct file *file, int index, struct block *block);
+
+// set the file size, and the size in its inode
+void
+set_file_size(struct file *file, size_t size);
+
+// free the block memory and header
+void
+free_block(struct block *block);
+
+// create the files, stored in the mounted image
+int
+load_files(void);
+
+// create a file from the inode, sharing the blocks via the map
+int
+load_file(struct image_inode *inode, struct file *parent, struct block_slot *map, size_t mask);
+
+// get the directory of the inode among the loaded ones
+struct file *
+inode_parent(struct image_inode *inode, struct file **dirs, uint32_t count);
+
+// find the block with the offset in the map, or a free slot for it
+struct block_slot *
+find_block_slot(struct block_slot *map, size_t mask, uint64_t offset);
+
+// get how many blocks the inode has
+int
+inode_block_count(struct image_inode *inode);
+
+// allocate an empty block to be at the index in a file
 struct block *
-create_block(struct file *file);
+alloc_block(int index);
 
+// make the block array fit the count, false if no memory
 bool
-is_valid_fd(int fd);
+reserve_blocks(struct file *file, int count);
+
+// create empty block on file and append it to the block array
+struct block *
+create_block(struct file *file);
+
+// make the file the only owner of its block, copying it if shared,
+// or filling it with zeros if it is a hole
+struct block *
+own_block(struct file *file, int index);
+
+// get how many bytes of the block at the index are in the file
+static inline ssize_t
+block_occupied(struct file *file, int index);
+
+// grow the file to the size with a hole
+int
+grow_file(struct file *file, size_t new_size);
+
+// find data or a hole at or after the offset
+ssize_t
+seek_file(int fd, size_t offset, bool is_data);
+
+// get index of the block with the given file offset
+static inline int
+block_index(size_t offset);
+
+// get file offset of the block start
+static inline size_t
+block_start(int index);
+
+// get memory size of the block
+static inline int
+block_size(int index);
+
+// move the cursor to the block with the offset, the cursor's block
+// and the next one are found at once
+static inline void
+seek_cursor(struct block_cursor *cursor, size_t offset);
+
+// move the cursor to the next block
+static inline void
+next_cursor(struct block_cursor *cursor);
+
+// get the descriptor's cursor, or the local one for positional I/O,
+// which several threads can do on one descriptor
+struct block_cursor *
+get_cursor(struct filedesc *filedesc, struct block_cursor *local, size_t offset);
+
+// count the read in the sequential ones, and read the next block
+// ahead for a sequential reader of the image
+static inline void
+track_read(struct filedesc *filedesc, size_t offset, ssize_t size);
+
+// read the block after the cursor ahead
+void
+read_ahead(struct filedesc *filedesc);
+
+// append data to the file end
+ssize_t
+append_file_data(struct file *file, const char *buf, size_t size);
+
+// get a descriptor, valid for reading or writing, or set an error
+struct filedesc *
+get_io_filedesc(int fd, bool is_write);
+
+// write or read the buffers via the descriptor, which file is
+// locked by the caller, at the offset, or at the descriptor offset
+// if it is NULL, moving it then
+ssize_t
+locked_write(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset);
+
+ssize_t
+locked_read(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset);
+
+// write the buffers via the descriptor in a change; the rest is
+// written once more if the change ran out of the reclaimable space
+ssize_t
+change_write(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset);
+
+// write the rest of the buffers, which a change left for the space
+// freed in it, in a new change after its commit; takes the result
+// of the first try and returns the total one
+ssize_t
+rewrite_rest(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset, ssize_t rc);
+
+// set the file size in a change, 0 on success, -1 if no memory
+int
+change_size(struct file *file, size_t new_size);
+
+// write the buffers to the file starting at the offset
+ssize_t
+file_write(struct file *file, struct block_cursor *cursor, size_t offset, const struct iovec *iov, int iovcnt);
+
+// read the file into the buffers starting at the offset
+ssize_t
+file_read(struct file *file, struct block_cursor *cursor, size_t offset, const struct iovec *iov, int iovcnt);
 
 // free file's blocks and memory
 void
 free_file_memory(struct file *file);
 
+// free the block array and the name of the file, if not inline
+void
+free_file_buffers(struct file *file);
+
+// set the name of a new or a renamed file, false if no memory
+bool
+set_file_name(struct file *file, const char *name, size_t len);
+
+// whether the block is the inline block of a file
+static inline bool
+is_inline_block(const struct block *block);
+
+// move the data of the inline block to a real first block
+struct block *
+grow_inline_block(struct file *file);
+
+// free the memory of the files in the tree, but not the files
+void
+free_tree_memory(void);
+
+// create the slab caches if not done yet
+void
+create_caches(void);
+
+// drop a reference to the block, free it if it was the last one
+void
+unref_block(struct block *block);
+
+// drop the block from a file
+void
+drop_block(struct block *block);
+
+// unpin all the blocks, viewed via the descriptor
+void
+release_pins(struct filedesc *filedesc);
+
+// drop a reference to the file, free it if it was the last one and
+// the file is deleted; a close also updates the close time
+void
+release_file(struct file *file, bool is_close);
+
+// compress the blocks of a cold locked file, using the scratch buffer
+void
+compress_file(struct file *file, char *buffer);
+
+// decompress the compressed blocks of the file, -1 if no memory
+int
+inflate_file(struct file *file);
+
+// replace the full block with the same one from the content table,
+// or put it there; returns the block, which the file has now
+struct block *
+dedup_block(struct file *file, int index);
+
+// take the block out of the content table, if the file is its only
+// owner; false if another file has got the block meanwhile
+bool
+unindex_block(struct block *block);
+
+// unlink the block from its content table chain under the lock
+void
+remove_indexed_block(struct block *block);
+
+// hash of the block data for the content table
+uint64_t
+hash_block_data(const char *data, size_t size);
+
+void
+lock_dedup(void);
+
+void
+unlock_dedup(void);
+
+// run the submitted calls of the ring till there are none
+void *
+run_ring(void *arg);
+
+// run the calls of the ring from the index to the end, returns the
+// index after the last one
+unsigned
+run_ring_batch(struct ufs_ring *ring, unsigned index, unsigned end);
+
+// whether the op of a submission entry is a known one
+bool
+is_ring_op(enum ufs_op op);
+
+// join and delete the task of the last run of the ring by a worker
+void
+join_ring_task(struct ufs_ring *ring);
+
+// monotonic time in nanoseconds
+uint64_t
+now_ns(void);
+
+// monotonic time in milliseconds
+uint64_t
+now_ms(void);
+
 enum ufs_error_code
 ufs_errno()
 {
 	return ufs_error_code;
 }
 
-int ufs_open(const char *filename, int flags)
+void
+ufs_set_concurrent(bool is_enabled)
 {
-	// search file or create if needed
-	struct file *f = search_file(filename);
-	if (f == NULL)
-	{
-		if (is_permitted(flags, UFS_CREATE))
-		{
-			f = (struct file *)malloc(sizeof(struct file));
-			f->block_list = NULL;
-			f->last_block = NULL;
-			f->prev = NULL;
-			f->next = NULL;
-			f->name = (char *)malloc((strlen(filename) + 1) * sizeof(char));
-			strcpy(f->name, filename);
-			f->refs = 0;
-			f->bytes_left = MAX_FILE_SIZE;
-			f->in_list = true;
-
-			append_file(f);
-		}
-		else
-		{
-			ufs_error_code = UFS_ERR_NO_FILE;
-			return -1;
-		}
-	}
-
-	f->refs++;
-
-	// search for free filedesc and create filedesc
-	int fd = get_fd();
-	struct filedesc *filedesc = (struct filedesc *)malloc(sizeof(struct filedesc));
-	filedesc->file = f;
-	filedesc->is_occupied = true;
-	filedesc->offset = 0;
-	filedesc->can_read = flags == 0 || is_permitted(flags, UFS_CREATE) || is_permitted(flags, UFS_READ_ONLY) || is_permitted(flags, UFS_READ_WRITE);
-	filedesc->can_write = flags == 0 || is_permitted(flags, UFS_CREATE) || is_permitted(flags, UFS_WRITE_ONLY) || is_permitted(flags, UFS_READ_WRITE);
-	file_descriptors[fd] = filedesc;
-	return fd;
+	// the caches are created eagerly, so threads don't race on it
+	create_caches();
+	for (int i = 0; i < GROWING_BLOCK_COUNT; i++)
+		slab_cache_set_shared(&block_caches[i], is_enabled);
+	slab_cache_set_shared(&file_cache, is_enabled);
+	slab_cache_set_shared(&image_block_cache, is_enabled);
+	if (is_mounted)
+		image_set_shared(&file_image, is_enabled);
+	is_concurrent = is_enabled;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+int
+ufs_mount(const char *path, size_t size)
 {
-	if (is_valid_fd(fd) == false)
+	if (image_open(&file_image, path, size) != 0)
 	{
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
+	is_mounted = true;
+	image_set_shared(&file_image, is_concurrent);
+	create_caches();
+	if (load_files() != 0)
+	{
+		ufs_destroy();
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	return 0;
+}
 
-	struct filedesc *filedesc = file_descriptors[fd];
-
-	if (filedesc->can_write == false)
+int
+ufs_sync(void)
+{
+	if (is_mounted && image_commit(&file_image) != 0)
 	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		ufs_error_code = UFS_ERR_IO;
 		return -1;
 	}
+	return 0;
+}
 
-	struct file *file = filedesc->file;
+void
+ufs_set_compression(bool is_enabled, uint64_t age_ms)
+{
+	is_compression_enabled = is_enabled;
+	compression_age_ms = age_ms;
+}
 
-	if (size > file->bytes_left)
+int
+ufs_compress(void)
+{
+	if (!is_compression_enabled || is_mounted)
+		return 0;
+	char *buffer = (char *)malloc(MAX_BLOCK_SIZE);
+	if (buffer == NULL)
 	{
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
+	uint64_t now = now_ms();
+	struct file **stack = NULL;
+	int count = 0, capacity = 0;
+	bool is_ok = true;
+	lock_names(false);
+	struct file *dir = &root_dir;
+	while (dir != NULL && is_ok)
+	{
+		for (int i = 0; i < (1 << dir->stripe_bits) && is_ok; i++)
+		{
+			struct name_stripe *stripe = &dir->stripes[i];
+			lock_name_stripe(stripe);
+			for (struct file *file = stripe->list; file != NULL && is_ok; file = file->next)
+			{
+				if (file->stripes != NULL)
+				{
+					if (count == capacity)
+					{
+						int new_capacity = capacity == 0 ? 16 : capacity * 2;
+						struct file **new_stack = (struct file **)realloc(stack, new_capacity * sizeof(*stack));
+						if (new_stack == NULL)
+						{
+							is_ok = false;
+							break;
+						}
+						stack = new_stack;
+						capacity = new_capacity;
+					}
+					stack[count++] = file;
+					continue;
+				}
+				if (file->refs != 0 || now - file->close_time < compression_age_ms)
+					continue;
+				// the file is locked before the stripe is unlocked,
+				// so an open meanwhile waits for the compression and
+				// decompresses the file back; the stripe is not held
+				// while compressing
+				file->is_compressing = true;
+				lock_file(file, true);
+				unlock_name_stripe(stripe);
+				compress_file(file, buffer);
+				unlock_file(file);
+				lock_name_stripe(stripe);
+				file->is_compressing = false;
+			}
+			unlock_name_stripe(stripe);
+		}
+		dir = count == 0 ? NULL : stack[--count];
+	}
+	unlock_names();
+	free(stack);
+	free(buffer);
+	if (!is_ok)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	return 0;
+}
+
+void
+ufs_compression_stats(struct ufs_compression_stats *stats)
+{
+	stats->raw_bytes = __atomic_load_n(&compression_stats.raw_bytes, __ATOMIC_RELAXED);
+	stats->compressed_bytes = __atomic_load_n(&compression_stats.compressed_bytes, __ATOMIC_RELAXED);
+	stats->decompressed_blocks = __atomic_load_n(&compression_stats.decompressed_blocks, __ATOMIC_RELAXED);
+	stats->decompress_ns = __atomic_load_n(&compression_stats.decompress_ns, __ATOMIC_RELAXED);
+}
+
+void
+ufs_set_dedup(bool is_enabled)
+{
+	is_dedup_enabled = is_enabled;
+}
+
+void
+ufs_dedup_stats(struct ufs_dedup_stats *stats)
+{
+	stats->hashed_bytes = __atomic_load_n(&dedup_stats.hashed_bytes, __ATOMIC_RELAXED);
+	stats->deduped_bytes = __atomic_load_n(&dedup_stats.deduped_bytes, __ATOMIC_RELAXED);
+	stats->indexed_blocks = __atomic_load_n(&dedup_stats.indexed_blocks, __ATOMIC_RELAXED);
+}
+
+int ufs_open(const char *filename, int flags)
+{
+	int fd = get_fd();
+	if (fd == -1)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	// search file or create if needed
+	bool is_create = is_permitted(flags, UFS_CREATE);
+	if (is_create)
+		begin_change();
+	lock_names(false);
+	const char *name;
+	size_t len;
+	struct file *parent = resolve_parent(filename, &name, &len);
+	if (parent == NULL)
+	{
+		unlock_names();
+		if (is_create)
+			end_change();
+		put_fd(fd);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	uint32_t hash = hash_name(name, len);
+	struct name_stripe *stripe = get_name_stripe(parent, hash);
+	lock_name_stripe(stripe);
+	struct file *f = search_file(stripe, hash, name, len);
+	enum ufs_error_code error = UFS_ERR_NO_ERR;
+	if (f == NULL && !is_create)
+		error = UFS_ERR_NO_FILE;
+	else if (f == NULL && (f = create_file(name, len, hash, parent, NULL)) != NULL &&
+		!append_file(stripe, f))
+	{
+		free_file_memory(f);
+		slab_free(f);
+		f = NULL;
+		error = UFS_ERR_NO_MEM;
+	}
+	else if (f == NULL)
+		error = UFS_ERR_NO_MEM;
+	else if (f->stripes != NULL)
+		error = UFS_ERR_NO_PERMISSION;
+	bool is_packed = false;
+	if (error == UFS_ERR_NO_ERR)
+	{
+		f->refs++;
+		is_packed = f->is_compressing;
+	}
+	unlock_name_stripe(stripe);
+	unlock_names();
+	if (is_create)
+		end_change();
+	// a cold file is decompressed on the first open, it is not
+	// compressed again while open
+	if (error == UFS_ERR_NO_ERR && (is_packed || __atomic_load_n(&f->packed_count, __ATOMIC_ACQUIRE) > 0) &&
+		inflate_file(f) != 0)
+	{
+		release_file(f, false);
+		error = UFS_ERR_NO_MEM;
+	}
+	if (error != UFS_ERR_NO_ERR)
+	{
+		put_fd(fd);
+		ufs_error_code = error;
+		return -1;
+	}
+
+	struct filedesc *filedesc = &file_descriptor_chunks[fd / FD_CHUNK_SIZE][fd % FD_CHUNK_SIZE];
+	filedesc->file = f;
+	filedesc->pins = NULL;
+	filedesc->pin_count = 0;
+	filedesc->pin_capacity = 0;
+	filedesc->is_occupied = true;
+	filedesc->offset = 0;
+	filedesc->cursor.index = 0;
+	filedesc->cursor.start = 0;
+	filedesc->cursor.size = block_size(0);
+	filedesc->read_end = 0;
+	filedesc->sequential_reads = 0;
+	filedesc->ahead_index = 0;
+	filedesc->can_read = flags == 0 || is_permitted(flags, UFS_CREATE) || is_permitted(flags, UFS_READ_ONLY) || is_permitted(flags, UFS_READ_WRITE);
+	filedesc->can_write = flags == 0 || is_permitted(flags, UFS_CREATE) || is_permitted(flags, UFS_WRITE_ONLY) || is_permitted(flags, UFS_READ_WRITE);
+	return fd;
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	struct filedesc *filedesc = get_io_filedesc(fd, true);
+	if (filedesc == NULL)
+		return -1;
+
+	struct iovec iov = {(void *)buf, size};
+	return change_write(filedesc, &iov, 1, NULL);
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	struct iovec iov = {buf, size};
+	return ufs_readv(fd, &iov, 1);
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *filedesc = get_io_filedesc(fd, true);
+	if (filedesc == NULL)
+		return -1;
+
+	return change_write(filedesc, iov, iovcnt, NULL);
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *filedesc = get_io_filedesc(fd, false);
+	if (filedesc == NULL)
+		return -1;
+
+	lock_file(filedesc->file, false);
+	ssize_t rc = locked_read(filedesc, iov, iovcnt, NULL);
+	unlock_file(filedesc->file);
+	return rc;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	struct filedesc *filedesc = get_io_filedesc(fd, true);
+	if (filedesc == NULL)
+		return -1;
+
+	struct iovec iov = {(void *)buf, size};
+	return change_write(filedesc, &iov, 1, &offset);
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	struct filedesc *filedesc = get_io_filedesc(fd, false);
+	if (filedesc == NULL)
+		return -1;
+
+	struct iovec iov = {buf, size};
+	lock_file(filedesc->file, false);
+	ssize_t rc = locked_read(filedesc, &iov, 1, &offset);
+	unlock_file(filedesc->file);
+	return rc;
+}
+
+ssize_t
+ufs_seek_data(int fd, size_t offset)
+{
+	return seek_file(fd, offset, true);
+}
+
+ssize_t
+ufs_seek_hole(int fd, size_t offset)
+{
+	return seek_file(fd, offset, false);
+}
+
+int
+ufs_readv_view(int fd, size_t size, struct iovec *out, int max)
+{
+	struct filedesc *filedesc = get_io_filedesc(fd, false);
+	if (filedesc == NULL)
+		return -1;
+
+	struct file *file = filedesc->file;
+	lock_file(file, false);
+	size_t offset = min(filedesc->offset, file->size);
+	int count = 0;
+
+	struct block_cursor *cursor = &filedesc->cursor;
+	while (size > 0 && count < max)
+	{
+		seek_cursor(cursor, offset);
+		int index = cursor->index;
+		if (index >= file->block_count)
+			break;
+
+		struct block *block = file->blocks[index];
+		ssize_t block_offset = offset - cursor->start;
+		ssize_t bytes_to_view = min(block_occupied(file, index) - block_offset, size);
+		if (bytes_to_view <= 0)
+			break;
+
+		// a block is pinned once, however many views it has, and
+		// a hole is not pinned at all
+		bool is_pinned = block == NULL || (filedesc->pin_count > 0 && filedesc->pins[filedesc->pin_count - 1] == block);
+		if (!is_pinned && filedesc->pin_count == filedesc->pin_capacity)
+		{
+			int new_capacity = filedesc->pin_capacity == 0 ? 8 : filedesc->pin_capacity * 2;
+			struct block **new_pins = (struct block **)realloc(filedesc->pins, new_capacity * sizeof(struct block *));
+			if (new_pins == NULL)
+			{
+				ufs_error_code = UFS_ERR_NO_MEM;
+				if (count == 0)
+					count = -1;
+				break;
+			}
+			filedesc->pins = new_pins;
+			filedesc->pin_capacity = new_capacity;
+		}
+		if (!is_pinned)
+		{
+			// other readers may pin the same block right now
+			__atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+			filedesc->pins[filedesc->pin_count++] = block;
+		}
+
+		out[count].iov_base = (block != NULL ? block->memory : hole_memory) + block_offset;
+		out[count].iov_len = bytes_to_view;
+		count++;
+		offset += bytes_to_view;
+		size -= bytes_to_view;
+	}
+	unlock_file(file);
+
+	if (count >= 0)
+		filedesc->offset = offset;
+	return count;
+}
+
+int
+ufs_view_release(int fd)
+{
+	struct filedesc *filedesc = get_filedesc(fd);
+	if (filedesc == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+
+	release_pins(filedesc);
+	return 0;
+}
+
+int ufs_close(int fd)
+{
+	struct filedesc *filedesc = get_filedesc(fd);
+	if (filedesc == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+
+	struct file *file = filedesc->file;
+	release_pins(filedesc);
+	free(filedesc->pins);
+	release_file(file, true);
+	put_fd(fd);
+	return 0;
+}
+
+void
+release_file(struct file *file, bool is_close)
+{
+	// refs and in_list are changed under the stripe lock, so
+	// either the last close or the delete frees the file
+	lock_names(false);
+	struct name_stripe *stripe = file->parent == NULL ? &deleted_stripe :
+		get_name_stripe(file->parent, file->hash);
+	lock_name_stripe(stripe);
+	bool is_last = --file->refs == 0 && file->in_list == false;
+	// the file gets cold since its last close
+	if (is_close && is_compression_enabled)
+		file->close_time = now_ms();
+	unlock_name_stripe(stripe);
+	unlock_names();
+	if (is_last)
+	{
+		begin_change();
+		free_file_memory(file);
+		end_change();
+		slab_free(file);
+	}
+}
+
+int ufs_delete(const char *filename)
+{
+	// the name space is locked exclusive, the stripes are not needed
+	begin_change();
+	lock_names(true);
+	const char *name;
+	size_t len;
+	struct file *parent = resolve_parent(filename, &name, &len);
+	struct file *file = NULL;
+	struct name_stripe *stripe = NULL;
+	if (parent != NULL)
+	{
+		uint32_t hash = hash_name(name, len);
+		stripe = get_name_stripe(parent, hash);
+		file = search_file(stripe, hash, name, len);
+	}
+	if (file == NULL || file->stripes != NULL)
+	{
+		unlock_names();
+		end_change();
+		ufs_error_code = file == NULL ? UFS_ERR_NO_FILE : UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+
+	unlink_file(stripe, file);
+	bool is_unused = file->refs == 0;
+	unlock_names();
+	if (is_unused)
+	{
+		free_file_memory(file);
+		slab_free(file);
+	}
+	end_change();
+	return 0;
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	begin_change();
+	lock_names(false);
+	const char *name;
+	size_t len;
+	struct file *parent = resolve_parent(path, &name, &len);
+	if (parent == NULL)
+	{
+		unlock_names();
+		end_change();
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	uint32_t hash = hash_name(name, len);
+	struct name_stripe *stripe = get_name_stripe(parent, hash);
+	lock_name_stripe(stripe);
+	struct file *dir = NULL;
+	enum ufs_error_code error = UFS_ERR_NO_ERR;
+	if (search_file(stripe, hash, name, len) != NULL)
+		error = UFS_ERR_EXISTS;
+	else if ((dir = create_file(name, len, hash, parent, NULL)) == NULL)
+		error = UFS_ERR_NO_MEM;
+	else if (!make_dir(dir) || !append_file(stripe, dir))
+	{
+		free_file_memory(dir);
+		slab_free(dir);
+		error = UFS_ERR_NO_MEM;
+	}
+	else
+	{
+		if (dir->inode != NULL)
+			dir->inode->state = IMAGE_INODE_DIR;
+	}
+	unlock_name_stripe(stripe);
+	unlock_names();
+	end_change();
+	if (error != UFS_ERR_NO_ERR)
+	{
+		ufs_error_code = error;
+		return -1;
+	}
+	return 0;
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	begin_change();
+	lock_names(true);
+	const char *name;
+	size_t len;
+	struct file *parent = resolve_parent(path, &name, &len);
+	struct file *dir = NULL;
+	struct name_stripe *stripe = NULL;
+	if (parent != NULL)
+	{
+		uint32_t hash = hash_name(name, len);
+		stripe = get_name_stripe(parent, hash);
+		dir = search_file(stripe, hash, name, len);
+	}
+	enum ufs_error_code error = UFS_ERR_NO_ERR;
+	if (dir == NULL)
+		error = UFS_ERR_NO_FILE;
+	else if (dir->stripes == NULL)
+		error = UFS_ERR_NO_PERMISSION;
+	else if (dir->stripes->count > 0)
+		error = UFS_ERR_NOT_EMPTY;
+	else
+	{
+		remove_file(stripe, dir);
+		free_file_memory(dir);
+		slab_free(dir);
+		// the cached paths can lead to the directory
+		path_generation++;
+	}
+	unlock_names();
+	end_change();
+	if (error != UFS_ERR_NO_ERR)
+	{
+		ufs_error_code = error;
+		return -1;
+	}
+	return 0;
+}
+
+int
+ufs_rename(const char *old_path, const char *new_path)
+{
+	begin_change();
+	lock_names(true);
+	const char *old_name, *new_name;
+	size_t old_len, new_len;
+	struct file *old_parent = resolve_parent(old_path, &old_name, &old_len);
+	struct file *new_parent = resolve_parent(new_path, &new_name, &new_len);
+	struct file *file = NULL;
+	struct name_stripe *old_stripe = NULL;
+	if (old_parent != NULL)
+	{
+		uint32_t hash = hash_name(old_name, old_len);
+		old_stripe = get_name_stripe(old_parent, hash);
+		file = search_file(old_stripe, hash, old_name, old_len);
+	}
+	if (file == NULL || new_parent == NULL)
+	{
+		unlock_names();
+		end_change();
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	uint32_t new_hash = hash_name(new_name, new_len);
+	struct name_stripe *new_stripe = get_name_stripe(new_parent, new_hash);
+	struct file *target = search_file(new_stripe, new_hash, new_name, new_len);
+
+	enum ufs_error_code error = UFS_ERR_NO_ERR;
+	if (target != NULL && (target->stripes != NULL || file->stripes != NULL))
+		error = target == file ? UFS_ERR_NO_ERR : UFS_ERR_EXISTS;
+	else if (file->inode != NULL && new_len >= IMAGE_NAME_SIZE)
+		error = UFS_ERR_NO_MEM;
+	// a directory can't move into itself
+	for (struct file *dir = new_parent; dir != NULL; dir = dir->parent)
+	{
+		if (dir == file)
+			error = UFS_ERR_NO_PERMISSION;
+	}
+	// a long name and a name table slot are allocated before
+	// anything is changed
+	if (error == UFS_ERR_NO_ERR && target != file && !reserve_file_slot(new_stripe))
+		error = UFS_ERR_NO_MEM;
+	char *name = NULL;
+	if (error == UFS_ERR_NO_ERR && target != file && new_len >= INLINE_NAME_SIZE &&
+		(name = (char *)malloc(new_len + 1)) == NULL)
+	{
+		error = UFS_ERR_NO_MEM;
+	}
+	if (error != UFS_ERR_NO_ERR || target == file)
+	{
+		unlock_names();
+		end_change();
+		if (error == UFS_ERR_NO_ERR)
+			return 0;
+		ufs_error_code = error;
+		return -1;
+	}
+
+	// a file with the new name is replaced, as if deleted
+	bool is_target_unused = false;
+	if (target != NULL)
+	{
+		unlink_file(new_stripe, target);
+		is_target_unused = target->refs == 0;
+	}
+	remove_file(old_stripe, file);
+	if (file->name != file->inline_name)
+		free(file->name);
+	if (name == NULL)
+		name = file->inline_name;
+	memcpy(name, new_name, new_len);
+	name[new_len] = 0;
+	file->name = name;
+	file->hash = new_hash;
+	file->parent = new_parent;
+	file->in_list = true;
+	// the slot is reserved above
+	append_file(new_stripe, file);
+	if (file->inode != NULL)
+	{
+		strcpy(file->inode->name, name);
+		file->inode->parent = new_parent->inode == NULL ? 0 :
+			image_inode_index(&file_image, new_parent->inode) + 1;
+		image_inode_dirty(&file_image, file->inode);
+	}
+	// the paths inside a moved directory change
+	if (file->stripes != NULL)
+		path_generation++;
+	unlock_names();
+	if (is_target_unused)
+	{
+		free_file_memory(target);
+		slab_free(target);
+	}
+	end_change();
+	return 0;
+}
+
+int
+ufs_readdir(const char *path, ufs_readdir_f cb, void *ctx)
+{
+	lock_names(false);
+	while (*path == '/')
+		path++;
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	struct file *dir = find_dir(path, len);
+	if (dir == NULL)
+	{
+		unlock_names();
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	int rc = 0;
+	for (int i = 0; i < (1 << dir->stripe_bits) && rc == 0; i++)
+	{
+		struct name_stripe *stripe = &dir->stripes[i];
+		lock_name_stripe(stripe);
+		for (struct file *f = stripe->list; f != NULL && rc == 0; f = f->next)
+		{
+			struct ufs_dirent entry = {f->name, f->stripes != NULL};
+			rc = cb(&entry, ctx);
+		}
+		unlock_name_stripe(stripe);
+	}
+	unlock_names();
+	return 0;
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+	int src_fd = ufs_open(src, 0);
+	if (src_fd == -1)
+		return -1;
+	struct file *from = get_filedesc(src_fd)->file;
+
+	// the source is closed out of the change, it can free the file
+	begin_change();
+	lock_names(true);
+	const char *name;
+	size_t len;
+	struct file *parent = resolve_parent(dst, &name, &len);
+	uint32_t hash = 0;
+	struct name_stripe *stripe = NULL;
+	struct file *old = NULL;
+	if (parent != NULL)
+	{
+		hash = hash_name(name, len);
+		stripe = get_name_stripe(parent, hash);
+		old = search_file(stripe, hash, name, len);
+	}
+	struct file *to = NULL;
+	enum ufs_error_code error = UFS_ERR_NO_ERR;
+	if (parent == NULL)
+		error = UFS_ERR_NO_FILE;
+	else if (old != NULL && old->stripes != NULL)
+		error = UFS_ERR_NO_PERMISSION;
+	else if (!reserve_file_slot(stripe) || (to = create_file(name, len, hash, parent, NULL)) == NULL)
+		error = UFS_ERR_NO_MEM;
+	if (error != UFS_ERR_NO_ERR)
+	{
+		unlock_names();
+		end_change();
+		ufs_close(src_fd);
+		ufs_error_code = error;
+		return -1;
+	}
+
+	// the blocks are shared, each one is copied on its first change
+	lock_file(from, false);
+	if (from->block_count > 0)
+	{
+		if (!reserve_blocks(to, from->block_count))
+		{
+			unlock_file(from);
+			free_file_memory(to);
+			slab_free(to);
+			unlock_names();
+			end_change();
+			ufs_close(src_fd);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		memcpy(to->blocks, from->blocks, from->block_count * sizeof(struct block *));
+		to->block_count = from->block_count;
+		if (to->inode != NULL)
+			memcpy(to->inode->blocks, from->inode->blocks, from->block_count * sizeof(uint64_t));
+	}
+	// the inline block lives in the record of its file, it is copied
+	if (to->block_count > 0 && to->blocks[0] != NULL && is_inline_block(to->blocks[0]))
+	{
+		struct block *copy = &to->inline_block;
+		copy->refs = 1;
+		copy->file_refs = 1;
+		copy->occupied = to->blocks[0]->occupied;
+		memcpy(copy->memory, to->blocks[0]->memory, copy->occupied);
+		to->blocks[0] = copy;
+	}
+	for (int i = 0; i < to->block_count; i++)
+	{
+		if (to->blocks[i] == NULL || to->blocks[i] == &to->inline_block)
+			continue;
+		__atomic_add_fetch(&to->blocks[i]->file_refs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&to->blocks[i]->refs, 1, __ATOMIC_RELAXED);
+	}
+	set_file_size(to, from->size);
+	unlock_file(from);
+
+	// a file with the same name is replaced, as if deleted
+	bool is_old_unused = false;
+	if (old != NULL)
+	{
+		unlink_file(stripe, old);
+		is_old_unused = old->refs == 0;
+	}
+	// the slot is reserved above
+	append_file(stripe, to);
+	unlock_names();
+	if (is_old_unused)
+	{
+		free_file_memory(old);
+		slab_free(old);
+	}
+	end_change();
+	ufs_close(src_fd);
+	return 0;
+}
+
+void ufs_destroy(void)
+{
+	// files and blocks go away with their slabs, only the mallocs
+	// inside are freed one by one; deleted files live until their
+	// last descriptor
+	for (int i = 0; i < file_descriptor_count; i++)
+	{
+		struct filedesc *fd = &file_descriptor_chunks[i / FD_CHUNK_SIZE][i % FD_CHUNK_SIZE];
+		if (fd->is_occupied == false)
+			continue;
+
+		free(fd->pins);
+		if (fd->file->in_list)
+			continue;
+
+		struct file *file = fd->file;
+		if (--file->refs == 0)
+			free_file_buffers(file);
+	}
+
+	free_tree_memory();
+	for (int i = 0; i < PATH_CACHE_SIZE; i++)
+	{
+		free(path_cache[i].path);
+		path_cache[i].path = NULL;
+	}
+	path_generation++;
+
+	if (are_caches_created)
+	{
+		for (int i = 0; i < GROWING_BLOCK_COUNT; i++)
+			slab_cache_destroy(&block_caches[i]);
+		slab_cache_destroy(&file_cache);
+		slab_cache_destroy(&image_block_cache);
+	}
+
+	// the files stay in the image
+	if (is_mounted)
+	{
+		image_close(&file_image);
+		is_mounted = false;
+	}
+
+	for (int i = 0; i < FD_CHUNK_COUNT && file_descriptor_chunks[i] != NULL; i++)
+	{
+		free(file_descriptor_chunks[i]);
+		file_descriptor_chunks[i] = NULL;
+	}
+	file_descriptor_count = 0;
+	file_descriptor_free = -1;
+	memset(&compression_stats, 0, sizeof(compression_stats));
+	// the tasks of the deleted rings are joined, the pool is idle;
+	// it is kept for the rings, which are still alive
+	pthread_mutex_lock(&ring_pool_lock);
+	if (ring_pool != NULL && thread_pool_delete(ring_pool) == 0)
+		ring_pool = NULL;
+	pthread_mutex_unlock(&ring_pool_lock);
+	free(dedup_table);
+	dedup_table = NULL;
+	dedup_capacity = dedup_count = 0;
+	memset(&dedup_stats, 0, sizeof(dedup_stats));
+}
+
+struct ufs_ring *
+ufs_ring_new(unsigned entries)
+{
+	if (entries == 0 || entries > (1u << 30))
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	unsigned size = 1;
+	while (size < entries)
+		size *= 2;
+	struct ufs_ring *ring = (struct ufs_ring *)calloc(1, sizeof(*ring));
+	if (ring != NULL)
+	{
+		ring->sqes = (struct ufs_sqe *)calloc(size, sizeof(struct ufs_sqe));
+		ring->cqes = (struct ufs_cqe *)calloc(size, sizeof(struct ufs_cqe));
+	}
+	if (ring == NULL || ring->sqes == NULL || ring->cqes == NULL)
+	{
+		if (ring != NULL)
+		{
+			free(ring->sqes);
+			free(ring->cqes);
+			free(ring);
+		}
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return NULL;
+	}
+	ring->mask = size - 1;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	return ring;
+}
+
+void
+ufs_ring_delete(struct ufs_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	while (ring->is_running)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	pthread_mutex_unlock(&ring->lock);
+	join_ring_task(ring);
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->cond);
+	free(ring->sqes);
+	free(ring->cqes);
+	free(ring);
+}
+
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring)
+{
+	if (ring->sq_pending - ring->cq_head > ring->mask)
+		return NULL;
+	struct ufs_sqe *sqe = &ring->sqes[ring->sq_pending++ & ring->mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+ufs_ring_submit(struct ufs_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	int count = ring->sq_pending - ring->sq_tail;
+	ring->sq_tail = ring->sq_pending;
+	bool is_started = count > 0 && !ring->is_running;
+	if (is_started)
+		ring->is_running = true;
+	pthread_mutex_unlock(&ring->lock);
+	if (!is_started)
+		return count;
+
+	// the last run is over, as the ring is not running
+	join_ring_task(ring);
+
+	// a worker runs the calls, unless there are no threads
+	if (is_concurrent)
+	{
+		pthread_mutex_lock(&ring_pool_lock);
+		if (ring_pool == NULL)
+			thread_pool_new(RING_THREAD_COUNT, &ring_pool);
+		struct thread_pool *pool = ring_pool;
+		pthread_mutex_unlock(&ring_pool_lock);
+		struct thread_task *task;
+		if (pool != NULL && thread_task_new(&task, run_ring, ring) == 0)
+		{
+			if (thread_pool_push_task(pool, task) == 0)
+				ring->task = task;
+			else
+				thread_task_delete(task);
+		}
+	}
+	if (ring->task == NULL)
+		run_ring(ring);
+	return count;
+}
+
+int
+ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count, int wait_count)
+{
+	pthread_mutex_lock(&ring->lock);
+	// the calls, not submitted yet, are never completed
+	unsigned wait = min(wait_count, ring->sq_tail - ring->cq_head);
+	while (ring->cq_tail - ring->cq_head < wait)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	int ready = min(count, ring->cq_tail - ring->cq_head);
+	pthread_mutex_unlock(&ring->lock);
+	for (int i = 0; i < ready; i++)
+		cqes[i] = ring->cqes[ring->cq_head++ & ring->mask];
+	return ready;
+}
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+	struct filedesc *filedesc = get_filedesc(fd);
+	if (filedesc == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+
+	if (filedesc->can_write == false)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+
+	if (new_size > MAX_FILE_SIZE)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	struct file *file = filedesc->file;
+	is_reclaim_asked = false;
+	int rc = change_size(file, new_size);
+	// the space, freed by the change, is reusable after its commit
+	if (rc != 0 && is_reclaim_asked)
+	{
+		is_reclaim_asked = false;
+		rc = change_size(file, new_size);
+	}
+	return rc;
+}
+
+ssize_t
+seek_file(int fd, size_t offset, bool is_data)
+{
+	struct filedesc *filedesc = get_filedesc(fd);
+	if (filedesc == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+
+	struct file *file = filedesc->file;
+	lock_file(file, false);
+	// the file end is both the end of data and the last hole
+	size_t result = file->size;
+	for (int i = offset < file->size ? block_index(offset) : file->block_count; i < file->block_count; i++)
+	{
+		if ((file->blocks[i] != NULL) == is_data)
+		{
+			result = max(offset, block_start(i));
+			break;
+		}
+	}
+	unlock_file(file);
+	return result;
+}
+
+bool
+is_permitted(int flags, enum open_flags flag)
+{
+	return (flags & flag) == flag;
+}
+
+uint32_t
+hash_name(const char *name, size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+struct name_stripe *
+get_name_stripe(struct file *dir, uint32_t hash)
+{
+	// the top bits choose the stripe, the low ones a slot in it
+	if (dir->stripe_bits == 0)
+		return dir->stripes;
+	return &dir->stripes[hash >> (32 - dir->stripe_bits)];
+}
+
+void
+lock_names(bool is_write)
+{
+	if (!is_concurrent)
+		return;
+	if (is_write)
+		pthread_rwlock_wrlock(&name_lock);
+	else
+		pthread_rwlock_rdlock(&name_lock);
+}
+
+void
+unlock_names(void)
+{
+	if (is_concurrent)
+		pthread_rwlock_unlock(&name_lock);
+}
+
+struct file *
+resolve_parent(const char *path, const char **name, size_t *len)
+{
+	// paths start at the root, with or without a slash
+	while (*path == '/')
+		path++;
+	const char *slash = NULL;
+	const char *end = path;
+	for (; *end != 0; end++)
+	{
+		if (*end == '/')
+			slash = end;
+	}
+	*name = slash == NULL ? path : slash + 1;
+	*len = end - *name;
+	if (*len == 0)
+		return NULL;
+	return find_dir(path, slash == NULL ? 0 : slash - path);
+}
+
+struct file *
+find_dir(const char *path, size_t len)
+{
+	if (len == 0)
+		return &root_dir;
+
+	uint32_t hash = hash_name(path, len);
+	uint32_t i = hash & (PATH_CACHE_SIZE - 1);
+	struct path_entry *entry = &path_cache[i];
+	int *lock = &path_cache_locks[i % NAME_STRIPE_COUNT];
+	struct file *dir = NULL;
+	if (is_concurrent)
+		spin_lock(lock);
+	if (entry->generation == path_generation && entry->hash == hash &&
+		strncmp(entry->path, path, len) == 0 && entry->path[len] == 0)
+	{
+		dir = entry->dir;
+	}
+	if (is_concurrent)
+		spin_unlock(lock);
+	if (dir != NULL)
+		return dir;
+
+	dir = walk_dir(path, len);
+	char *copy = dir == NULL ? NULL : (char *)malloc(len + 1);
+	if (copy == NULL)
+		return dir;
+	memcpy(copy, path, len);
+	copy[len] = 0;
+	if (is_concurrent)
+		spin_lock(lock);
+	char *old = entry->path;
+	entry->path = copy;
+	entry->hash = hash;
+	entry->generation = path_generation;
+	entry->dir = dir;
+	if (is_concurrent)
+		spin_unlock(lock);
+	free(old);
+	return dir;
+}
+
+struct file *
+walk_dir(const char *path, size_t len)
+{
+	struct file *dir = &root_dir;
+	const char *end = path + len;
+	while (path < end)
+	{
+		const char *slash = (const char *)memchr(path, '/', end - path);
+		size_t n = (slash == NULL ? end : slash) - path;
+		if (n == 0)
+			return NULL;
+		uint32_t hash = hash_name(path, n);
+		struct name_stripe *stripe = get_name_stripe(dir, hash);
+		lock_name_stripe(stripe);
+		struct file *f = search_file(stripe, hash, path, n);
+		unlock_name_stripe(stripe);
+		if (f == NULL || f->stripes == NULL)
+			return NULL;
+		dir = f;
+		path += n;
+		if (path < end)
+			path++;
+	}
+	return dir;
+}
+
+bool
+make_dir(struct file *file)
+{
+	file->stripes = (struct name_stripe *)calloc(1, sizeof(struct name_stripe));
+	if (file->stripes == NULL)
+		return false;
+	pthread_mutex_init(&file->stripes->lock, NULL);
+	file->stripe_bits = 0;
+	return true;
+}
+
+void
+lock_name_stripe(struct name_stripe *stripe)
+{
+	if (is_concurrent)
+		pthread_mutex_lock(&stripe->lock);
+}
+
+void
+unlock_name_stripe(struct name_stripe *stripe)
+{
+	if (is_concurrent)
+		pthread_mutex_unlock(&stripe->lock);
+}
 
-	ssize_t buf_offset = 0;
-	ssize_t offset = filedesc->offset;
-	struct block *block = file->block_list;
+void
+lock_file(struct file *file, bool is_write)
+{
+	if (!is_concurrent)
+		return;
+	if (is_write)
+		pthread_rwlock_wrlock(&file->lock);
+	else
+		pthread_rwlock_rdlock(&file->lock);
+}
 
-	while (size > 0)
+void
+unlock_file(struct file *file)
+{
+	if (is_concurrent)
+		pthread_rwlock_unlock(&file->lock);
+}
+
+void
+begin_change(void)
+{
+	if (is_mounted)
+		image_change_begin(&file_image);
+}
+
+void
+end_change(void)
+{
+	if (is_mounted)
+		image_change_end(&file_image);
+}
+
+struct file *
+search_file(struct name_stripe *stripe, uint32_t hash, const char *name, size_t len)
+{
+	if (stripe->count == 0)
+		return NULL;
+
+	uint32_t mask = stripe->capacity - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		struct file_slot *slot = &stripe->table[i];
+		if (slot->file == NULL)
+			return NULL;
+		if (slot->hash == hash && slot->file != &file_tombstone &&
+			strncmp(slot->file->name, name, len) == 0 && slot->file->name[len] == 0)
+		{
+			return slot->file;
+		}
+	}
+}
+
+// rebuild the stripe table without tombstones, growing it if needed;
+// false if no memory, then the old table is kept
+static bool
+rebuild_file_table(struct name_stripe *stripe)
+{
+	uint32_t capacity = stripe->capacity == 0 ? 16 : stripe->capacity;
+	while (stripe->count * 4 >= capacity)
+		capacity *= 2;
+
+	struct file_slot *table = (struct file_slot *)calloc(capacity, sizeof(struct file_slot));
+	if (table == NULL)
+		return false;
+	struct file_slot *old_table = stripe->table;
+	uint32_t old_capacity = stripe->capacity;
+	stripe->table = table;
+	stripe->capacity = capacity;
+	stripe->used = stripe->count;
+
+	uint32_t mask = capacity - 1;
+	for (uint32_t i = 0; i < old_capacity; i++)
+	{
+		struct file *f = old_table[i].file;
+		if (f == NULL || f == &file_tombstone)
+			continue;
+		uint32_t j = f->hash & mask;
+		while (stripe->table[j].file != NULL)
+			j = (j + 1) & mask;
+		stripe->table[j] = old_table[i];
+	}
+	free(old_table);
+	return true;
+}
+
+bool
+reserve_file_slot(struct name_stripe *stripe)
+{
+	if ((stripe->used + 1) * 2 <= stripe->capacity)
+		return true;
+	// without a bigger table a free slot still ends the probes
+	return rebuild_file_table(stripe) || stripe->used + 1 < stripe->capacity;
+}
+
+bool
+append_file(struct name_stripe *stripe, struct file *new_file)
+{
+	if (!reserve_file_slot(stripe))
+		return false;
+
+	uint32_t mask = stripe->capacity - 1;
+	uint32_t i = new_file->hash & mask;
+	while (stripe->table[i].file != NULL && stripe->table[i].file != &file_tombstone)
+		i = (i + 1) & mask;
+	if (stripe->table[i].file == NULL)
+		stripe->used++;
+	stripe->table[i].hash = new_file->hash;
+	stripe->table[i].file = new_file;
+	stripe->count++;
+
+	new_file->next = NULL;
+	new_file->prev = stripe->list_last;
+	if (stripe->list_last == NULL)
+		stripe->list = new_file;
+	else
+		stripe->list_last->next = new_file;
+	stripe->list_last = new_file;
+	return true;
+}
+
+void
+remove_file(struct name_stripe *stripe, struct file *file)
+{
+	uint32_t mask = stripe->capacity - 1;
+	uint32_t i = file->hash & mask;
+	while (stripe->table[i].file != file)
+		i = (i + 1) & mask;
+	stripe->table[i].file = &file_tombstone;
+	stripe->count--;
+
+	if (file->prev == NULL)
+		stripe->list = file->next;
+	else
+		file->prev->next = file->next;
+	if (file->next == NULL)
+		stripe->list_last = file->prev;
+	else
+		file->next->prev = file->prev;
+	file->in_list = false;
+}
+
+void
+unlink_file(struct name_stripe *stripe, struct file *file)
+{
+	remove_file(stripe, file);
+	file->parent = NULL;
+	// a deleted file is dropped from the image on the next mount, if
+	// it is not closed before
+	if (file->inode != NULL)
+	{
+		file->inode->state = IMAGE_INODE_UNLINKED;
+		image_inode_dirty(&file_image, file->inode);
+	}
+}
+
+int
+get_fd()
+{
+	if (is_concurrent)
+		spin_lock(&file_descriptor_lock);
+
+	int fd = file_descriptor_free;
+	if (fd != -1)
+	{
+		file_descriptor_free = file_descriptor_chunks[fd / FD_CHUNK_SIZE][fd % FD_CHUNK_SIZE].next_free;
+	}
+	else if (file_descriptor_count < FD_CHUNK_SIZE * FD_CHUNK_COUNT)
+	{
+		int chunk = file_descriptor_count / FD_CHUNK_SIZE;
+		if (file_descriptor_chunks[chunk] == NULL)
+		{
+			// published filled, get_filedesc() reads it without the lock
+			struct filedesc *new_chunk = (struct filedesc *)calloc(FD_CHUNK_SIZE, sizeof(struct filedesc));
+			__atomic_store_n(&file_descriptor_chunks[chunk], new_chunk, __ATOMIC_RELEASE);
+		}
+		if (file_descriptor_chunks[chunk] != NULL)
+			fd = file_descriptor_count++;
+	}
+
+	if (is_concurrent)
+		spin_unlock(&file_descriptor_lock);
+	return fd;
+}
+
+void
+put_fd(int fd)
+{
+	struct filedesc *filedesc = &file_descriptor_chunks[fd / FD_CHUNK_SIZE][fd % FD_CHUNK_SIZE];
+	filedesc->file = NULL;
+	filedesc->is_occupied = false;
+
+	if (is_concurrent)
+		spin_lock(&file_descriptor_lock);
+	filedesc->next_free = file_descriptor_free;
+	file_descriptor_free = fd;
+	if (is_concurrent)
+		spin_unlock(&file_descriptor_lock);
+}
+
+struct filedesc *
+get_filedesc(int fd)
+{
+	if (fd < 0 || fd >= FD_CHUNK_SIZE * FD_CHUNK_COUNT)
+		return NULL;
+	struct filedesc *chunk = __atomic_load_n(&file_descriptor_chunks[fd / FD_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	if (chunk == NULL || chunk[fd % FD_CHUNK_SIZE].is_occupied == false)
+		return NULL;
+	return &chunk[fd % FD_CHUNK_SIZE];
+}
+
+struct block *
+create_block(struct file *file)
+{
+	if (file == NULL)
+	{
+		return NULL;
+	}
+
+	if (!reserve_blocks(file, file->block_count + 1))
+		return NULL;
+
+	// a small file starts in its record, unless a view still pins
+	// the inline block
+	struct block *new_block = &file->inline_block;
+	if (file->block_count == 0 && !is_mounted && __atomic_load_n(&new_block->refs, __ATOMIC_ACQUIRE) == 0)
+	{
+		new_block->refs = 1;
+		new_block->file_refs = 1;
+		new_block->occupied = 0;
+	}
+	else if ((new_block = alloc_block(file->block_count)) == NULL)
+		return NULL;
+
+	set_block(file, file->block_count++, new_block);
+	return new_block;
+}
+
+bool
+reserve_blocks(struct file *file, int count)
+{
+	if (count <= file->block_capacity)
+		return true;
+
+	int new_capacity = file->block_capacity == 0 ? 8 : file->block_capacity * 2;
+	if (new_capacity < count)
+		new_capacity = count;
+	struct block **new_blocks;
+	if (file->blocks == &file->first_block)
+	{
+		new_blocks = (struct block **)malloc(new_capacity * sizeof(struct block *));
+		if (new_blocks != NULL)
+			memcpy(new_blocks, file->blocks, file->block_count * sizeof(struct block *));
+	}
+	else
+	{
+		new_blocks = (struct block **)realloc(file->blocks, new_capacity * sizeof(struct block *));
+	}
+	if (new_blocks == NULL)
+		return false;
+	file->blocks = new_blocks;
+	file->block_capacity = new_capacity;
+	return true;
+}
+
+struct block *
+alloc_block(int index)
+{
+	int size_class = min(index, GROWING_BLOCK_COUNT - 1);
+	struct block *block;
+	if (is_mounted)
 	{
+		// block sizes are powers of two of the image units
+		block = (struct block *)slab_alloc(&image_block_cache);
 		if (block == NULL)
+			return NULL;
+		uint64_t offset = image_alloc(&file_image, size_class);
+		if (offset == 0)
 		{
-			block = create_block(file);
-			offset = 0;
+			// freed blocks are reused after a commit, which can't
+			// be done amid the change
+			if (image_reclaim(&file_image))
+				is_reclaim_asked = true;
+			slab_free(block);
+			return NULL;
+		}
+		block->memory = image_data(&file_image, offset);
+	}
+	else
+	{
+		block = (struct block *)slab_alloc(&block_caches[size_class]);
+		if (block == NULL)
+			return NULL;
+		block->memory = (char *)(block + 1);
+	}
+	block->refs = 1;
+	block->file_refs = 1;
+	block->occupied = 0;
+	block->size = block_size(index);
+	block->packed = 0;
+	block->is_indexed = false;
+	return block;
+}
+
+struct block *
+own_block(struct file *file, int index)
+{
+	struct block *block = file->blocks[index];
+	// the other owners drop the block only after copying it; a
+	// block from the content table can be found by another file
+	if (block != NULL && __atomic_load_n(&block->file_refs, __ATOMIC_ACQUIRE) == 1 &&
+		(!block->is_indexed || unindex_block(block)))
+		return block;
+
+	struct block *copy = alloc_block(index);
+	if (copy == NULL)
+		return NULL;
+	if (block == NULL)
+	{
+		copy->occupied = block_occupied(file, index);
+		memset(copy->memory, 0, copy->occupied);
+	}
+	else
+	{
+		memcpy(copy->memory, block->memory, block->occupied);
+		copy->occupied = block->occupied;
+		drop_block(block);
+	}
+	set_block(file, index, copy);
+	return copy;
+}
+
+static inline ssize_t
+block_occupied(struct file *file, int index)
+{
+	struct block *block = file->blocks[index];
+	if (block != NULL)
+		return block->occupied;
+	return min(block_size(index), file->size - block_start(index));
+}
+
+int
+grow_file(struct file *file, size_t new_size)
+{
+	int new_count = block_index(new_size - 1) + 1;
+	if (!reserve_blocks(file, new_count))
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	// the last block is filled up as far as it goes, the rest is
+	// a hole
+	struct block *last = file->block_count > 0 ? file->blocks[file->block_count - 1] : NULL;
+	if (last != NULL && is_inline_block(last) && new_size > (size_t)last->size &&
+		(last = grow_inline_block(file)) == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	if (last != NULL && last->occupied < last->size)
+	{
+		last = own_block(file, file->block_count - 1);
+		if (last == NULL)
+		{
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		ssize_t fill = min(last->size - last->occupied, new_size - file->size);
+		memset(last->memory + last->occupied, 0, fill);
+		last->occupied += fill;
+	}
+	while (file->block_count < new_count)
+		set_block(file, file->block_count++, NULL);
+	set_file_size(file, new_size);
+	return 0;
+}
+
+void
+set_block(struct file *file, int index, struct block *block)
+{
+	file->blocks[index] = block;
+	if (file->inode != NULL)
+	{
+		file->inode->blocks[index] = block == NULL ? 0 : image_offset(&file_image, block->memory);
+		image_inode_dirty(&file_image, file->inode);
+	}
+}
+
+void
+set_file_size(struct file *file, size_t size)
+{
+	file->size = size;
+	if (file->inode != NULL)
+	{
+		file->inode->size = size;
+		image_inode_dirty(&file_image, file->inode);
+	}
+}
+
+struct file *
+create_file(const char *name, size_t len, uint32_t hash, struct file *parent, struct image_inode *inode)
+{
+	create_caches();
+	struct file *f = (struct file *)slab_alloc(&file_cache);
+	if (f == NULL)
+		return NULL;
+	if (!set_file_name(f, name, len))
+	{
+		slab_free(f);
+		return NULL;
+	}
+	if (is_mounted && inode == NULL)
+	{
+		// the name is kept in the inode to find the file on mount
+		if (len >= IMAGE_NAME_SIZE ||
+			(inode = image_inode_alloc(&file_image)) == NULL)
+		{
+			if (f->name != f->inline_name)
+				free(f->name);
+			slab_free(f);
+			return NULL;
 		}
+		memcpy(inode->name, name, len);
+		inode->name[len] = 0;
+		if (parent != NULL && parent->inode != NULL)
+			inode->parent = image_inode_index(&file_image, parent->inode) + 1;
+	}
+	f->inode = inode;
+	f->blocks = &f->first_block;
+	f->block_count = 0;
+	f->block_capacity = 1;
+	f->inline_block.refs = 0;
+	f->inline_block.size = INLINE_DATA_SIZE;
+	f->inline_block.packed = 0;
+	f->inline_block.is_indexed = false;
+	f->inline_block.memory = f->inline_data;
+	f->size = 0;
+	f->prev = NULL;
+	f->next = NULL;
+	f->hash = hash;
+	f->parent = parent;
+	f->stripes = NULL;
+	f->stripe_bits = 0;
+	f->refs = 0;
+	f->in_list = true;
+	f->close_time = is_compression_enabled ? now_ms() : 0;
+	f->packed_count = 0;
+	f->is_compressing = false;
+	pthread_rwlock_init(&f->lock, NULL);
+	return f;
+}
+
+static inline int
+block_index(size_t offset)
+{
+	if (offset < GROWING_BLOCKS_SIZE)
+	{
+		// block i starts at MIN_BLOCK_SIZE * (2^i - 1)
+		unsigned units = offset / MIN_BLOCK_SIZE + 1;
+		return 31 - __builtin_clz(units);
+	}
+	return GROWING_BLOCK_COUNT + (offset - GROWING_BLOCKS_SIZE) / MAX_BLOCK_SIZE;
+}
+
+static inline size_t
+block_start(int index)
+{
+	if (index < GROWING_BLOCK_COUNT)
+		return (size_t)MIN_BLOCK_SIZE * ((1u << index) - 1);
+	return GROWING_BLOCKS_SIZE + (size_t)(index - GROWING_BLOCK_COUNT) * MAX_BLOCK_SIZE;
+}
+
+static inline int
+block_size(int index)
+{
+	if (index < GROWING_BLOCK_COUNT)
+		return MIN_BLOCK_SIZE << index;
+	return MAX_BLOCK_SIZE;
+}
+
+static inline void
+seek_cursor(struct block_cursor *cursor, size_t offset)
+{
+	// an offset before the block start wraps around here
+	size_t block_offset = offset - cursor->start;
+	if (block_offset < cursor->size)
+		return;
+	if (block_offset - cursor->size < (size_t)block_size(cursor->index + 1))
+	{
+		next_cursor(cursor);
+		return;
+	}
+	cursor->index = block_index(offset);
+	cursor->start = block_start(cursor->index);
+	cursor->size = block_size(cursor->index);
+}
+
+static inline void
+next_cursor(struct block_cursor *cursor)
+{
+	cursor->start += cursor->size;
+	cursor->index++;
+	cursor->size = block_size(cursor->index);
+}
+
+struct block_cursor *
+get_cursor(struct filedesc *filedesc, struct block_cursor *local, size_t offset)
+{
+	if (!is_concurrent)
+		return &filedesc->cursor;
+	local->index = block_index(offset);
+	local->start = block_start(local->index);
+	local->size = block_size(local->index);
+	return local;
+}
+
+static inline void
+track_read(struct filedesc *filedesc, size_t offset, ssize_t size)
+{
+	if (offset != filedesc->read_end)
+		filedesc->sequential_reads = 0;
+	else if (filedesc->sequential_reads < SEQUENTIAL_READS)
+		filedesc->sequential_reads++;
+	filedesc->read_end = offset + size;
+	// in-memory blocks have nothing to read ahead
+	if (is_mounted && filedesc->sequential_reads == SEQUENTIAL_READS &&
+		filedesc->cursor.index + 1 != filedesc->ahead_index)
+	{
+		read_ahead(filedesc);
+	}
+}
+
+void
+read_ahead(struct filedesc *filedesc)
+{
+	// the next block is asked once, when the reader enters the
+	// block before it, so the system reads it during this one
+	struct file *file = filedesc->file;
+	int next = filedesc->cursor.index + 1;
+	filedesc->ahead_index = next;
+	if (next < file->block_count && file->blocks[next] != NULL)
+		image_prefetch(&file_image, file->blocks[next]->memory, file->blocks[next]->occupied);
+}
+
+struct filedesc *
+get_io_filedesc(int fd, bool is_write)
+{
+	struct filedesc *filedesc = get_filedesc(fd);
+	if (filedesc == NULL)
+	{
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+
+	if (is_write ? filedesc->can_write == false : filedesc->can_read == false)
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return filedesc;
+}
 
-		ssize_t block_offset = min(offset, block->occupied);
-		if (block_offset == BLOCK_SIZE)
+ssize_t
+locked_write(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset)
+{
+	struct file *file = filedesc->file;
+	if (offset != NULL)
+	{
+		struct block_cursor local;
+		struct block_cursor *cursor = get_cursor(filedesc, &local, *offset);
+		return file_write(file, cursor, *offset, iov, iovcnt);
+	}
+
+	// a descriptor behind the file end proceeds from the end
+	size_t position = min(filedesc->offset, file->size);
+	ssize_t rc;
+	// streaming append goes right to the tail block
+	if (iovcnt == 1 && position == file->size && iov[0].iov_len <= MAX_FILE_SIZE - position)
+		rc = append_file_data(file, (const char *)iov[0].iov_base, iov[0].iov_len);
+	else
+		rc = file_write(file, &filedesc->cursor, position, iov, iovcnt);
+	if (rc > 0)
+		filedesc->offset = position + rc;
+	return rc;
+}
+
+ssize_t
+locked_read(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset)
+{
+	struct file *file = filedesc->file;
+	if (offset != NULL)
+	{
+		struct block_cursor local;
+		struct block_cursor *cursor = get_cursor(filedesc, &local, *offset);
+		ssize_t rc = file_read(file, cursor, *offset, iov, iovcnt);
+		if (cursor != &local)
+			track_read(filedesc, *offset, rc);
+		return rc;
+	}
+
+	size_t position = min(filedesc->offset, file->size);
+	ssize_t rc = file_read(file, &filedesc->cursor, position, iov, iovcnt);
+	track_read(filedesc, position, rc);
+	filedesc->offset = position + rc;
+	return rc;
+}
+
+ssize_t
+change_write(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset)
+{
+	struct file *file = filedesc->file;
+	is_reclaim_asked = false;
+	begin_change();
+	lock_file(file, true);
+	ssize_t rc = locked_write(filedesc, iov, iovcnt, offset);
+	unlock_file(file);
+	end_change();
+	if (!is_reclaim_asked)
+		return rc;
+	return rewrite_rest(filedesc, iov, iovcnt, offset, rc);
+}
+
+ssize_t
+rewrite_rest(struct filedesc *filedesc, const struct iovec *iov, int iovcnt, const size_t *offset, ssize_t rc)
+{
+	// the space, freed in the transaction, is reusable after the
+	// commit at the change end
+	struct file *file = filedesc->file;
+	is_reclaim_asked = false;
+	size_t done = rc > 0 ? rc : 0;
+	size_t position = offset != NULL ? *offset + done : 0;
+	size_t *new_offset = offset != NULL ? &position : NULL;
+	int i = 0;
+	for (; i < iovcnt && done >= iov[i].iov_len; i++)
+		done -= iov[i].iov_len;
+	if (i == iovcnt)
+		return rc;
+	struct iovec head = {(char *)iov[i].iov_base + done, iov[i].iov_len - done};
+	begin_change();
+	lock_file(file, true);
+	ssize_t more = locked_write(filedesc, &head, 1, new_offset);
+	if (more == (ssize_t)head.iov_len && i + 1 < iovcnt)
+	{
+		position += more;
+		ssize_t rest = locked_write(filedesc, iov + i + 1, iovcnt - i - 1, new_offset);
+		if (rest > 0)
+			more += rest;
+	}
+	unlock_file(file);
+	end_change();
+	if (more < 0)
+		return rc;
+	return (rc > 0 ? rc : 0) + more;
+}
+
+int
+change_size(struct file *file, size_t new_size)
+{
+	int new_count = new_size == 0 ? 0 : block_index(new_size - 1) + 1;
+	int rc = 0;
+	begin_change();
+	lock_file(file, true);
+
+	// the new last block is cut, it can't stay shared; a hole is
+	// cut by the size alone. It is owned before anything is freed,
+	// so a failure changes nothing
+	struct block *last = NULL;
+	if (new_size < file->size && new_count > 0 && file->blocks[new_count - 1] != NULL)
+	{
+		last = own_block(file, new_count - 1);
+		if (last == NULL)
 		{
-			offset -= BLOCK_SIZE;
-			block = block->next;
-			continue;
+			ufs_error_code = UFS_ERR_NO_MEM;
+			unlock_file(file);
+			end_change();
+			return -1;
 		}
-
-		ssize_t write_bytes = min(size, BLOCK_SIZE - block_offset);
-		memcpy(block->memory + block_offset, buf + buf_offset, write_bytes);
-		buf_offset += write_bytes;
-		size -= write_bytes;
-		block->occupied = max(block_offset + write_bytes, block->occupied);
-		block = block->next;
-		offset = 0;
 	}
 
-	block = file->block_list;
-	while (block->next != NULL) {
-		block = block->next;
+	// drop the blocks behind the new end
+	while (file->block_count > new_count)
+	{
+		struct block *block = file->blocks[--file->block_count];
+		if (block != NULL)
+			drop_block(block);
+	}
+	if (new_size < file->size)
+	{
+		if (last != NULL)
+			last->occupied = new_size - block_start(new_count - 1);
+		set_file_size(file, new_size);
 	}
 
-	filedesc->offset += buf_offset;
-	file->bytes_left -= buf_offset;
-	file->last_block = block;
+	if (new_size > file->size)
+		rc = grow_file(file, new_size);
 
-	return buf_offset;
+	unlock_file(file);
+	end_change();
+	return rc;
 }
 
 ssize_t
-ufs_read(int fd, char *buf, size_t size)
+file_write(struct file *file, struct block_cursor *cursor, size_t offset, const struct iovec *iov, int iovcnt)
 {
-	if (is_valid_fd(fd) == false)
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (offset > MAX_FILE_SIZE || total > MAX_FILE_SIZE - offset)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
+		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
 
-	struct filedesc *filedesc = file_descriptors[fd];
+	// a position behind the end leaves a hole before the data
+	if (offset > file->size && grow_file(file, offset) != 0)
+		return -1;
+
+	// the block cursor moves on through all the buffers
+	seek_cursor(cursor, offset);
+	ssize_t done = 0;
 
-	if (filedesc->can_read == false)
+	for (int i = 0; i < iovcnt; i++)
 	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
-	}
+		const char *buf = (const char *)iov[i].iov_base;
+		size_t size = iov[i].iov_len;
 
-	struct file *file = filedesc->file;
+		while (size > 0)
+		{
+			// the rest goes to the tail block
+			if (offset == file->size)
+			{
+				ssize_t rc = append_file_data(file, buf, size);
+				if (rc < 0)
+					return done > 0 ? done : -1;
+				done += rc;
+				offset += rc;
+				seek_cursor(cursor, offset);
+				if ((size_t)rc < size)
+					return done;
+				break;
+			}
+
+			int index = cursor->index;
+			ssize_t block_offset = offset - cursor->start;
+			if (block_offset == block_occupied(file, index))
+			{
+				next_cursor(cursor);
+				continue;
+			}
+			struct block *block = own_block(file, index);
+			if (block == NULL)
+			{
+				ufs_error_code = UFS_ERR_NO_MEM;
+				return done > 0 ? done : -1;
+			}
+
+			ssize_t write_bytes = min(size, block->occupied - block_offset);
+			memcpy(block->memory + block_offset, buf, write_bytes);
+			buf += write_bytes;
+			size -= write_bytes;
+			done += write_bytes;
+			offset += write_bytes;
+		}
+	}
+	return done;
+}
 
-	ssize_t bytes_read = 0;
-	struct block *file_block = file->block_list;
+ssize_t
+file_read(struct file *file, struct block_cursor *cursor, size_t offset, const struct iovec *iov, int iovcnt)
+{
+	if (offset >= file->size)
+		return 0;
 
-	ssize_t offset = filedesc->offset;
+	// the block cursor moves on through all the buffers
+	seek_cursor(cursor, offset);
+	ssize_t done = 0;
 
-	while (file_block != NULL && size > 0)
+	for (int i = 0; i < iovcnt && offset < file->size; i++)
 	{
-		int occupied = file_block->occupied;
-		int block_offset = min(offset, BLOCK_SIZE);
+		char *buf = (char *)iov[i].iov_base;
+		size_t size = iov[i].iov_len;
 
-		if (block_offset == BLOCK_SIZE)
-		{
-			offset -= BLOCK_SIZE;
-		}
-		else
+		while (size > 0 && offset < file->size)
 		{
-			ssize_t bytes_to_read = min(occupied - block_offset, size);
-			if (bytes_to_read < 0)
-				break;
+			int index = cursor->index;
+			ssize_t block_offset = offset - cursor->start;
+			struct block *block = file->blocks[index];
+			ssize_t occupied = block_occupied(file, index);
+			if (block_offset == occupied)
+			{
+				next_cursor(cursor);
+				continue;
+			}
 
-			memcpy(buf + bytes_read, file_block->memory + block_offset, bytes_to_read);
-			bytes_read += bytes_to_read;
-			offset = 0;
+			ssize_t bytes_to_read = min(occupied - block_offset, size);
+			if (block == NULL)
+				memset(buf, 0, bytes_to_read);
+			else
+				memcpy(buf, block->memory + block_offset, bytes_to_read);
+			buf += bytes_to_read;
 			size -= bytes_to_read;
+			done += bytes_to_read;
+			offset += bytes_to_read;
 		}
-		file_block = file_block->next;
 	}
-
-	filedesc->offset += bytes_read;
-	return bytes_read;
+	return done;
 }
 
-int ufs_close(int fd)
+ssize_t
+append_file_data(struct file *file, const char *buf, size_t size)
 {
-	if (is_valid_fd(fd) == false)
+	ssize_t done = 0;
+	int last = file->block_count - 1;
+	struct block *block = last >= 0 ? file->blocks[last] : NULL;
+	// a shared or a hole last block, which is not full, is made own
+	bool is_shared = block != NULL && block->occupied < block->size && __atomic_load_n(&block->file_refs, __ATOMIC_ACQUIRE) > 1;
+	bool is_hole = last >= 0 && block == NULL && block_occupied(file, last) < block_size(last);
+	if (size > 0 && (is_shared || is_hole))
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		block = own_block(file, last);
+		if (block == NULL)
+		{
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
 	}
 
-	struct filedesc *filedesc = file_descriptors[fd];
-	struct file *file = filedesc->file;
-	file->refs--;
-
-	if (file->refs == 0 && file->in_list == false)
+	while (size > 0)
 	{
-		free_file_memory(file);
-		free(file);
+		if (block != NULL && block->occupied == block->size && is_inline_block(block))
+		{
+			block = grow_inline_block(file);
+			if (block == NULL)
+			{
+				ufs_error_code = UFS_ERR_NO_MEM;
+				break;
+			}
+		}
+		if (block == NULL || block->occupied == block->size)
+		{
+			block = create_block(file);
+			if (block == NULL)
+			{
+				ufs_error_code = UFS_ERR_NO_MEM;
+				break;
+			}
+		}
+
+		ssize_t write_bytes = min(size, block->size - block->occupied);
+		memcpy(block->memory + block->occupied, buf + done, write_bytes);
+		block->occupied += write_bytes;
+		file->size += write_bytes;
+		if (is_dedup_enabled && block->occupied == block->size && !is_inline_block(block))
+			block = dedup_block(file, file->block_count - 1);
+		done += write_bytes;
+		size -= write_bytes;
 	}
+	// the inode is updated once per call
+	set_file_size(file, file->size);
 
-	free(filedesc);
-	file_descriptors[fd] = NULL;
-	file_descriptor_count--;
-	return 0;
+	if (done == 0 && size > 0)
+		return -1;
+	return done;
 }
 
-int ufs_delete(const char *filename)
+void
+free_file_memory(struct file *file)
 {
-	struct file *file = search_file(filename);
-	if (file == NULL)
-	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
-	}
-
-	struct file *prev_file = file->prev;
-	struct file *next_file = file->next;
-	if (prev_file == NULL)
+	for (int i = 0; i < file->block_count; i++)
 	{
-		file_list = next_file;
-		if (next_file != NULL)
-			next_file->prev = NULL;
+		if (file->blocks[i] != NULL)
+			drop_block(file->blocks[i]);
 	}
-	else
+	free_file_buffers(file);
+	if (file->stripes != NULL)
 	{
-		prev_file->next = next_file;
-		if (next_file != NULL)
-			next_file->prev = prev_file;
+		free(file->stripes->table);
+		pthread_mutex_destroy(&file->stripes->lock);
+		free(file->stripes);
+		file->stripes = NULL;
 	}
+	pthread_rwlock_destroy(&file->lock);
+	if (file->inode != NULL)
+		image_inode_free(&file_image, file->inode);
+	file->inode = NULL;
+	file->blocks = NULL;
+	file->block_count = file->block_capacity = 0;
+	file->size = 0;
+}
 
-	file->in_list = false;
-	if (file->refs == 0)
-	{
-		free_file_memory(file);
-		free(file);
-	}
-	return 0;
+void
+free_file_buffers(struct file *file)
+{
+	if (file->blocks != &file->first_block)
+		free(file->blocks);
+	if (file->name != file->inline_name)
+		free(file->name);
 }
 
-void ufs_destroy(void)
+bool
+set_file_name(struct file *file, const char *name, size_t len)
 {
-	struct file *file = file_list;
-	while (file != NULL)
-	{
-		struct file *copy = file;
-		file = file->next;
-		free_file_memory(copy);
-		free(copy);
-	}
+	char *copy = len < INLINE_NAME_SIZE ? file->inline_name : (char *)malloc(len + 1);
+	if (copy == NULL)
+		return false;
+	memcpy(copy, name, len);
+	copy[len] = 0;
+	file->name = copy;
+	return true;
+}
 
-	for (int i = 0; i < file_descriptor_capacity; i++)
+void
+free_tree_memory(void)
+{
+	// directories to visit are kept on a stack, the tree can be deep
+	struct file **stack = NULL;
+	int count = 0, capacity = 0;
+	struct file *dir = &root_dir;
+	while (dir != NULL)
 	{
-		struct filedesc *fd = file_descriptors[i];
-		if (fd == NULL)
-			continue;
-
-		struct file *file = fd->file;
-		if (file != NULL && file->in_list == false)
+		for (int i = 0; i < (1 << dir->stripe_bits); i++)
 		{
-			free_file_memory(file);
-			free(file);
+			struct name_stripe *stripe = &dir->stripes[i];
+			for (struct file *file = stripe->list; file != NULL; file = file->next)
+			{
+				free_file_buffers(file);
+				if (file->stripes == NULL)
+					continue;
+				if (count == capacity)
+				{
+					capacity = capacity == 0 ? 16 : capacity * 2;
+					stack = (struct file **)realloc(stack, capacity * sizeof(*stack));
+				}
+				stack[count++] = file;
+			}
+			free(stripe->table);
+			stripe->table = NULL;
+			stripe->capacity = stripe->count = stripe->used = 0;
+			stripe->list = stripe->list_last = NULL;
 		}
-
-		free(fd);
-		file_descriptors[i] = NULL;
+		if (dir != &root_dir)
+		{
+			pthread_mutex_destroy(&dir->stripes->lock);
+			free(dir->stripes);
+		}
+		dir = count == 0 ? NULL : stack[--count];
 	}
+	free(stack);
+}
+
+int
+inode_block_count(struct image_inode *inode)
+{
+	return inode->size == 0 ? 0 : block_index(inode->size - 1) + 1;
+}
 
-	free(file_list);
-	free(file_descriptors);
+struct block_slot *
+find_block_slot(struct block_slot *map, size_t mask, uint64_t offset)
+{
+	size_t i = (offset / MIN_BLOCK_SIZE) & mask;
+	while (map[i].offset != 0 && map[i].offset != offset)
+		i = (i + 1) & mask;
+	return &map[i];
 }
 
 int
-ufs_resize(int fd, size_t new_size)
+load_files(void)
 {
-	if (is_valid_fd(fd) == false)
+	uint32_t inode_count = image_inode_count(&file_image);
+	size_t block_total = 0;
+	for (uint32_t i = 0; i < inode_count; i++)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		struct image_inode *inode = image_inode_at(&file_image, i);
+		if (inode->state != IMAGE_INODE_FREE)
+			block_total += inode_block_count(inode);
 	}
 
-	struct filedesc *filedesc = file_descriptors[fd];
+	// blocks, shared by clones, are found by their offsets
+	size_t capacity = 16;
+	while (capacity < block_total * 2)
+		capacity *= 2;
+	struct block_slot *map = (struct block_slot *)calloc(capacity, sizeof(struct block_slot));
+	if (map == NULL)
+		return -1;
 
-	if (filedesc->can_write == false)
+	// directories go first, the files refer to them
+	struct file **dirs = (struct file **)calloc(inode_count + 1, sizeof(struct file *));
+	if (dirs == NULL)
 	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		free(map);
 		return -1;
 	}
-
-	if (new_size > MAX_FILE_SIZE)
+	int rc = 0;
+	for (uint32_t i = 0; i < inode_count && rc == 0; i++)
 	{
-		ufs_error_code = UFS_ERR_NO_MEM;
-		return -1;
+		struct image_inode *inode = image_inode_at(&file_image, i);
+		if (inode->state != IMAGE_INODE_DIR)
+			continue;
+		size_t len = strnlen(inode->name, IMAGE_NAME_SIZE - 1);
+		dirs[i] = create_file(inode->name, len, hash_name(inode->name, len), NULL, inode);
+		if (dirs[i] == NULL || !make_dir(dirs[i]))
+			rc = -1;
 	}
-
-	struct file *file = filedesc->file;
-	struct block *block = file->block_list;
-
-	while (new_size > 0)
+	for (uint32_t i = 0; i < inode_count; i++)
 	{
-		if (block == NULL)
-		{
-			block = create_block(file);
-			new_size -= BLOCK_SIZE;
-		}
-		else if (new_size >= BLOCK_SIZE)
+		if (dirs[i] == NULL)
+			continue;
+		// not linked ones are freed here, the others by ufs_destroy()
+		if (rc != 0)
 		{
-			new_size -= BLOCK_SIZE;
+			dirs[i]->inode = NULL;
+			free_file_memory(dirs[i]);
+			slab_free(dirs[i]);
+			continue;
 		}
-		else if (new_size < (size_t)block->occupied)
+		struct file *parent = inode_parent(dirs[i]->inode, dirs, inode_count);
+		dirs[i]->parent = parent;
+		if (!append_file(get_name_stripe(parent, dirs[i]->hash), dirs[i]))
 		{
-			char *new_memory = (char *)malloc(BLOCK_SIZE);
-			memcpy(new_memory, block->memory, new_size);
-			free(block->memory);
-			block->memory = new_memory;
-			block->occupied = new_size;
-			new_size = 0;
+			rc = -1;
+			dirs[i]->inode = NULL;
+			free_file_memory(dirs[i]);
+			slab_free(dirs[i]);
 		}
-
-		block = block->next;
 	}
-
-	if (block != NULL && block->prev != NULL)
+	for (uint32_t i = 0; i < inode_count && rc == 0; i++)
 	{
-		file->last_block = block->prev;
-		block->prev->next = NULL;
+		struct image_inode *inode = image_inode_at(&file_image, i);
+		if (inode->state == IMAGE_INODE_USED)
+			rc = load_file(inode, inode_parent(inode, dirs, inode_count), map, capacity - 1);
 	}
+	free(dirs);
 
-	while (block != NULL)
+	// deleted files, which were open on exit, are dropped now
+	for (uint32_t i = 0; i < inode_count && rc == 0; i++)
 	{
-		struct block *copy = block;
-		block = block->next;
-		free(copy->memory);
-		free(copy);
+		struct image_inode *inode = image_inode_at(&file_image, i);
+		if (inode->state != IMAGE_INODE_UNLINKED)
+			continue;
+		int count = inode_block_count(inode);
+		for (int j = 0; j < count; j++)
+		{
+			if (inode->blocks[j] == 0)
+				continue;
+			// a block in the map is still used, or is freed already;
+			// a rebuilt bitmap has none of the others
+			struct block_slot *slot = find_block_slot(map, capacity - 1, inode->blocks[j]);
+			if (slot->offset != 0 || file_image.is_rebuilding)
+				continue;
+			slot->offset = inode->blocks[j];
+			image_free(&file_image, inode->blocks[j], min(j, GROWING_BLOCK_COUNT - 1));
+		}
+		image_inode_free(&file_image, inode);
 	}
 
-	size_t new_file_size = 0;
-	block = file->block_list;
-	while (block != NULL)
+	free(map);
+	if (rc == 0)
+		file_image.is_rebuilding = false;
+	return rc;
+}
+
+int
+load_file(struct image_inode *inode, struct file *parent, struct block_slot *map, size_t mask)
+{
+	size_t len = strnlen(inode->name, IMAGE_NAME_SIZE - 1);
+	uint32_t hash = hash_name(inode->name, len);
+	struct file *f = create_file(inode->name, len, hash, parent, inode);
+	if (f == NULL)
+		return -1;
+	// added at once, so ufs_destroy() frees it on an error below
+	if (!append_file(get_name_stripe(parent, hash), f))
 	{
-		new_file_size += block->occupied;
-		file->last_block = block;
-		block = block->next;
+		// the inode stays in the image
+		f->inode = NULL;
+		free_file_memory(f);
+		slab_free(f);
+		return -1;
 	}
+	int count = inode_block_count(inode);
+	if (!reserve_blocks(f, count))
+		return -1;
+	f->size = inode->size;
 
-	file->bytes_left = MAX_FILE_SIZE - new_file_size;
+	for (int i = 0; i < count; i++)
+	{
+		struct block *block = NULL;
+		if (inode->blocks[i] != 0)
+		{
+			struct block_slot *slot = find_block_slot(map, mask, inode->blocks[i]);
+			if (slot->offset == 0)
+			{
+				block = (struct block *)slab_alloc(&image_block_cache);
+				if (block == NULL)
+					return -1;
+				block->refs = 0;
+				block->file_refs = 0;
+				block->size = block_size(i);
+				block->packed = 0;
+				block->is_indexed = false;
+				block->occupied = min(block->size, f->size - block_start(i));
+				block->memory = image_data(&file_image, inode->blocks[i]);
+				slot->offset = inode->blocks[i];
+				slot->block = block;
+				// the bitmap is lost in a crash
+				if (file_image.is_rebuilding)
+					image_mark(&file_image, inode->blocks[i], min(i, GROWING_BLOCK_COUNT - 1));
+			}
+			block = slot->block;
+			block->refs++;
+			block->file_refs++;
+		}
+		f->blocks[f->block_count++] = block;
+	}
 	return 0;
 }
 
-bool
-is_permitted(int flags, enum open_flags flag)
+struct file *
+inode_parent(struct image_inode *inode, struct file **dirs, uint32_t count)
 {
-	return (flags & flag) == flag;
+	// a broken reference puts the file to the root, not to lose it
+	if (inode->parent == 0 || inode->parent > count || dirs[inode->parent - 1] == NULL)
+		return &root_dir;
+	return dirs[inode->parent - 1];
 }
 
-struct file *
-search_file(const char *filename)
+void
+create_caches(void)
+{
+	if (are_caches_created)
+		return;
+	for (int i = 0; i < GROWING_BLOCK_COUNT; i++)
+		slab_cache_create(&block_caches[i], sizeof(struct block) + block_size(i));
+	slab_cache_create(&file_cache, sizeof(struct file));
+	slab_cache_create(&image_block_cache, sizeof(struct block));
+	are_caches_created = true;
+}
+
+void
+unref_block(struct block *block)
+{
+	if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free_block(block);
+}
+
+void
+free_block(struct block *block)
 {
-	struct file *f = file_list;
-	while (f != NULL && strcmp(f->name, filename) != 0)
+	// the inline block is freed with its file
+	if (is_inline_block(block))
+		return;
+	if (block->is_indexed)
 	{
-		f = f->next;
+		lock_dedup();
+		remove_indexed_block(block);
+		unlock_dedup();
 	}
+	if (block->packed != 0)
+	{
+		__atomic_sub_fetch(&compression_stats.raw_bytes, block->occupied, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&compression_stats.compressed_bytes, block->packed, __ATOMIC_RELAXED);
+	}
+	if (is_mounted)
+	{
+		int order = __builtin_ctz(block->size / MIN_BLOCK_SIZE);
+		image_free(&file_image, image_offset(&file_image, block->memory), order);
+	}
+	slab_free(block);
+}
 
-	return f;
+static inline bool
+is_inline_block(const struct block *block)
+{
+	// other blocks are never smaller than MIN_BLOCK_SIZE
+	return block->size < MIN_BLOCK_SIZE;
+}
+
+struct block *
+grow_inline_block(struct file *file)
+{
+	struct block *block = alloc_block(0);
+	if (block == NULL)
+		return NULL;
+	struct block *old = file->blocks[0];
+	memcpy(block->memory, old->memory, old->occupied);
+	block->occupied = old->occupied;
+	drop_block(old);
+	set_block(file, 0, block);
+	return block;
 }
 
 void
-append_file(struct file *new_file)
+drop_block(struct block *block)
 {
-	struct file *f = file_list;
-	if (f == NULL)
+	__atomic_sub_fetch(&block->file_refs, 1, __ATOMIC_RELEASE);
+	unref_block(block);
+}
+
+void
+release_pins(struct filedesc *filedesc)
+{
+	for (int i = 0; i < filedesc->pin_count; i++)
+		unref_block(filedesc->pins[i]);
+	filedesc->pin_count = 0;
+}
+
+void
+compress_file(struct file *file, char *buffer)
+{
+	for (int i = 0; i < file->block_count; i++)
 	{
-		file_list = new_file;
+		// shared and viewed blocks are left raw, they are read as is
+		struct block *block = file->blocks[i];
+		if (block == NULL || block->packed != 0 || is_inline_block(block) ||
+			__atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) != 1 || block->file_refs != 1 ||
+			(block->is_indexed && !unindex_block(block)))
+			continue;
+		// the data must fit at least a twice smaller size class
+		int size_class = min(i, GROWING_BLOCK_COUNT - 1);
+		if (size_class == 0)
+			continue;
+		size_t packed = lz_compress(block->memory, block->occupied, buffer, block_size(size_class - 1));
+		if (packed == 0)
+			continue;
+		int packed_class = 0;
+		while ((size_t)block_size(packed_class) < packed)
+			packed_class++;
+		struct block *copy = (struct block *)slab_alloc(&block_caches[packed_class]);
+		if (copy == NULL)
+			break;
+		copy->refs = 1;
+		copy->file_refs = 1;
+		copy->occupied = block->occupied;
+		copy->size = block->size;
+		copy->packed = packed;
+		copy->is_indexed = false;
+		copy->memory = (char *)(copy + 1);
+		memcpy(copy->memory, buffer, packed);
+		file->blocks[i] = copy;
+		slab_free(block);
+		__atomic_add_fetch(&file->packed_count, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&compression_stats.raw_bytes, copy->occupied, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&compression_stats.compressed_bytes, packed, __ATOMIC_RELAXED);
 	}
-	else
+}
+
+int
+inflate_file(struct file *file)
+{
+	int rc = 0;
+	lock_file(file, true);
+	// another open could decompress it meanwhile
+	for (int i = 0; i < file->block_count && file->packed_count > 0; i++)
 	{
-		while (f->next != NULL)
+		struct block *block = file->blocks[i];
+		if (block == NULL || block->packed == 0)
+			continue;
+		uint64_t start = now_ns();
+		struct block *raw = alloc_block(i);
+		if (raw == NULL)
 		{
-			f = f->next;
+			rc = -1;
+			break;
 		}
-		f->next = new_file;
-		new_file->prev = f;
+		// the data was compressed here, and can not be broken
+		lz_decompress(block->memory, block->packed, raw->memory, block->occupied);
+		raw->occupied = block->occupied;
+		file->blocks[i] = raw;
+		free_block(block);
+		__atomic_sub_fetch(&file->packed_count, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&compression_stats.decompressed_blocks, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&compression_stats.decompress_ns, now_ns() - start, __ATOMIC_RELAXED);
 	}
+	unlock_file(file);
+	return rc;
 }
 
-int
-get_fd()
+uint64_t
+now_ns(void)
 {
-	int fd = -1;
-	if (file_descriptors == NULL)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+now_ms(void)
+{
+	return now_ns() / 1000000;
+}
+
+struct block *
+dedup_block(struct file *file, int index)
+{
+	struct block *block = file->blocks[index];
+	uint64_t hash = hash_block_data(block->memory, block->size);
+	__atomic_add_fetch(&dedup_stats.hashed_bytes, block->size, __ATOMIC_RELAXED);
+	lock_dedup();
+	struct block *same = dedup_capacity == 0 ? NULL : dedup_table[hash & (dedup_capacity - 1)];
+	for (; same != NULL; same = same->dedup_next)
 	{
-		file_descriptor_capacity = 10;
-		file_descriptors = (struct filedesc **)malloc(file_descriptor_capacity * sizeof(struct filedesc *));
-		fd = 0;
+		if (same->hash != hash || same->size != block->size ||
+			memcmp(same->memory, block->memory, block->size) != 0)
+			continue;
+		// a block, which lost its last reference, is being freed
+		int refs = __atomic_load_n(&same->refs, __ATOMIC_ACQUIRE);
+		while (refs > 0 && !__atomic_compare_exchange_n(&same->refs, &refs, refs + 1, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+		if (refs > 0)
+			break;
 	}
-	else if (file_descriptor_count == file_descriptor_capacity)
+	if (same != NULL)
 	{
-		file_descriptor_capacity *= 2;
-		struct filedesc **new_fd_list = (struct filedesc **)malloc(file_descriptor_capacity * sizeof(struct filedesc *));
-		memcpy(new_fd_list, file_descriptors, file_descriptor_capacity / 2 * sizeof(struct filedesc *));
-		free(file_descriptors);
-		file_descriptors = new_fd_list;
-		fd = file_descriptor_count;
+		__atomic_add_fetch(&same->file_refs, 1, __ATOMIC_RELEASE);
+		unlock_dedup();
+		__atomic_add_fetch(&dedup_stats.deduped_bytes, block->size, __ATOMIC_RELAXED);
+		set_block(file, index, same);
+		drop_block(block);
+		return same;
 	}
-	else
+
+	// the table grows with the blocks, and stays as it is without
+	// memory
+	if (dedup_count >= dedup_capacity)
 	{
-		for (int i = 0; i < file_descriptor_capacity; i++)
+		uint32_t new_capacity = dedup_capacity == 0 ? 1024 : dedup_capacity * 2;
+		struct block **new_table = (struct block **)calloc(new_capacity, sizeof(struct block *));
+		if (new_table != NULL)
 		{
-			if (file_descriptors[i] == NULL)
+			for (uint32_t i = 0; i < dedup_capacity; i++)
 			{
-				fd = i;
-				break;
+				struct block *next;
+				for (struct block *b = dedup_table[i]; b != NULL; b = next)
+				{
+					next = b->dedup_next;
+					b->dedup_next = new_table[b->hash & (new_capacity - 1)];
+					new_table[b->hash & (new_capacity - 1)] = b;
+				}
 			}
+			free(dedup_table);
+			dedup_table = new_table;
+			dedup_capacity = new_capacity;
 		}
 	}
+	if (dedup_capacity > 0)
+	{
+		block->hash = hash;
+		block->is_indexed = true;
+		block->dedup_next = dedup_table[hash & (dedup_capacity - 1)];
+		dedup_table[hash & (dedup_capacity - 1)] = block;
+		dedup_count++;
+		__atomic_store_n(&dedup_stats.indexed_blocks, dedup_count, __ATOMIC_RELAXED);
+	}
+	unlock_dedup();
+	return block;
+}
 
-	file_descriptor_count++;
-	return fd;
+bool
+unindex_block(struct block *block)
+{
+	lock_dedup();
+	bool is_own = __atomic_load_n(&block->file_refs, __ATOMIC_ACQUIRE) == 1;
+	if (is_own)
+		remove_indexed_block(block);
+	unlock_dedup();
+	return is_own;
 }
 
-struct block *
-create_block(struct file *file)
+void
+remove_indexed_block(struct block *block)
 {
-	if (file == NULL)
+	struct block **link = &dedup_table[block->hash & (dedup_capacity - 1)];
+	while (*link != block)
+		link = &(*link)->dedup_next;
+	*link = block->dedup_next;
+	block->is_indexed = false;
+	dedup_count--;
+	__atomic_store_n(&dedup_stats.indexed_blocks, dedup_count, __ATOMIC_RELAXED);
+}
+
+uint64_t
+hash_block_data(const char *data, size_t size)
+{
+	// four independent lanes, so the multiplications overlap; the
+	// size is a multiple of the lanes width
+	const uint64_t prime = 0x9E3779B97F4A7C15ull;
+	uint64_t lanes[4] = {1, 2, 3, 4};
+	for (size_t i = 0; i < size; i += sizeof(lanes))
 	{
-		return NULL;
+		for (int j = 0; j < 4; j++)
+		{
+			uint64_t word;
+			memcpy(&word, data + i + j * sizeof(word), sizeof(word));
+			lanes[j] = (lanes[j] ^ word) * prime;
+			lanes[j] ^= lanes[j] >> 32;
+		}
 	}
-
-	struct block *new_block = (struct block *)malloc(sizeof(struct block));
-	new_block->memory = (char *)malloc(BLOCK_SIZE);
-	new_block->occupied = 0;
-	new_block->next = NULL;
-
-	if (file->last_block == NULL)
+	uint64_t hash = size;
+	for (int j = 0; j < 4; j++)
 	{
-		file->last_block = file->block_list = new_block;
+		hash = (hash ^ lanes[j]) * prime;
+		hash ^= hash >> 29;
 	}
-	else
+	return hash;
+}
+
+void
+lock_dedup(void)
+{
+	if (is_concurrent)
+		pthread_mutex_lock(&dedup_lock);
+}
+
+void
+unlock_dedup(void)
+{
+	if (is_concurrent)
+		pthread_mutex_unlock(&dedup_lock);
+}
+
+void *
+run_ring(void *arg)
+{
+	struct ufs_ring *ring = (struct ufs_ring *)arg;
+	pthread_mutex_lock(&ring->lock);
+	while (ring->cq_tail != ring->sq_tail)
 	{
-		file->last_block->next = new_block;
-		new_block->prev = file->last_block;
-		file->last_block = new_block;
+		unsigned index = ring->cq_tail;
+		unsigned end = ring->sq_tail;
+		pthread_mutex_unlock(&ring->lock);
+		// the results are published by runs, so the caller sees the
+		// first ones of a big batch early
+		index = run_ring_batch(ring, index, end);
+		pthread_mutex_lock(&ring->lock);
+		ring->cq_tail = index;
+		pthread_cond_broadcast(&ring->cond);
 	}
+	ring->is_running = false;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
 
-	return new_block;
+void
+join_ring_task(struct ufs_ring *ring)
+{
+	if (ring->task == NULL)
+		return;
+	void *result;
+	thread_task_join(ring->task, &result);
+	thread_task_delete(ring->task);
+	ring->task = NULL;
 }
 
 bool
-is_valid_fd(int fd)
+is_ring_op(enum ufs_op op)
+{
+	// the ops are numbered from 0 up to the last one
+	return (unsigned)op <= UFS_OP_PWRITE;
+}
+
+unsigned
+run_ring_batch(struct ufs_ring *ring, unsigned index, unsigned end)
 {
-	if (fd < 0 || fd >= file_descriptor_capacity)
+	struct ufs_sqe *sqe = &ring->sqes[index & ring->mask];
+	struct ufs_cqe *cqe = &ring->cqes[index & ring->mask];
+	cqe->user_data = sqe->user_data;
+	ufs_error_code = UFS_ERR_NO_ERR;
+	if (!is_ring_op(sqe->op))
 	{
-		return false;
+		cqe->result = -1;
+		cqe->error = UFS_ERR_INVALID_ARG;
+		return index + 1;
 	}
-
-	struct filedesc *filedesc = file_descriptors[fd];
-	if (filedesc == NULL || filedesc->file == NULL || filedesc->is_occupied == false)
+	if (sqe->op == UFS_OP_OPEN || sqe->op == UFS_OP_CLOSE)
 	{
-		return false;
+		cqe->result = sqe->op == UFS_OP_OPEN ? ufs_open(sqe->path, sqe->flags) : ufs_close(sqe->fd);
+		cqe->error = ufs_error_code;
+		return index + 1;
 	}
 
-	return true;
-}
+	// a run of reads or writes of one descriptor takes the checks
+	// and the locks once
+	bool is_write = sqe->op == UFS_OP_WRITE || sqe->op == UFS_OP_PWRITE;
+	int fd = sqe->fd;
+	unsigned run_end = index + 1;
+	while (run_end != end && run_end - index < RING_RUN_LIMIT)
+	{
+		struct ufs_sqe *next = &ring->sqes[run_end & ring->mask];
+		bool is_next_write = next->op == UFS_OP_WRITE || next->op == UFS_OP_PWRITE;
+		if (next->fd != fd || !is_ring_op(next->op) || next->op == UFS_OP_OPEN || next->op == UFS_OP_CLOSE ||
+			is_next_write != is_write)
+			break;
+		run_end++;
+	}
+	struct filedesc *filedesc = get_io_filedesc(fd, is_write);
+	if (filedesc == NULL)
+	{
+		for (; index != run_end; index++)
+		{
+			cqe = &ring->cqes[index & ring->mask];
+			cqe->user_data = ring->sqes[index & ring->mask].user_data;
+			cqe->result = -1;
+			cqe->error = ufs_error_code;
+		}
+		return run_end;
+	}
+	is_reclaim_asked = false;
+	if (is_write)
+		begin_change();
+	lock_file(filedesc->file, is_write);
+	for (; index != run_end && !is_reclaim_asked; index++)
+	{
+		sqe = &ring->sqes[index & ring->mask];
+		cqe = &ring->cqes[index & ring->mask];
+		struct iovec iov = {sqe->buf, sqe->size};
+		bool is_positional = sqe->op == UFS_OP_PREAD || sqe->op == UFS_OP_PWRITE;
+		const size_t *offset = is_positional ? &sqe->offset : NULL;
+		ufs_error_code = UFS_ERR_NO_ERR;
+		cqe->user_data = sqe->user_data;
+		cqe->result = is_write ? locked_write(filedesc, &iov, 1, offset) :
+			locked_read(filedesc, &iov, 1, offset);
+		cqe->error = ufs_error_code;
+	}
+	unlock_file(filedesc->file);
+	if (is_write)
+		end_change();
 
-void
-free_file_memory(struct file *file)
-{
-	struct block *block = file->block_list;
-	while (block != NULL)
+	// the last write ran out of the space, freed in the change; the
+	// run goes on from the next call after the rest of it is written
+	if (is_write && is_reclaim_asked)
 	{
-		struct block *copy = block;
-		block = block->next;
-		free(copy->memory);
-		free(copy);
+		sqe = &ring->sqes[(index - 1) & ring->mask];
+		cqe = &ring->cqes[(index - 1) & ring->mask];
+		struct iovec iov = {sqe->buf, sqe->size};
+		bool is_positional = sqe->op == UFS_OP_PWRITE;
+		cqe->result = rewrite_rest(filedesc, &iov, 1, is_positional ? &sqe->offset : NULL, cqe->result);
+		cqe->error = ufs_error_code;
 	}
-	free(file->name);
-	file->bytes_left = MAX_FILE_SIZE;
-	file->block_list = file->last_block = NULL;
+	return index;
 }
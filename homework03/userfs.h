@@ -1,6 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
@@ -68,21 +71,173 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_IO,
+	UFS_ERR_EXISTS,
+	UFS_ERR_NOT_EMPTY,
+	UFS_ERR_INVALID_ARG,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
 /**
- * Open a file by filename.
+ * Turn the concurrent mode on or off. In the concurrent mode the
+ * functions can be called from several threads at once. Each file
+ * has a read-write lock, so reads of one file go in parallel, and
+ * writes and resizes are serialized. Opens and creates lock only a
+ * part of a directory name table, and the descriptor table. Calls,
+ * which unlink or move names (deletes, renames, clones, removals of
+ * directories), lock the whole name space.
+ *
+ * The mode is off by default, and then no locks are taken at all.
+ * It should be switched when no other thread uses the FS.
+ *
+ * One descriptor should not be used by several threads at once,
+ * except by ufs_pread() and ufs_pwrite(), which don't change its
+ * position.
+ *
+ * @param is_enabled Whether the mode is on.
+ */
+void
+ufs_set_concurrent(bool is_enabled);
+
+/**
+ * Store the FS in an image file. If the file exists, the files,
+ * stored in it, are there right away. Their data is not read: the
+ * system loads the pages when they are touched. Otherwise the image
+ * is created of @a size bytes, which is a limit for all the data.
+ *
+ * The data goes right to the image memory, and the system writes
+ * it back. The metadata changes (sizes, blocks, creates, deletes)
+ * are journaled: ufs_sync() commits them, and many changes share
+ * one commit. After a crash the image is mounted as of the last
+ * commit, the changes after it are lost as a whole. The journal is
+ * checkpointed when it fills up. ufs_destroy() commits, flushes the
+ * image and closes it, keeping the files there. A file, deleted
+ * while open, is dropped from the image on the next mount.
+ *
+ * Should be called when there are no files yet. Names in a path
+ * are limited to 111 characters in this mode.
+ *
+ * @param path Image file path.
+ * @param size Size of a new image.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - the file can't be opened or mapped, or
+ *       is not an image.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mount(const char *path, size_t size);
+
+/**
+ * Make all the finished changes of the mounted files durable: the
+ * data and the metadata. Threads, which sync at once, share one
+ * flush. Without a mounted image it does nothing.
+ *
+ * The changes are also committed when they are many, and when
+ * freed space is needed. Space, freed by a change, is reused only
+ * after its commit.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image write failed, now or before. The
+ *       changes since the last successful sync can be lost.
+ */
+int
+ufs_sync(void);
+
+/**
+ * Turn the compression of cold files on or off. A file is cold,
+ * when it has no descriptors and was closed at least @a age_ms
+ * milliseconds ago. ufs_compress() compresses the blocks of the
+ * cold files with a built-in LZ4-like codec, each block into one
+ * of a smaller size, and the next ufs_open() decompresses the file
+ * back. Blocks, shared with clones, and data, which does not shrink
+ * at least twice, stay raw. Turning it off keeps the compressed
+ * files, they are decompressed on open as usual.
+ *
+ * The data of a mounted FS is in the image file and is not
+ * compressed.
+ */
+void
+ufs_set_compression(bool is_enabled, uint64_t age_ms);
+
+/**
+ * Compress the cold files, see ufs_set_compression(). Meant to be
+ * called from time to time, e.g. by a timer. It holds the name
+ * space shared till the end, so deletes and renames wait for it.
+ * Opens of a file wait only while the file is compressed.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_compress(void);
+
+/** Compression statistics, see ufs_compression_stats(). */
+struct ufs_compression_stats {
+	/** Size of the data, now kept compressed... */
+	uint64_t raw_bytes;
+	/** ...and its compressed size. */
+	uint64_t compressed_bytes;
+	/** How many blocks were decompressed on opens... */
+	uint64_t decompressed_blocks;
+	/** ...and how long it took in total. */
+	uint64_t decompress_ns;
+};
+
+/** Get the compression statistics. Reset by ufs_destroy(). */
+void
+ufs_compression_stats(struct ufs_compression_stats *stats);
+
+/**
+ * Turn the block deduplication on or off. When a write fills a
+ * block, its data is hashed and looked up in a content table. If a
+ * block with the same data is there, the file shares that one, and
+ * its own copy is freed. Otherwise the block is put to the table.
+ * A shared block is copied on the first change, like the blocks of
+ * clones. Files with equal content, like copies of one template or
+ * zero-filled ones, take the memory once.
+ *
+ * Only full blocks, filled by sequential writes, are hashed. It
+ * costs a pass over the data of each block, and a compare on a
+ * match. Turning it off keeps the shared blocks shared.
+ */
+void
+ufs_set_dedup(bool is_enabled);
+
+/** Deduplication statistics, see ufs_dedup_stats(). */
+struct ufs_dedup_stats {
+	/** Bytes of the hashed blocks... */
+	uint64_t hashed_bytes;
+	/** ...and of the ones, found in the table. */
+	uint64_t deduped_bytes;
+	/** How many blocks are in the table now. */
+	uint64_t indexed_blocks;
+};
+
+/** Get the deduplication statistics. Reset by ufs_destroy(). */
+void
+ufs_dedup_stats(struct ufs_dedup_stats *stats);
+
+/**
+ * Open a file by filename. The name is a path of directories,
+ * split by '/', from the root; the leading '/' can be omitted.
+ * The directories of a path are found in a cache, so the depth of
+ * a path does not matter much.
  * @param filename Name of a file to open.
  * @param flags Bitwise combination of open_flags.
  *
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no such directory.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the name does not
+ *       fit into the image, see ufs_mount().
+ *     - UFS_ERR_NO_PERMISSION - the path is a directory.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -115,6 +270,136 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data from several buffers to the file, as one ufs_write()
+ * of them concatenated.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Size of @a iov.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data from the file into several buffers, filling them one
+ * by one, as one ufs_read() would do.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Size of @a iov.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write data to the file at the given offset. The descriptor
+ * position is not used and not changed. If the offset is behind
+ * the file end, the gap becomes a hole, which reads as zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Where to write in the file.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * position is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Where to read in the file.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Find data in the file at or after the given offset. A file
+ * consists of data and holes: ranges, which were never written
+ * after a resize or a write behind the end. Holes take no memory
+ * and read as zeros. The descriptor position is not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Where to start the search.
+ *
+ * @retval >= 0 Offset of the data, or the file size if there is
+ *     no data after @a offset.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_seek_data(int fd, size_t offset);
+
+/**
+ * Find a hole in the file at or after the given offset, see
+ * ufs_seek_data(). The file end counts as a hole.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Where to start the search.
+ *
+ * @retval >= 0 Offset of the hole, or the file size if there is
+ *     no hole after @a offset.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_seek_hole(int fd, size_t offset);
+
+/**
+ * Read data from the file without copying. Instead of filling a
+ * buffer, @a out is filled with pointers right into the file
+ * memory, and the position moves on as after ufs_read().
+ *
+ * The viewed memory is pinned: it stays valid even if the file is
+ * truncated or deleted, until ufs_view_release() or ufs_close()
+ * on the same descriptor. Writes into the same range of the file
+ * are visible through the view, unless the memory is shared with
+ * a clone, see ufs_clone(), and so is copied on the write.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to view.
+ * @param out Array to fill with the views.
+ * @param max Size of @a out.
+ *
+ * @retval > 0 How many elements of @a out are filled.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory to pin the data.
+ */
+int
+ufs_readv_view(int fd, size_t size, struct iovec *out, int max);
+
+/**
+ * Release all the views, taken via the descriptor by
+ * ufs_readv_view(). Their memory should not be used after that.
+ * @param fd File descriptor from ufs_open().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int
+ufs_view_release(int fd);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -136,19 +421,217 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_NO_PERMISSION - the path is a directory, see
+ *       ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create an empty directory. Its parent should exist.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_EXISTS - a file or a directory with the path
+ *       exists.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the name does not
+ *       fit into the image.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Remove an empty directory.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NO_PERMISSION - the path is a file.
+ *     - UFS_ERR_NOT_EMPTY - the directory has files.
+ */
+int
+ufs_rmdir(const char *path);
+
+/**
+ * Move a file or a directory to a new path. A file at the new path
+ * is replaced, as by ufs_delete(). The open descriptors stay valid,
+ * and the files in a moved directory move with it.
+ *
+ * @param old_path Path of a file or a directory.
+ * @param new_path Its new path.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file, or no new parent directory.
+ *     - UFS_ERR_EXISTS - a directory is at the new path, or a file
+ *       is there, and a directory is moved.
+ *     - UFS_ERR_NO_PERMISSION - a directory is moved into itself.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the name does not
+ *       fit into the image.
+ */
+int
+ufs_rename(const char *old_path, const char *new_path);
+
+/** An entry of a directory, see ufs_readdir(). */
+struct ufs_dirent {
+	/** Name in the directory, valid during the callback. */
+	const char *name;
+	bool is_dir;
+};
+
+/**
+ * Directory listing callback.
+ * @retval 0 Go on.
+ * @retval Not 0 Stop the listing.
+ */
+typedef int
+(*ufs_readdir_f)(const struct ufs_dirent *entry, void *ctx);
+
+/**
+ * Call @a cb for each entry of the directory, in no particular
+ * order. It takes time by the size of the directory, not of the
+ * FS. The callback should not change the FS.
+ *
+ * @param path Path of the directory, "" or "/" is the root.
+ * @param cb Callback.
+ * @param ctx Callback argument.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ */
+int
+ufs_readdir(const char *path, ufs_readdir_f cb, void *ctx);
+
+/**
+ * Create a file @a dst as a copy of the file @a src. If @a dst
+ * exists, it is deleted first, as by ufs_delete(). The copy shares
+ * all the data with the source, and a block of it is copied only
+ * when one of the files changes the block. So a clone costs a few
+ * bytes per block, and then memory grows only by changed blocks.
+ *
+ * @param src Name of a file to copy.
+ * @param dst Name of the copy.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src, or no directory of
+ *       @a dst.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_NO_PERMISSION - @a src or @a dst is a directory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Asynchronous interface in the spirit of io_uring. A caller takes
+ * entries of the submission ring with ufs_ring_get_sqe(), fills
+ * them, and submits them at once with ufs_ring_submit(). Results
+ * come to the completion ring and are taken by ufs_ring_reap().
+ *
+ * In the concurrent mode the submitted entries are run by a worker
+ * of a background thread pool, and the caller can do other work
+ * meanwhile. Otherwise ufs_ring_submit() runs them right away.
+ * Either way the entries of one ring are run in order, one batch
+ * at a time. Consecutive reads or writes of one descriptor in a
+ * batch check the descriptor and lock the file once.
+ *
+ * A ring is used by one thread at a time, but several rings can be
+ * used by different threads at once.
+ */
+struct ufs_ring;
+
+enum ufs_op {
+	/** ufs_open(path, flags). */
+	UFS_OP_OPEN,
+	/** ufs_close(fd). */
+	UFS_OP_CLOSE,
+	/** ufs_read(fd, buf, size). */
+	UFS_OP_READ,
+	/** ufs_write(fd, buf, size). */
+	UFS_OP_WRITE,
+	/** ufs_pread(fd, buf, size, offset). */
+	UFS_OP_PREAD,
+	/** ufs_pwrite(fd, buf, size, offset). */
+	UFS_OP_PWRITE,
+};
+
+/** Submission queue entry, arguments of one call. */
+struct ufs_sqe {
+	enum ufs_op op;
+	int fd;
+	const char *path;
+	int flags;
+	void *buf;
+	size_t size;
+	size_t offset;
+	/** Passed to the completion as is. */
+	uint64_t user_data;
+};
+
+/** Completion queue entry, the result of one call. */
+struct ufs_cqe {
+	uint64_t user_data;
+	/** What the call returns: a descriptor, a size, 0 or -1. */
+	ssize_t result;
+	/**
+	 * ufs_errno() of the call, when the result is -1.
+	 * UFS_ERR_INVALID_ARG for an unknown op.
+	 */
+	enum ufs_error_code error;
+};
+
+/**
+ * Create a ring of @a entries entries, rounded up to a power of 2.
+ * That many calls can be submitted and not reaped at once.
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory, or @a entries is 0.
+ */
+struct ufs_ring *
+ufs_ring_new(unsigned entries);
+
+/**
+ * Wait for the submitted calls, and delete the ring. Descriptors,
+ * opened through it, stay open.
+ */
+void
+ufs_ring_delete(struct ufs_ring *ring);
+
+/**
+ * Take a free submission entry to fill.
+ * @retval NULL The ring is full: the calls are to be submitted and
+ *     reaped first.
+ */
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring);
+
+/**
+ * Submit all the entries, taken since the last submit.
+ * @return How many entries are submitted.
+ */
+int
+ufs_ring_submit(struct ufs_ring *ring);
+
+/**
+ * Take up to @a count completions in the order of submission.
+ * Waits, until at least @a wait_count of them are ready, 0 does
+ * not wait.
+ * @return How many completions are taken.
+ */
+int
+ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count,
+	      int wait_count);
+
 #ifdef NEED_RESIZE
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
- * changed. If the current size is bigger than @a new_size, then
- * the blocks are truncated. Opened file descriptors behind the
- * new file size should proceed from the new file end.
+ * file size is less than @a new_size, then the file grows with a
+ * hole, which reads as zeros and takes no memory until written,
+ * and positions of opened file descriptors are not changed. If
+ * the current size is bigger than @a new_size, then the blocks
+ * are truncated. Opened file descriptors behind the new file size
+ * should proceed from the new file end.
  *
  * @param fd File descriptor from ufs_open().
  * @param new_size New file size.
@@ -157,8 +640,9 @@ ufs_delete(const char *filename);
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
  *     - UFS_ERR_NO_PERMISSION - descriptor should have been opened with
  *       UFS_WRITE_ONLY or UFS_READ_WRITE permissions.
- *     - UFS_ERR_NO_MEM - not enough memory. Can appear only when
- *       @a new_size is bigger than the current size.
+ *     - UFS_ERR_NO_MEM - not enough memory. Can appear when
+ *       @a new_size is bigger than the current size, or when the
+ *       file shares its data with a clone.
  */
 int
 ufs_resize(int fd, size_t new_size);
@@ -169,6 +653,8 @@ ufs_resize(int fd, size_t new_size);
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * If the FS is mounted, the image is flushed and closed, and the files stay
+ * there.
  */
 void
 ufs_destroy(void);
@@ -172,6 +172,8 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
 	if (pool->active_threads_cnt == pool->threads_cnt && pool->threads_cnt < pool->max_threads_cnt)
 	{
 		pthread_create(&pool->threads[pool->threads_cnt], NULL, thread_pool_worker, pool);
+		/* Nobody joins the workers, the delete waits for the count. */
+		pthread_detach(pool->threads[pool->threads_cnt]);
 		pool->threads_cnt++;
 	}
 
@@ -200,6 +202,11 @@ int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
 {
 	struct thread_task *new_task = (struct thread_task*) malloc(sizeof(struct thread_task));
+	if (new_task == NULL)
+	{
+		*task = NULL;
+		return TPOOL_ERR_NO_MEM;
+	}
 
 	new_task->function = function;
 	new_task->arg = arg;
@@ -255,7 +262,7 @@ thread_task_join(struct thread_task *task, void **result)
 
 	tp_task->is_joined = true;
 
-	if (!tp_task->is_finished)
+	while (!tp_task->is_finished)
 	{
 		pthread_cond_wait(&(tp_task->end_cond), &pool->mutex);
 	}
@@ -319,7 +326,10 @@ thread_pool_worker(void *arg)
 		{
 			delete_task(tp_task->thread_task);
 		}
-		pthread_cond_signal(&tp_task->end_cond);
+		else
+		{
+			pthread_cond_signal(&tp_task->end_cond);
+		}
 		pthread_mutex_unlock(&pool->mutex);
 	}
 
@@ -357,8 +367,22 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 		struct timespec timestamp;
 		timestamp.tv_sec = (long long)timeout;
 		timestamp.tv_nsec = (long)((timeout - timestamp.tv_sec) * (long)1e9);
-		
+
+#ifdef __APPLE__
 		int retval = pthread_cond_timedwait_relative_np(&tp_task->end_cond, &pool->mutex, &timestamp);
+#else
+		// other systems take an absolute deadline
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		timestamp.tv_sec += now.tv_sec;
+		timestamp.tv_nsec += now.tv_nsec;
+		if (timestamp.tv_nsec >= (long)1e9)
+		{
+			timestamp.tv_sec++;
+			timestamp.tv_nsec -= (long)1e9;
+		}
+		int retval = pthread_cond_timedwait(&tp_task->end_cond, &pool->mutex, &timestamp);
+#endif
 		if (retval == ETIMEDOUT)
 		{
 			pthread_mutex_unlock(&pool->mutex);
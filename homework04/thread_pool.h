@@ -37,6 +37,7 @@ enum thread_poool_errcode {
 	TPOOL_ERR_TASK_IN_POOL,
 	TPOOL_ERR_NOT_IMPLEMENTED,
 	TPOOL_ERR_TIMEOUT,
+	TPOOL_ERR_NO_MEM,
 };
 
 /** Thread pool API. */
@@ -95,7 +96,9 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
  * @param function Function to run by this task.
  * @param arg Argument for @a function.
  *
- * @retval Always 0.
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NO_MEM - not enough memory, @a task is NULL.
  */
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);